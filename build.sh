@@ -34,52 +34,93 @@ export LIBRARY_PATH="/usr/local/lib/:${LIBRARY_PATH}"
 
 echo '#include <sodium/crypto_box_curve25519xsalsa20poly1305.h>' > tmp/libtest1.c
 echo '#include <nacl/crypto_box_curve25519xsalsa20poly1305.h>' > tmp/libtest2.c
-if [ "$1" = "debian" ] || $cc -shared -lsodium tmp/libtest1.c -o tmp/libtest 2>/dev/null; then
+if [ "$1" = "debian" ] || { [ -z "$CRYPTO" -o "$CRYPTO" = "sodium" ] && $cc -shared -lsodium tmp/libtest1.c -o tmp/libtest 2>/dev/null; }; then
 	echo Using shared libsodium.
+	crypto="libsodium"
 	echo '#include <sodium/crypto_box_curve25519xsalsa20poly1305.h>' > tmp/include/crypto_box_curve25519xsalsa20poly1305.h
 	echo '#include <sodium/crypto_scalarmult_curve25519.h>' > tmp/include/crypto_scalarmult_curve25519.h
+	echo '#include <sodium/crypto_core_hsalsa20.h>' > tmp/include/crypto_core_hsalsa20.h
+	echo '#include <sodium/crypto_stream_salsa20.h>' > tmp/include/crypto_stream_salsa20.h
+	echo '#include <sodium/crypto_onetimeauth_poly1305.h>' > tmp/include/crypto_onetimeauth_poly1305.h
 	export CPATH="./tmp/include/:${CPATH}"
 	export CRYPTLIB="-lsodium"
-elif $cc -shared -lnacl tmp/libtest2.c -o tmp/libtest 2>/dev/null; then
+elif [ -z "$CRYPTO" -o "$CRYPTO" = "nacl" ] && $cc -shared -lnacl tmp/libtest2.c -o tmp/libtest 2>/dev/null; then
 	echo Using shared libnacl.
+	crypto="libnacl"
 	echo '#include <nacl/crypto_box_curve25519xsalsa20poly1305.h>' > tmp/include/crypto_box_curve25519xsalsa20poly1305.h
 	echo '#include <nacl/crypto_scalarmult_curve25519.h>' > tmp/include/crypto_scalarmult_curve25519.h
+	echo '#include <nacl/crypto_core_hsalsa20.h>' > tmp/include/crypto_core_hsalsa20.h
+	echo '#include <nacl/crypto_stream_salsa20.h>' > tmp/include/crypto_stream_salsa20.h
+	echo '#include <nacl/crypto_onetimeauth_poly1305.h>' > tmp/include/crypto_onetimeauth_poly1305.h
 	export CPATH="./tmp/include/:${CPATH}"
 	export CRYPTLIB="-lnacl"
-else
+elif [ -z "$CRYPTO" -o "$CRYPTO" = "tweetnacl" ]; then
 	echo Building TweetNaCl...
+	crypto="TweetNaCl"
 	echo 'The TweetNaCl cryptography library is not optimized for performance. Please install libsodium or libnacl before building QuickTun for best performance.'
 	$cc $CFLAGS -c src/tweetnacl.c -o obj/tweetnacl.o
 	$cc $CFLAGS -c src/randombytes.c -o obj/randombytes.o
 	echo '#include <src/tweetnacl.h>' > tmp/include/crypto_box_curve25519xsalsa20poly1305.h
 	echo '#include <src/tweetnacl.h>' > tmp/include/crypto_scalarmult_curve25519.h
+	echo '#include <src/tweetnacl.h>' > tmp/include/crypto_core_hsalsa20.h
+	echo '#include <src/tweetnacl.h>' > tmp/include/crypto_stream_salsa20.h
+	echo '#include <src/tweetnacl.h>' > tmp/include/crypto_onetimeauth_poly1305.h
 	export CPATH="./tmp/include/:${CPATH}"
 	export CRYPTLIB="obj/randombytes.o obj/tweetnacl.o"
+else
+	echo "Crypto library $CRYPTO not found, use sodium, nacl or tweetnacl"
+	exit 1
+fi
+
+if [ "$NODEBUG" = "1" ]; then
+	echo Compiling out debug logging.
+	CFLAGS="$CFLAGS -DQT_NODEBUG"
+fi
+
+if [ "$LATENCY" = "1" ]; then
+	echo Timing event loop stages.
+	CFLAGS="$CFLAGS -DQT_LATENCY"
+fi
+
+echo '#include <sys/sdt.h>' > tmp/sdttest.c
+if [ "$USDT" != "0" ] && $cc $CFLAGS -c tmp/sdttest.c -o tmp/sdttest.o 2>/dev/null; then
+	echo Enabling USDT probes.
+	CFLAGS="$CFLAGS -DHAVE_SYS_SDT_H"
 fi
 
 CFLAGS="$CFLAGS -DQT_VERSION=\"`cat version`\""
+LDFLAGS="$LDFLAGS -lpthread"
 
 echo Building combined binary...
 $cc $CFLAGS -c -DCOMBINED_BINARY	src/proto.raw.c		-o obj/proto.raw.o
 $cc $CFLAGS -c -DCOMBINED_BINARY	src/proto.nacl0.c	-o obj/proto.nacl0.o
 $cc $CFLAGS -c -DCOMBINED_BINARY	src/proto.nacltai.c	-o obj/proto.nacltai.o
+$cc $CFLAGS -c -DCOMBINED_BINARY	src/proto.nacltai2.c	-o obj/proto.nacltai2.o
 $cc $CFLAGS -c -DCOMBINED_BINARY	src/proto.salty.c	-o obj/proto.salty.o
 $cc $CFLAGS -c -DCOMBINED_BINARY	src/run.combined.c	-o obj/run.combined.o
 $cc $CFLAGS -c				src/common.c		-o obj/common.o
-$cc $CFLAGS -o out/quicktun.combined obj/common.o obj/run.combined.o obj/proto.raw.o obj/proto.nacl0.o obj/proto.nacltai.o obj/proto.salty.o $CRYPTLIB $LDFLAGS
+$cc $CFLAGS -o out/quicktun.combined obj/common.o obj/run.combined.o obj/proto.raw.o obj/proto.nacl0.o obj/proto.nacltai.o obj/proto.nacltai2.o obj/proto.salty.o $CRYPTLIB $LDFLAGS
 ln out/quicktun.combined out/quicktun
 
+echo Building benchmark...
+$cc $CFLAGS -c -DCOMBINED_BINARY -DQT_CRYPTO="\"$crypto\""	src/bench.c	-o obj/bench.o
+$cc $CFLAGS -o out/quicktun.bench obj/common.o obj/bench.o obj/proto.raw.o obj/proto.nacl0.o obj/proto.nacltai.o obj/proto.nacltai2.o obj/proto.salty.o $CRYPTLIB $LDFLAGS
+
 echo Building single protocol binaries...
 $cc $CFLAGS -o out/quicktun.raw		src/proto.raw.c				$LDFLAGS
 $cc $CFLAGS -o out/quicktun.nacl0	src/proto.nacl0.c	$CRYPTLIB	$LDFLAGS
 $cc $CFLAGS -o out/quicktun.nacltai	src/proto.nacltai.c	$CRYPTLIB	$LDFLAGS
+$cc $CFLAGS -o out/quicktun.nacltai2	src/proto.nacltai2.c	$CRYPTLIB	$LDFLAGS
 $cc $CFLAGS -o out/quicktun.salty	src/proto.salty.c	$CRYPTLIB	$LDFLAGS
 $cc $CFLAGS -o out/quicktun.keypair	src/keypair.c		$CRYPTLIB	$LDFLAGS
+$cc $CFLAGS -o out/quicktun.peerdb	src/peerdb.c		$CRYPTLIB	$LDFLAGS
+$cc $CFLAGS -o out/quicktun.stat	src/stat.c				$LDFLAGS
+$cc $CFLAGS -o out/quicktun.capture	src/capture.c				$LDFLAGS
 
 if [ -f /etc/network/interfaces -o "$1" = "debian" ]; then
 	echo Building debian binary...
 	$cc $CFLAGS -c -DCOMBINED_BINARY -DDEBIAN_BINARY src/run.combined.c -o obj/run.debian.o
-	$cc $CFLAGS -o out/quicktun.debian obj/common.o obj/run.debian.o obj/proto.raw.o obj/proto.nacl0.o obj/proto.nacltai.o obj/proto.salty.o $CRYPTLIB $LDFLAGS
+	$cc $CFLAGS -o out/quicktun.debian obj/common.o obj/run.debian.o obj/proto.raw.o obj/proto.nacl0.o obj/proto.nacltai.o obj/proto.nacltai2.o obj/proto.salty.o $CRYPTLIB $LDFLAGS
 	if [ "$1" != "debian" -a -x /usr/bin/dpkg-deb -a -x /usr/bin/fakeroot ]; then
 		echo -n Building debian package...
 		cd deb
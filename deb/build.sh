@@ -13,8 +13,12 @@ fi
 cp ../out/quicktun.raw data/usr/sbin/
 cp ../out/quicktun.nacl0 data/usr/sbin/
 cp ../out/quicktun.nacltai data/usr/sbin/
+cp ../out/quicktun.nacltai2 data/usr/sbin/
 cp ../out/quicktun.debian data/usr/sbin/
 cp ../out/quicktun.keypair data/usr/sbin/
+cp ../out/quicktun.peerdb data/usr/sbin/
+cp ../out/quicktun.stat data/usr/sbin/
+cp ../out/quicktun.capture data/usr/sbin/
 cp ../out/quicktun data/usr/sbin/
 fakeroot dpkg-deb --build data quicktun-${VERSION}_${ARCH}.deb
 mv quicktun*.deb ../out/
@@ -0,0 +1,970 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Microbenchmark of the protocols without a device or socket (quicktun.bench).
+Every thread drives a pair of sessions of a protocol, set up with fresh keys as the two ends of a tunnel. Control packets (the key exchange of salty) are passed between the two until both ends can encode data packets.
+One end encodes a batch of packets of the same size, the other end decodes them. For every protocol, packet size, batch size and number of threads this reports the time to encode and to decode a packet, the payload throughput of all threads together and the time stamp counter cycles per payload byte (x86 only).
+It uses the crypto library that build.sh selected, which can be chosen with CRYPTO=sodium, nacl or tweetnacl. Build with optimization (CFLAGS=-O2) for meaningful numbers.
+Protocol settings such as PRECOMPUTE are taken from the environment, but the idle time work of the event loop is not done.
+The clock of the sessions is read once per batch, like the event loop does once per wakeup. With -c every cell is also run with the clock read before every packet is encoded or decoded, the cost of calling clock_gettime from the protocols for every packet.
+
+With -l the whole datapath is measured instead, without root or /dev/net/tun. For every protocol a child process runs the two ends as tunnels of one event loop (qtrunmulti), each with a socketpair as its tun device (DEVICE=fd), and connected to each other by a third socketpair (TRANSPORT=fd).
+The parent writes packets into the device of one end and reads them back from the device of the other end, keeping up to the window (-b) of packets in flight. It reports the packet rate, the payload throughput and the latency from write to read. Packets that do not arrive within 100 milliseconds are counted as lost.
+With -u the two ends are connected over UDP on the loopback interface instead (-u fd,sendto,send), to compare sendto() with write() on a socket connected to the remote endpoint (REMOTE_CONNECT).
+With -f the parent also sends forged datagrams at the given rates to the second end, shaped as salty control packets with the highest timestamp so that salty has to rate limit them (CONTROL_RATE). On the fd transport they come in through the transport of the first end, like datagrams spoofing the address of the peer; over UDP they come from a different address in 127.0.0.0/8 every time.
+The tunnels are started again for every rate with the flood already on, and the time until packets got through (ready ms) shows whether the handshake completes under it. Next to the data rates this reports the datagrams that the second end dropped, and how many of those exceeded the rate limit.
+
+With -e epochbox (epochbox.c) is compared with crypto_box and crypto_box_afternm, after checking that it gives the same output and opens what crypto_box_afternm seals.
+
+With -r the rekey spreading of salty is simulated with many sessions (-n, 5000 by default) that start at the same time: once in lockstep, once with REKEY_JITTER at 10% of REKEY_INTERVAL (60 seconds by default) and once with a REKEY_RATE of twice the average rate as well. It reports the key updates and the CPU time per simulated second.
+*/
+
+#include "common.c"
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "epochbox.c"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef QT_CRYPTO
+	#define QT_CRYPTO "unknown"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define benchticks() __rdtsc()
+	#define BENCH_CYCLES 1
+#else
+	static inline uint64_t benchticks() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	#define BENCH_CYCLES 0
+#endif
+
+extern struct qtproto qtproto_raw;
+extern struct qtproto qtproto_nacl0;
+extern struct qtproto qtproto_nacltai;
+extern struct qtproto qtproto_nacltai2;
+extern struct qtproto qtproto_salty;
+
+static const struct {
+	const char* name;
+	struct qtproto* proto;
+} benchprotocols[] = {
+	{ "raw", &qtproto_raw },
+	{ "nacl0", &qtproto_nacl0 },
+	{ "nacltai", &qtproto_nacltai },
+	{ "nacltai2", &qtproto_nacltai2 },
+	{ "salty", &qtproto_salty },
+};
+
+#define BENCH_MAXLIST 32
+#define BENCH_QUEUE 16
+#define BENCH_SLACK 128 //room for the protocol overhead in a buffer
+
+//The two ends of a tunnel, sessions[0] encodes and sessions[1] decodes
+struct benchpair {
+	struct qtsession sessions[2];
+	struct qtstats stats[2];
+	struct qtclock clock;
+	char keys[2][2][65]; //private and public key of each end, in hex
+	char* queue[2][BENCH_QUEUE]; //control packets for each end
+	int queuelen[2][BENCH_QUEUE];
+	int queued[2];
+	char* raw; //batch buffers of rawstride bytes
+	char* enc; //batch buffers of encstride bytes
+	char* out;
+	int* lens;
+	int rawstride, encstride;
+	int size, batch;
+	uint64_t packets, errors, enctime, dectime;
+	pthread_t thread;
+};
+
+static struct benchpair* benchpairs = NULL;
+static int benchside = 0; //the end being initialized, for benchconf
+static struct benchpair* benchconfpair = NULL;
+static volatile bool benchstop = false;
+static bool benchclockperpacket = false; //read the clock for every packet instead of once per batch, as the event loop does per wakeup
+
+static char* benchconf(const char* name) {
+	if (!strcmp(name, "PRIVATE_KEY")) return benchconfpair->keys[benchside][0];
+	if (!strcmp(name, "PUBLIC_KEY")) return benchconfpair->keys[!benchside][1];
+	if (!strcmp(name, "PRIVATE_KEY_FILE") || !strcmp(name, "SHARED_KEY")) return NULL;
+	if (!strcmp(name, "TIME_WINDOW") && !getenv(name)) return "60";
+	return getenv(name);
+}
+
+static void benchhex(char* out, const unsigned char* in, int len) {
+	int i;
+	for (i = 0; i < len; i++) sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+static void benchclock(struct benchpair* b) {
+	clock_gettime(QT_CLOCK_MONOTONIC, &b->clock.monotonic);
+	clock_gettime(CLOCK_REALTIME, &b->clock.realtime);
+}
+
+//Queue a control packet for the other end of the pair, the session id is twice the index of the pair plus the end
+static void benchsend(struct qtsession* sess, char* msg, int len) {
+	struct benchpair* b = &benchpairs[sess->id / 2];
+	int to = !(sess->id & 1);
+	if (b->queued[to] >= BENCH_QUEUE || len > MAX_PACKET_LEN + BENCH_SLACK) return;
+	memcpy(b->queue[to][b->queued[to]] + sess->protocol.offset_enc, msg, len);
+	b->queuelen[to][b->queued[to]++] = len;
+}
+
+static void benchdeliver(struct benchpair* b) {
+	int side, i;
+	for (side = 0; side < 2; side++) {
+		struct qtsession* s = &b->sessions[side];
+		//Decoding may queue replies, which are delivered on the next call
+		int count = b->queued[side];
+		b->queued[side] = 0;
+		for (i = 0; i < count; i++) s->protocol.decode(s, b->queue[side][i], b->out, b->queuelen[side][i]);
+	}
+}
+
+//Encode a packet at one end and check that the other end decodes it
+static bool benchroundtrip(struct benchpair* b, int from, int size) {
+	struct qtsession* s = &b->sessions[from];
+	struct qtsession* d = &b->sessions[!from];
+	int i, len;
+	for (i = 0; i < size; i++) b->raw[s->protocol.offset_raw + i] = i * 7;
+	len = s->protocol.encode(s, b->raw, b->enc, size);
+	if (len <= 0) return false;
+	if (d->protocol.decode(d, b->enc, b->out, len) != size) return false;
+	return !memcmp(b->raw + s->protocol.offset_raw, b->out + d->protocol.offset_raw, size);
+}
+
+static int benchsetup(struct benchpair* b, int index, struct qtproto* p, int maxsize, int maxbatch) {
+	unsigned char publickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
+	unsigned char secretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	int side, i;
+	//Buffers of a previous protocol
+	free(b->raw);
+	free(b->enc);
+	free(b->out);
+	free(b->lens);
+	for (side = 0; side < 2; side++) for (i = 0; i < BENCH_QUEUE; i++) free(b->queue[side][i]);
+	memset(b, 0, sizeof(*b));
+	b->rawstride = (p->offset_raw + maxsize + BENCH_SLACK + 63) & ~63;
+	b->encstride = (p->offset_enc + maxsize + BENCH_SLACK + 63) & ~63;
+	b->raw = calloc(maxbatch, b->rawstride);
+	b->enc = calloc(maxbatch, b->encstride);
+	b->out = calloc(1, b->rawstride);
+	b->lens = calloc(maxbatch, sizeof(int));
+	if (!b->raw || !b->enc || !b->out || !b->lens) return errorexit("Out of memory");
+	for (side = 0; side < 2; side++) {
+		for (i = 0; i < BENCH_QUEUE; i++) if (!(b->queue[side][i] = calloc(1, MAX_PACKET_LEN + 2 * BENCH_SLACK))) return errorexit("Out of memory");
+		crypto_box_curve25519xsalsa20poly1305_keypair(publickey, secretkey);
+		benchhex(b->keys[side][0], secretkey, sizeof(secretkey));
+		benchhex(b->keys[side][1], publickey, sizeof(publickey));
+	}
+	benchclock(b);
+	benchconfpair = b;
+	for (side = 0; side < 2; side++) {
+		struct qtsession* s = &b->sessions[side];
+		s->protocol = *p;
+		s->id = index * 2 + side;
+		s->fd_socket = s->fd_dev = s->fd_peer = s->fd_protocol = -1;
+		s->poll_timeout = -1;
+		s->clock = &b->clock;
+		s->stats = &b->stats[side];
+		s->sendnetworkpacket = benchsend;
+		s->protocol_data = calloc(1, p->protocol_data_size ? p->protocol_data_size : 1);
+		if (!s->protocol_data) return errorexit("Could not allocate protocol data");
+		benchside = side;
+		if (p->init && p->init(s) < 0) return -1;
+	}
+	//Pass control packets and protocol events until data packets get through in both directions, for up to 5 seconds
+	for (i = 0; i < 500; i++) {
+		struct pollfd fds[2];
+		benchclock(b);
+		benchdeliver(b);
+		for (side = 0; side < 2; side++) {
+			fds[side].fd = b->sessions[side].fd_protocol;
+			fds[side].events = POLLIN;
+			fds[side].revents = 0;
+		}
+		if (poll(fds, 2, 10) > 0) for (side = 0; side < 2; side++) if (fds[side].revents & POLLIN) b->sessions[side].protocol_event(&b->sessions[side]);
+		benchdeliver(b);
+		if (benchroundtrip(b, 0, 64) && benchroundtrip(b, 1, 64)) return 0;
+	}
+	return errorexit("The sessions did not become ready");
+}
+
+static void* benchthread(void* arg) {
+	struct benchpair* b = (struct benchpair*)arg;
+	struct qtsession* s = &b->sessions[0];
+	struct qtsession* d = &b->sessions[1];
+	struct qtproto* p = &s->protocol;
+	int i;
+	while (!benchstop) {
+		benchclock(b);
+		uint64_t start = benchticks();
+		for (i = 0; i < b->batch; i++) {
+			if (benchclockperpacket) benchclock(b);
+			b->lens[i] = p->encode(s, b->raw + i * b->rawstride, b->enc + i * b->encstride, b->size);
+		}
+		uint64_t encoded = benchticks();
+		for (i = 0; i < b->batch; i++) {
+			if (benchclockperpacket) benchclock(b);
+			if (b->lens[i] <= 0 || p->decode(d, b->enc + i * b->encstride, b->out, b->lens[i]) != b->size) b->errors++;
+		}
+		uint64_t decoded = benchticks();
+		b->enctime += encoded - start;
+		b->dectime += decoded - encoded;
+		b->packets += b->batch;
+		if (b->queued[0] || b->queued[1]) benchdeliver(b);
+	}
+	return NULL;
+}
+
+//Run threads pairs for duration milliseconds
+static int benchcell(const char* name, int threads, int size, int batch, int duration) {
+	struct timespec startts, endts, delay = { duration / 1000, (duration % 1000) * 1000000 };
+	uint64_t packets = 0, errors = 0, enctime = 0, dectime = 0;
+	int i, j;
+	for (i = 0; i < threads; i++) {
+		struct benchpair* b = &benchpairs[i];
+		b->size = size;
+		b->batch = batch;
+		b->packets = b->errors = b->enctime = b->dectime = 0;
+		if (!benchroundtrip(b, 0, size)) {
+			printf("%-10s %6s %6d %6d %7d  round trip failed\n", name, benchclockperpacket ? "packet" : "batch", size, batch, threads);
+			return -1;
+		}
+		for (j = 0; j < batch; j++) memcpy(b->raw + j * b->rawstride, b->raw, b->rawstride);
+	}
+	benchstop = false;
+	clock_gettime(CLOCK_MONOTONIC, &startts);
+	uint64_t startticks = benchticks();
+	for (i = 0; i < threads; i++) if (pthread_create(&benchpairs[i].thread, NULL, benchthread, &benchpairs[i])) return errorexit("Could not start thread");
+	nanosleep(&delay, NULL);
+	benchstop = true;
+	for (i = 0; i < threads; i++) {
+		pthread_join(benchpairs[i].thread, NULL);
+		packets += benchpairs[i].packets;
+		errors += benchpairs[i].errors;
+		enctime += benchpairs[i].enctime;
+		dectime += benchpairs[i].dectime;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &endts);
+	uint64_t ticks = benchticks() - startticks;
+	double seconds = (endts.tv_sec - startts.tv_sec) + (endts.tv_nsec - startts.tv_nsec) / 1e9;
+	double nspertick = seconds * 1e9 / ticks;
+	printf("%-10s %6s %6d %6d %7d %12.1f %12.1f %10.3f", name, benchclockperpacket ? "packet" : "batch", size, batch, threads, enctime * nspertick / packets, dectime * nspertick / packets, packets * size * 8 / seconds / 1e9);
+	if (BENCH_CYCLES) printf(" %10.2f", (double)(enctime + dectime) / packets / size);
+	else printf(" %10s", "-");
+	if (errors) printf("  %llu errors", (unsigned long long)errors);
+	printf("\n");
+	fflush(stdout);
+	return 0;
+}
+
+//Parse a comma separated list of numbers between min and max
+static int benchlist(const char* text, int* list, int min, int max) {
+	int n = 0;
+	while (*text) {
+		char* end;
+		long v = strtol(text, &end, 10);
+		if (end == text || v < min || v > max || n >= BENCH_MAXLIST) return -1;
+		list[n++] = v;
+		text = (*end == ',') ? end + 1 : end;
+		if (*end && *end != ',') return -1;
+	}
+	return n ? n : -1;
+}
+
+static bool benchselected(const char* list, const char* name) {
+	int n = strlen(name);
+	while (1) {
+		if (!strncmp(list, name, n) && (list[n] == ',' || !list[n])) return true;
+		if (!(list = strchr(list, ','))) return false;
+		list++;
+	}
+}
+
+#define LOOP_HEADER 12 //sequence number and send time at the start of every packet
+#define LOOP_FORGED (1 + 8 + 16 + 1 + 32 + 24 + 32 + 24 + 8) //length of a salty control packet
+
+//A child process running the two ends of a protocol as tunnels, with the devices of both ends
+struct benchloop {
+	pid_t pid;
+	int dev[2]; //our end of the device of each tunnel
+	FILE* log; //stderr of the child
+	char* buffer;
+	int inject; //our copy of the transport of the first end, or a UDP socket, to send forged datagrams to the second end
+	struct qtstatsheader* stats; //STATS_FILE of the child
+	char forged[LOOP_FORGED];
+	const char* transport;
+	struct sockaddr_in target; //UDP address of the second end
+	u_int64_t ready; //nanoseconds from the start of the child until packets got through
+};
+
+//Transports between the two ends: a socketpair, or UDP on the loopback interface sent with sendto() (REMOTE_FLOAT) or with write() on a connected socket (REMOTE_FLOAT and REMOTE_CONNECT)
+static const char* benchtransports[] = { "fd", "sendto", "send" };
+
+//Find two free UDP ports on the loopback interface
+static int benchloopports(int* ports) {
+	int fd[2] = { -1, -1 }, i, ret = 0;
+	for (i = 0; i < 2; i++) {
+		struct sockaddr_in sa;
+		socklen_t len = sizeof(sa);
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((fd[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || bind(fd[i], (struct sockaddr*)&sa, sizeof(sa)) || getsockname(fd[i], (struct sockaddr*)&sa, &len)) ret = -1;
+		else ports[i] = ntohs(sa.sin_port);
+	}
+	for (i = 0; i < 2; i++) if (fd[i] != -1) close(fd[i]);
+	return ret;
+}
+
+static u_int64_t benchnow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct qtproto* benchselectprotocol() {
+	char* name = getconf("PROTOCOL");
+	int i;
+	for (i = 0; name && i < sizeof(benchprotocols) / sizeof(benchprotocols[0]); i++) if (!strcmp(benchprotocols[i].name, name)) return benchprotocols[i].proto;
+	errorexit("Unknown PROTOCOL specified");
+	return NULL;
+}
+
+static void benchloopstop(struct benchloop* l, bool failed) {
+	char line[256];
+	if (l->pid > 0) {
+		kill(l->pid, SIGKILL);
+		waitpid(l->pid, NULL, 0);
+	}
+	if (failed && l->log) {
+		rewind(l->log);
+		while (fgets(line, sizeof(line), l->log)) fputs(line, stderr);
+	}
+	if (l->log) fclose(l->log);
+	if (l->dev[0] != -1) close(l->dev[0]);
+	if (l->dev[1] != -1) close(l->dev[1]);
+	if (l->inject != -1) close(l->inject);
+	if (l->stats) munmap(l->stats, QTSTATS_SIZE(l->stats));
+	l->pid = -1;
+	l->log = NULL;
+	l->dev[0] = l->dev[1] = l->inject = -1;
+	l->stats = NULL;
+}
+
+static void benchloopsend(struct benchloop* l, u_int32_t seq, int size) {
+	u_int64_t now = benchnow();
+	memcpy(l->buffer, &seq, 4);
+	memcpy(l->buffer + 4, &now, 8);
+	write(l->dev[0], l->buffer, size);
+}
+
+//Read a packet from the far end, returns its sequence number and latency in nanoseconds, or -1 after timeout milliseconds
+static int benchloopreceive(struct benchloop* l, int timeout, u_int32_t* seq, u_int64_t* latency) {
+	struct pollfd pfd = { l->dev[1], POLLIN, 0 };
+	u_int64_t sent;
+	int len;
+	while (1) {
+		if (poll(&pfd, 1, timeout) <= 0) return -1;
+		len = recv(l->dev[1], l->buffer, MAX_PACKET_LEN, MSG_DONTWAIT);
+		if (len >= LOOP_HEADER) break;
+	}
+	memcpy(seq, l->buffer, 4);
+	memcpy(&sent, l->buffer + 4, 8);
+	*latency = benchnow() - sent;
+	return len;
+}
+
+//Send a forged datagram to the second end, over UDP from a different address in 127.0.0.0/8 every time
+static bool benchloopforge(struct benchloop* l, u_int32_t n) {
+#ifdef IP_PKTINFO
+	if (l->target.sin_family == AF_INET) {
+		char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+		struct iovec iov = { l->forged, sizeof(l->forged) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		msg.msg_name = &l->target;
+		msg.msg_namelen = sizeof(l->target);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		struct in_pktinfo* info = (struct in_pktinfo*)CMSG_DATA(cmsg);
+		info->ipi_spec_dst.s_addr = htonl(0x7F000000 | ((0x100000 + n) & 0xFFFFFF)); //never 127.0.0.1 in practice
+		return sendmsg(l->inject, &msg, MSG_DONTWAIT) == sizeof(l->forged);
+	}
+#endif
+	if (l->target.sin_family == AF_INET) return sendto(l->inject, l->forged, sizeof(l->forged), MSG_DONTWAIT, (struct sockaddr*)&l->target, sizeof(l->target)) == sizeof(l->forged);
+	return send(l->inject, l->forged, sizeof(l->forged), MSG_DONTWAIT) == sizeof(l->forged);
+}
+
+//Send the forged datagrams that are due at flood per second since start, forged counts those sent so far
+static void benchloopflood(struct benchloop* l, int flood, u_int64_t start, u_int64_t now, u_int64_t* forged) {
+	u_int64_t due = (now - start) * flood / 1000000000;
+	if (!flood || l->inject == -1) return;
+	while (*forged < due && benchloopforge(l, *forged)) (*forged)++;
+	if (*forged < due) *forged = due; //the socket is full, skip what could not be sent
+}
+
+//Start the tunnels of a protocol and wait until packets get through, for up to 5 seconds, while sending flood forged datagrams per second to the second end
+static int benchloopstart(struct benchloop* l, const char* name, const char* transportname, int flood) {
+	unsigned char publickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
+	unsigned char secretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	char keys[2][2][65];
+	char path[] = "/tmp/quicktun.bench.XXXXXX";
+	char statspath[] = "/tmp/quicktun.bench.stats.XXXXXX";
+	int dev[2][2], transport[2] = { -1, -1 }, ports[2];
+	int i, fd;
+	bool udp = strcmp(transportname, "fd");
+	u_int32_t seq;
+	u_int64_t latency, forged = 0, start;
+	FILE* conf;
+
+	for (i = 0; i < 2; i++) {
+		crypto_box_curve25519xsalsa20poly1305_keypair(publickey, secretkey);
+		benchhex(keys[i][0], secretkey, sizeof(secretkey));
+		benchhex(keys[i][1], publickey, sizeof(publickey));
+	}
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, dev[0]) || socketpair(AF_UNIX, SOCK_DGRAM, 0, dev[1])) return errorexitp("Could not create socket pair");
+	if (udp && benchloopports(ports)) return errorexitp("Could not find free UDP ports");
+	if (!udp && socketpair(AF_UNIX, SOCK_DGRAM, 0, transport)) return errorexitp("Could not create socket pair");
+	if ((fd = mkstemp(statspath)) < 0) return errorexitp("Could not create statistics file");
+	close(fd);
+	if ((fd = mkstemp(path)) < 0 || !(conf = fdopen(fd, "w"))) return errorexitp("Could not create configuration file");
+	fprintf(conf, "PROTOCOL=%s\nTUN_MODE=1\nDEVICE=fd\nTIME_WINDOW=60\nSTATS_FILE=%s\n", name, statspath);
+	if (!udp) fprintf(conf, "TRANSPORT=fd\n");
+	else fprintf(conf, "TRANSPORT=udp\nLOCAL_ADDRESS=127.0.0.1\nREMOTE_ADDRESS=127.0.0.1\nREMOTE_FLOAT=1\n%s", strcmp(transportname, "send") ? "" : "REMOTE_CONNECT=1\n");
+	for (i = 0; i < 2; i++) {
+		fprintf(conf, "[%c]\nPRIVATE_KEY=%s\nPUBLIC_KEY=%s\nDEVICE_FD=%d\n", 'a' + i, keys[i][0], keys[!i][1], dev[i][1]);
+		if (udp) fprintf(conf, "LOCAL_PORT=%d\nREMOTE_PORT=%d\n", ports[i], ports[!i]);
+		else fprintf(conf, "TRANSPORT_FD=%d\n", transport[i]);
+	}
+	fclose(conf);
+	if (!(l->log = tmpfile())) return errorexitp("Could not create temporary file");
+	//A control packet of salty with the highest timestamp, which gets past the checks that need no cryptography, and garbage to the other protocols
+	qtrandom((unsigned char*)l->forged, sizeof(l->forged));
+	l->forged[0] = 0x80;
+	memset(l->forged + 1, 0xFF, 8);
+	fflush(stdout);
+	start = benchnow();
+	l->pid = fork();
+	if (l->pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		if (devnull >= 0) dup2(devnull, 1);
+		dup2(fileno(l->log), 2);
+		close(dev[0][0]);
+		close(dev[1][0]);
+		qtmulticonfig = path;
+		qtrunmulti(benchselectprotocol);
+		_exit(1);
+	}
+	close(dev[0][1]);
+	close(dev[1][1]);
+	if (transport[1] != -1) close(transport[1]);
+	l->dev[0] = dev[0][0];
+	l->dev[1] = dev[1][0];
+	l->inject = transport[0];
+	l->transport = transportname;
+	memset(&l->target, 0, sizeof(l->target));
+	if (udp) {
+		l->target.sin_family = AF_INET;
+		l->target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		l->target.sin_port = htons(ports[1]);
+		if ((l->inject = socket(AF_INET, SOCK_DGRAM, 0)) < 0) perror("Could not create socket for forged datagrams");
+	}
+	if (l->pid < 0) {
+		unlink(path);
+		unlink(statspath);
+		return errorexitp("Could not start child process");
+	}
+	for (i = 0; i < 500; i++) {
+		benchloopflood(l, flood, start, benchnow(), &forged);
+		benchloopsend(l, 0xFFFFFFFF, 64);
+		if (benchloopreceive(l, 10, &seq, &latency) >= 0) break;
+		if (waitpid(l->pid, NULL, WNOHANG) == l->pid) {
+			l->pid = -1;
+			break;
+		}
+	}
+	l->ready = benchnow() - start;
+	unlink(path);
+	if (i == 500 || l->pid == -1) {
+		unlink(statspath);
+		return errorexit("The tunnels did not become ready");
+	}
+	while (benchloopreceive(l, 50, &seq, &latency) >= 0) ; //probes still under way
+	if ((fd = open(statspath, O_RDONLY)) >= 0) {
+		struct stat st;
+		if (!fstat(fd, &st) && st.st_size >= sizeof(struct qtstatsheader) + 2 * sizeof(struct qtstats)) {
+			struct qtstatsheader* header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (header != MAP_FAILED && !memcmp(header->magic, QTSTATS_MAGIC, 4) && header->version == QTSTATS_VERSION && header->sessions == 2) l->stats = header;
+			else if (header != MAP_FAILED) munmap(header, st.st_size);
+		}
+		close(fd);
+	}
+	unlink(statspath);
+	if (!l->stats) return errorexit("Could not read the statistics of the tunnels");
+	return 0;
+}
+
+static int benchu64compare(const void* a, const void* b) {
+	u_int64_t x = *(const u_int64_t*)a, y = *(const u_int64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+//Push packets through the tunnels for duration milliseconds, with up to window packets in flight, while sending flood forged datagrams per second to the second end
+static int benchloopcell(struct benchloop* l, const char* name, int size, int window, int flood, int duration) {
+	u_int64_t* latencies = NULL;
+	size_t count = 0, allocated = 0;
+	u_int64_t lost = 0, latency;
+	u_int32_t seq = 0, first = 0, received;
+	int inflight = 0;
+	u_int64_t forged = 0;
+	struct qtstats* stats = QTSTATS_SESSION(l->stats, 1);
+	u_int64_t dropped = stats->rxdropped, ratelimitdrops = stats->rxdrops[QTSTAT_RATELIMIT];
+	u_int64_t start = benchnow(), end = start + (u_int64_t)duration * 1000000;
+	int i;
+	for (i = LOOP_HEADER; i < size; i++) l->buffer[i] = i * 7;
+	while (benchnow() < end || inflight) {
+		u_int64_t now = benchnow();
+		if (now < end) benchloopflood(l, flood, start, now, &forged);
+		while (inflight < window && benchnow() < end) {
+			benchloopsend(l, seq++, size);
+			inflight++;
+		}
+		if (benchloopreceive(l, 100, &received, &latency) < 0) {
+			lost += inflight;
+			inflight = 0;
+			first = seq; //anything sent before is counted as lost already
+			continue;
+		}
+		if (received < first || received >= seq) continue;
+		inflight--;
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 4096;
+			u_int64_t* grown = realloc(latencies, allocated * sizeof(u_int64_t));
+			if (!grown) {
+				free(latencies);
+				return errorexit("Out of memory");
+			}
+			latencies = grown;
+		}
+		latencies[count++] = latency;
+	}
+	double seconds = (benchnow() - start) / 1e9;
+	printf("%-10s %-9s %6d %6d %8d %8.1f %10.0f %10.3f", name, l->transport, size, window, flood, l->ready / 1e6, count / seconds, count * size * 8 / seconds / 1e9);
+	if (count) {
+		qsort(latencies, count, sizeof(u_int64_t), benchu64compare);
+		printf(" %10.1f %10.1f %10.1f", latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3);
+	} else {
+		printf(" %10s %10s %10s", "-", "-", "-");
+	}
+	printf(" %8llu %8llu %10llu\n", (unsigned long long)lost, (unsigned long long)(stats->rxdropped - dropped), (unsigned long long)(stats->rxdrops[QTSTAT_RATELIMIT] - ratelimitdrops));
+	fflush(stdout);
+	free(latencies);
+	return 0;
+}
+
+static int benchloop(const char* protocols, const char* transports, int* sizes, int nsizes, int* windows, int nwindows, int* floods, int nfloods, int duration) {
+	struct benchloop l;
+	memset(&l, 0, sizeof(l));
+	l.pid = l.dev[0] = l.dev[1] = l.inject = -1;
+	int i, j, k, m, t;
+	if (!(l.buffer = malloc(MAX_PACKET_LEN))) return errorexit("Out of memory");
+	signal(SIGPIPE, SIG_IGN);
+	printf("%-10s %-9s %6s %6s %8s %8s %10s %10s %10s %10s %10s %8s %8s %10s\n", "PROTOCOL", "TRANSPORT", "SIZE", "WINDOW", "flood/s", "ready ms", "pkt/s", "Gbit/s", "p50 us", "p99 us", "max us", "lost", "dropped", "ratelimit");
+	fflush(stdout);
+	for (i = 0; i < sizeof(benchprotocols) / sizeof(benchprotocols[0]); i++) {
+		const char* name = benchprotocols[i].name;
+		if (protocols && !benchselected(protocols, name)) continue;
+		for (t = 0; t < sizeof(benchtransports) / sizeof(benchtransports[0]); t++) {
+			if (!benchselected(transports ? transports : "fd", benchtransports[t])) continue;
+			//The tunnels are started again for every flood rate, so the handshake has to complete while the flood is on
+			for (m = 0; m < nfloods; m++) {
+				if (benchloopstart(&l, name, benchtransports[t], floods[m]) < 0) {
+					printf("%-10s %-9s %6s %6s %8d  not ready\n", name, benchtransports[t], "-", "-", floods[m]);
+					fflush(stdout);
+					benchloopstop(&l, true);
+					continue;
+				}
+				for (j = 0; j < nsizes; j++) for (k = 0; k < nwindows; k++) benchloopcell(&l, name, sizes[j], windows[k], floods[m], duration);
+				benchloopstop(&l, false);
+			}
+		}
+	}
+	free(l.buffer);
+	return 0;
+}
+
+//Nanoseconds per operation of one of the boxes in benchepochbox, run for duration milliseconds
+static double benchboxtime(int which, struct qtepochbox* e, unsigned char* out, unsigned char* in, int len, unsigned char* nonce, const unsigned char* pk, const unsigned char* sk, const unsigned char* k, int duration) {
+	u_int64_t start = benchnow(), end = start + (u_int64_t)duration * 1000000, count = 0, now;
+	do {
+		int i;
+		for (i = 0; i < 16; i++) {
+			nonce[23]++; //only the counter part of the nonce changes within an epoch
+			if (which == 0) crypto_box_curve25519xsalsa20poly1305(out, in, len, nonce, pk, sk);
+			else if (which == 1) crypto_box_curve25519xsalsa20poly1305_afternm(out, in, len, nonce, k);
+			else if (which == 2) epochbox_afternm(e, out, in, len, nonce, k);
+			else if (which == 3) crypto_box_curve25519xsalsa20poly1305_open_afternm(out, in, len, nonce, k);
+			else epochbox_open_afternm(e, out, in, len, nonce, k);
+		}
+		count += 16;
+		now = benchnow();
+	} while (now < end);
+	return (double)(now - start) / count;
+}
+
+/*
+Compare epochbox (epochbox.c) with crypto_box and crypto_box_afternm of the crypto library, for every packet size.
+Before timing, every size is checked: epochbox must give the same output as crypto_box_afternm, each must open what the other sealed, and a modified packet must be rejected.
+The open functions are timed on a packet that fails authentication, which is the cost of rejecting a forged packet.
+*/
+static int benchepochbox(int* sizes, int nsizes, int duration) {
+	unsigned char pk[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], sk[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	unsigned char k[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+	unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+	struct qtepochbox e;
+	int i, len;
+	crypto_box_curve25519xsalsa20poly1305_keypair(pk, sk);
+	crypto_box_curve25519xsalsa20poly1305_beforenm(k, pk, sk);
+	int maxlen = 0;
+	for (i = 0; i < nsizes; i++) if (sizes[i] > maxlen) maxlen = sizes[i];
+	maxlen += crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
+	unsigned char* m = calloc(1, maxlen);
+	unsigned char* c = calloc(1, maxlen);
+	unsigned char* c2 = calloc(1, maxlen);
+	unsigned char* m2 = calloc(1, maxlen);
+	if (!m || !c || !c2 || !m2) return errorexit("Out of memory");
+	memset(&e, 0, sizeof(e));
+	printf("%-6s %12s %12s %12s %12s %12s %8s %6s\n", "SIZE", "box ns", "afternm ns", "epochbox ns", "open ns", "epoch open", "speedup", "check");
+	fflush(stdout);
+	for (i = 0; i < nsizes; i++) {
+		len = sizes[i] + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
+		qtrandom(m + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, sizes[i]);
+		qtrandom(nonce, sizeof(nonce));
+		bool ok = !crypto_box_curve25519xsalsa20poly1305_afternm(c, m, len, nonce, k)
+			&& !epochbox_afternm(&e, c2, m, len, nonce, k)
+			&& !memcmp(c, c2, len)
+			&& !epochbox_open_afternm(&e, m2, c, len, nonce, k)
+			&& !memcmp(m, m2, len)
+			&& !crypto_box_curve25519xsalsa20poly1305_open_afternm(m2, c2, len, nonce, k)
+			&& !memcmp(m, m2, len);
+		c2[len - 1] ^= 1;
+		if (ok && !epochbox_open_afternm(&e, m2, c2, len, nonce, k)) ok = false;
+		double box = benchboxtime(0, &e, c, m, len, nonce, pk, sk, k, duration);
+		double afternm = benchboxtime(1, &e, c, m, len, nonce, pk, sk, k, duration);
+		double epochbox = benchboxtime(2, &e, c, m, len, nonce, pk, sk, k, duration);
+		double open = benchboxtime(3, &e, m2, c2, len, nonce, pk, sk, k, duration);
+		double epochopen = benchboxtime(4, &e, m2, c2, len, nonce, pk, sk, k, duration);
+		printf("%-6d %12.0f %12.0f %12.0f %12.0f %12.0f %7.2fx %6s\n", sizes[i], box, afternm, epochbox, open, epochopen, afternm / epochbox, ok ? "ok" : "FAILED");
+		fflush(stdout);
+		if (!ok) return errorexit("epochbox does not match crypto_box_afternm");
+	}
+	free(m);
+	free(c);
+	free(c2);
+	free(m2);
+	return 0;
+}
+
+//Key updates of many salty sessions in simulated time, see benchrekey
+static struct qtclock benchsimclock;
+static char benchsimkeys[3][65]; //private, public and shared key in hex
+
+static char* benchsimconf(const char* name) {
+	if (!strcmp(name, "PRIVATE_KEY")) return benchsimkeys[0];
+	if (!strcmp(name, "PUBLIC_KEY")) return benchsimkeys[1];
+	if (!strcmp(name, "SHARED_KEY")) return benchsimkeys[2];
+	if (!strcmp(name, "PRIVATE_KEY_FILE")) return NULL;
+	if (!strcmp(name, "TIME_WINDOW") && !getenv(name)) return "60";
+	return getenv(name);
+}
+
+static void benchsimsend(struct qtsession* sess, char* msg, int len) {
+}
+
+//CPU time of the process in milliseconds, including the key generation worker
+static double benchcpu() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//Wait until the worker threads are idle, so their work is counted in the current second
+static void benchsettle() {
+	struct timespec delay = { 0, 200000 };
+	int i;
+	for (i = 0; i < 10000; i++) {
+		double before = benchcpu();
+		nanosleep(&delay, NULL);
+		if (benchcpu() - before < 0.05) return;
+	}
+}
+
+static int benchdoublecompare(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+//Start count sessions at the same time and run them for three rekey intervals in simulated time, in a child process because the rekey budget is process-wide
+static int benchrekeyrun(const char* label, int count, int interval, int jitter, int rate) {
+	char value[16];
+	int i, second, seconds = 3 * interval;
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) return errorexitp("Could not start child process");
+	if (pid) {
+		int status;
+		waitpid(pid, &status, 0);
+		return (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : -1;
+	}
+	snprintf(value, sizeof(value), "%d", interval);
+	setenv("REKEY_INTERVAL", value, 1);
+	snprintf(value, sizeof(value), "%d", jitter);
+	setenv("REKEY_JITTER", value, 1);
+	snprintf(value, sizeof(value), "%d", rate);
+	setenv("REKEY_RATE", value, 1);
+	unsetenv("REKEY_BURST");
+	getconf = benchsimconf;
+	struct qtsession* sessions = calloc(count, sizeof(struct qtsession));
+	struct qtstats* stats = calloc(count, sizeof(struct qtstats));
+	double* rekeys = calloc(seconds, sizeof(double));
+	double* cpu = calloc(seconds, sizeof(double));
+	if (!sessions || !stats || !rekeys || !cpu) _exit(errorexit("Out of memory"));
+	int savedout = dup(1), devnull = open("/dev/null", O_WRONLY);
+	if (savedout >= 0 && devnull >= 0) dup2(devnull, 1);
+	for (i = 0; i < count; i++) {
+		struct qtsession* s = &sessions[i];
+		s->protocol = qtproto_salty;
+		s->id = i;
+		s->fd_socket = s->fd_dev = s->fd_peer = s->fd_protocol = -1;
+		s->poll_timeout = -1;
+		s->clock = &benchsimclock;
+		s->stats = &stats[i];
+		s->sendnetworkpacket = benchsimsend;
+		s->protocol_data = calloc(1, qtproto_salty.protocol_data_size);
+		if (!s->protocol_data) _exit(errorexit("Could not allocate protocol data"));
+		if (qtproto_salty.init(s) < 0) _exit(1);
+	}
+	fflush(stdout);
+	if (savedout >= 0 && devnull >= 0) dup2(savedout, 1);
+	benchsettle();
+	u_int64_t total = 0, last = 0;
+	for (i = 0; i < count; i++) last += stats[i].rekeys;
+	for (second = 0; second < seconds; second++) {
+		double start = benchcpu();
+		for (i = 1; i <= 1000; i++) {
+			u_int64_t now = (u_int64_t)second * 1000 + i;
+			benchsimclock.monotonic.tv_sec = benchsimclock.realtime.tv_sec = now / 1000;
+			benchsimclock.monotonic.tv_nsec = benchsimclock.realtime.tv_nsec = (now % 1000) * 1000000;
+			qttimer_expire(now);
+		}
+		benchsettle();
+		cpu[second] = benchcpu() - start;
+		u_int64_t sum = 0;
+		for (i = 0; i < count; i++) sum += stats[i].rekeys;
+		rekeys[second] = sum - last;
+		total += sum - last;
+		last = sum;
+	}
+	double cpusum = 0;
+	for (second = 0; second < seconds; second++) cpusum += cpu[second];
+	qsort(rekeys, seconds, sizeof(double), benchdoublecompare);
+	qsort(cpu, seconds, sizeof(double), benchdoublecompare);
+	printf("%-14s %6d %6d %8llu %8.0f %8.0f %8.1f %10.1f %10.1f %10.1f\n", label, jitter, rate, (unsigned long long)total,
+		rekeys[seconds - 1], rekeys[seconds * 99 / 100], (double)total / seconds, cpu[seconds - 1], cpu[seconds * 99 / 100], cpusum / seconds);
+	fflush(stdout);
+	_exit(0);
+}
+
+/*
+Rekey spreading of salty (REKEY_JITTER, REKEY_RATE) with count sessions that start at the same time, without peers.
+Time is simulated: the timers of three rekey intervals run as fast as possible, and after every simulated second the process waits for the key generation worker to finish. Every key update then costs its key generation and shared key derivation, and the retransmission of the unacknowledged key updates adds a constant load.
+This reports the key updates and the CPU time of the process per simulated second.
+*/
+static int benchrekey(int count) {
+	unsigned char publickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
+	unsigned char secretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	unsigned char sharedkey[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+	char* envval;
+	int interval = (envval = getenv("REKEY_INTERVAL")) ? atoi(envval) : 60;
+	if (interval < 10) return errorexit("REKEY_INTERVAL out of range");
+	int rate = 2 * count / interval + 1; //twice the average rate
+	struct rlimit rl; //every session has a notification pipe
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	crypto_box_curve25519xsalsa20poly1305_keypair(publickey, secretkey);
+	benchhex(benchsimkeys[0], secretkey, sizeof(secretkey));
+	crypto_box_curve25519xsalsa20poly1305_keypair(publickey, secretkey);
+	benchhex(benchsimkeys[1], publickey, sizeof(publickey));
+	if (qtrandom(sharedkey, sizeof(sharedkey))) return errorexit("Could not get random data");
+	benchhex(benchsimkeys[2], sharedkey, sizeof(sharedkey));
+	printf("Rekey simulation: %d salty sessions, REKEY_INTERVAL %d, %d simulated seconds\n", count, interval, 3 * interval);
+	printf("%-14s %6s %6s %8s %8s %8s %8s %10s %10s %10s\n", "CONFIG", "JITTER", "RATE", "rekeys", "max/s", "p99/s", "mean/s", "max ms/s", "p99 ms/s", "mean ms/s");
+	fflush(stdout);
+	if (benchrekeyrun("lockstep", count, interval, 0, 0) < 0) return -1;
+	if (benchrekeyrun("jitter", count, interval, interval / 10, 0) < 0) return -1;
+	if (benchrekeyrun("jitter+budget", count, interval, interval / 10, rate) < 0) return -1;
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	int sizes[BENCH_MAXLIST] = { 64, 256, 512, 1024, 1400, 4096, 16384, 65536 }, nsizes = 8;
+	int batches[BENCH_MAXLIST] = { 1 }, nbatches = 1;
+	int threads[BENCH_MAXLIST] = { 1 }, nthreads = 1;
+	int floods[BENCH_MAXLIST] = { 0 }, nfloods = 1;
+	int duration = 200;
+	bool loop = false, epochbox = false, defaultsizes = true, defaultbatches = true;
+	int rekey = 0;
+	const char* protocols = NULL, * transports = NULL;
+	int maxsize = 0, maxbatch = 0, maxthreads = 0;
+	int i, j, k, l, m;
+	bool clockperpacket = false;
+
+	for (i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+			printf("Usage: %s [-p <protocol,...>] [-s <size,...>] [-b <batch,...>] [-t <threads,...>] [-c] [-d <milliseconds>]\n", argv[0]);
+			printf("       %s -l [-p <protocol,...>] [-s <size,...>] [-b <window,...>] [-f <datagrams/s,...>] [-u <transport,...>] [-d <milliseconds>]\n", argv[0]);
+			printf("       %s -e [-s <size,...>] [-d <milliseconds>]\n", argv[0]);
+			printf("       %s -r [-n <sessions>]\n", argv[0]);
+			printf("Please read the documentation at http://wiki.ucis.nl/QuickTun\n");
+			return 0;
+		} else if (!strcmp(a, "-v") || !strcmp(a, "--version")) {
+			printf("UCIS QuickTun "QT_VERSION"\n");
+			return 0;
+		} else if (!strcmp(a, "-l")) {
+			loop = true;
+		} else if (!strcmp(a, "-c")) {
+			clockperpacket = true;
+		} else if (!strcmp(a, "-e")) {
+			epochbox = true;
+		} else if (!strcmp(a, "-r")) {
+			if (!rekey) rekey = 5000;
+		} else if (!strcmp(a, "-n")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "Missing argument for %s\n", a);
+				return -1;
+			}
+			if ((rekey = atoi(argv[i])) < 1) return errorexit("Invalid argument specified for -n");
+		} else if (!strcmp(a, "-p") || !strcmp(a, "-s") || !strcmp(a, "-b") || !strcmp(a, "-t") || !strcmp(a, "-f") || !strcmp(a, "-u") || !strcmp(a, "-d")) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "Missing argument for %s\n", a);
+				return -1;
+			}
+			if (a[1] == 'p') protocols = argv[i];
+			else if (a[1] == 'u') transports = argv[i];
+			else if (a[1] == 's' && (nsizes = benchlist(argv[i], sizes, 1, 65536)) < 0) return errorexit("Invalid argument specified for -s");
+			else if (a[1] == 'b' && (nbatches = benchlist(argv[i], batches, 1, 4096)) < 0) return errorexit("Invalid argument specified for -b");
+			else if (a[1] == 't' && (nthreads = benchlist(argv[i], threads, 1, 1024)) < 0) return errorexit("Invalid argument specified for -t");
+			else if (a[1] == 'f' && (nfloods = benchlist(argv[i], floods, 0, 1000000)) < 0) return errorexit("Invalid argument specified for -f");
+			else if (a[1] == 'd' && (duration = atoi(argv[i])) < 10) return errorexit("Invalid argument specified for -d");
+			if (a[1] == 's') defaultsizes = false;
+			if (a[1] == 'b') defaultbatches = false;
+		} else {
+			return errorexit("Unexpected command line argument");
+		}
+	}
+	if (rekey) {
+		if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
+		printf("Crypto library: %s\n", QT_CRYPTO);
+		return benchrekey(rekey) < 0 ? 1 : 0;
+	}
+	if (epochbox) {
+		if (defaultsizes) {
+			sizes[0] = 64;
+			sizes[1] = 512;
+			sizes[2] = 1400;
+			nsizes = 3;
+		}
+		if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
+		printf("Crypto library: %s\n", QT_CRYPTO);
+		return benchepochbox(sizes, nsizes, duration) < 0 ? 1 : 0;
+	}
+	if (loop) {
+		if (defaultsizes) {
+			sizes[0] = 64;
+			sizes[1] = 512;
+			sizes[2] = 1400;
+			nsizes = 3;
+		}
+		if (defaultbatches) {
+			batches[1] = 64;
+			nbatches = 2;
+		}
+		for (i = 0; i < nsizes; i++) if (sizes[i] < LOOP_HEADER || sizes[i] > MAX_PACKET_LEN) return errorexit("Invalid argument specified for -s");
+		if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
+		printf("Crypto library: %s\n", QT_CRYPTO);
+		return benchloop(protocols, transports, sizes, nsizes, batches, nbatches, floods, nfloods, duration);
+	}
+	for (i = 0; i < nsizes; i++) if (sizes[i] > maxsize) maxsize = sizes[i];
+	for (i = 0; i < nbatches; i++) if (batches[i] > maxbatch) maxbatch = batches[i];
+	for (i = 0; i < nthreads; i++) if (threads[i] > maxthreads) maxthreads = threads[i];
+
+	getconf = benchconf;
+	if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
+	benchpairs = calloc(maxthreads, sizeof(struct benchpair));
+	if (!benchpairs) return errorexit("Out of memory");
+
+	printf("Crypto library: %s\n", QT_CRYPTO);
+	printf("%-10s %6s %6s %6s %7s %12s %12s %10s %10s\n", "PROTOCOL", "CLOCK", "SIZE", "BATCH", "THREADS", "enc ns/pkt", "dec ns/pkt", "Gbit/s", "cycles/B");
+	fflush(stdout);
+	for (i = 0; i < sizeof(benchprotocols) / sizeof(benchprotocols[0]); i++) {
+		const char* name = benchprotocols[i].name;
+		if (protocols && !benchselected(protocols, name)) continue;
+		//The protocols announce their initialization on stdout, which is kept for the results
+		int savedout = dup(1), devnull = open("/dev/null", O_WRONLY);
+		if (savedout >= 0 && devnull >= 0) dup2(devnull, 1);
+		for (j = 0; j < maxthreads; j++) if (benchsetup(&benchpairs[j], j, benchprotocols[i].proto, maxsize, maxbatch) < 0) return 1;
+		fflush(stdout);
+		if (savedout >= 0 && devnull >= 0) dup2(savedout, 1);
+		if (savedout >= 0) close(savedout);
+		if (devnull >= 0) close(devnull);
+		for (j = 0; j < nsizes; j++) for (k = 0; k < nbatches; k++) for (l = 0; l < nthreads; l++) for (m = 0; m < (clockperpacket ? 2 : 1); m++) {
+			benchclockperpacket = m;
+			benchcell(name, threads[l], sizes[j], batches[k], duration);
+		}
+	}
+	return 0;
+}
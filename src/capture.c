@@ -0,0 +1,219 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Controls the packet capture of a running quicktun process with CAPTURE_FILE set, and writes the captured packets to a pcapng file.
+-e starts capturing with the given settings: -i only inner packets, -o only outer datagrams (both by default), -s snaplen, -n sample (keep one in every n packets) and -f filter.
+The filter is the output of tcpdump -ddd with the lines separated by newlines or commas, for the link type of the inner packets, for example: -f "$(tcpdump -y RAW -ddd icmp)". It is run on the inner packets only.
+-d stops capturing. -w writes the packets in the ring to a file, oldest first, capturing is paused while the ring is copied. Without options the state of the capture is shown.
+*/
+
+#include "common.c"
+#include <signal.h>
+
+static int parsefilter(const char* text, struct qtbpfinsn* filter) {
+	unsigned long count, code, jt, jf, k;
+	int i, n;
+	if (sscanf(text, "%lu%n", &count, &n) != 1 || count < 1 || count > QTCAPTURE_MAXFILTER) return errorexit("Invalid filter length");
+	text += n;
+	for (i = 0; i < count; i++) {
+		while (*text == ',' || *text == '\n' || *text == '\r' || *text == ' ') text++;
+		if (sscanf(text, "%lu %lu %lu %lu%n", &code, &jt, &jf, &k, &n) != 4 || code > 0xffff || jt > 0xff || jf > 0xff || k > 0xffffffff) return errorexit("Invalid filter instruction");
+		text += n;
+		filter[i].code = code;
+		filter[i].jt = jt;
+		filter[i].jf = jf;
+		filter[i].k = k;
+	}
+	if (!qtbpf_validate(filter, count)) return errorexit("The filter is not a valid program");
+	return count;
+}
+
+static struct qtcapturecontrol* opencapture(const char* path, bool write, char** file, size_t* size) {
+	struct stat st;
+	int fd = open(path, write ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		perror("Could not open capture file");
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < PCAPNG_SHB_SIZE + sizeof(struct qtcapturecontrol)) {
+		fprintf(stderr, "Capture file is truncated\n");
+		close(fd);
+		return NULL;
+	}
+	char* p = mmap(NULL, st.st_size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("Could not map capture file");
+		return NULL;
+	}
+	struct qtcapturecontrol* c = (struct qtcapturecontrol*)(p + PCAPNG_SHB_SIZE);
+	if (memcmp(c->magic, QTCAPTURE_MAGIC, 4) || c->version != QTCAPTURE_VERSION) {
+		fprintf(stderr, "Not a capture file or unsupported version\n");
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	if (c->datastart > c->dataend || c->dataend > st.st_size || c->head < c->datastart || c->head > c->dataend) {
+		fprintf(stderr, "Capture file is truncated\n");
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	*file = p;
+	*size = c->dataend;
+	return c;
+}
+
+//Write the blocks in [from, to) of the copied ring, leaving out the filler blocks
+static int writeblocks(FILE* out, const char* file, uint32_t from, uint32_t to, uint64_t* packets) {
+	while (to - from >= 12) {
+		uint32_t type = qtcapture_get32(file + from), l = qtcapture_get32(file + from + 4);
+		if (l < 12 || (l & 3) || l > to - from) return errorexit("The ring is damaged");
+		if (type == PCAPNG_EPB) {
+			if (fwrite(file + from, l, 1, out) != 1) return errorexitp("Could not write output file");
+			(*packets)++;
+		}
+		from += l;
+	}
+	return 0;
+}
+
+static int writecapture(struct qtcapturecontrol* c, const char* file, size_t size, const char* path) {
+	uint64_t packets = 0;
+	uint32_t enabled = c->enabled, sequence;
+	char* copy = malloc(size);
+	if (!copy) return errorexit("Out of memory");
+	//The process stops writing at its next packet. Copy the ring when it is not writing a block, again if it has written one during the copy
+	c->enabled = 0;
+	__sync_synchronize();
+	while (1) {
+		while ((sequence = c->sequence) & 1) {
+			if (kill(c->pid, 0) && errno == ESRCH) break; //it will never finish
+			usleep(100);
+		}
+		__sync_synchronize();
+		memcpy(copy, file, size);
+		__sync_synchronize();
+		if (c->sequence == sequence || (sequence & 1)) break;
+	}
+	c->enabled = enabled;
+	struct qtcapturecontrol* cc = (struct qtcapturecontrol*)(copy + PCAPNG_SHB_SIZE);
+	FILE* out = fopen(path, "wb");
+	if (!out) return errorexitp("Could not create output file");
+	//The section header and the interfaces, then the ring from the oldest block
+	uint32_t idbstart = PCAPNG_SHB_SIZE + cc->blocklength;
+	if (idbstart >= cc->datastart) return errorexit("Capture file is damaged");
+	if (fwrite(copy, PCAPNG_SHB_SIZE, 1, out) != 1 || fwrite(copy + idbstart, cc->datastart - idbstart, 1, out) != 1) return errorexitp("Could not write output file");
+	if (writeblocks(out, copy, cc->head, cc->dataend, &packets) < 0) return -1;
+	if (writeblocks(out, copy, cc->datastart, cc->head, &packets) < 0) return -1;
+	if (fclose(out)) return errorexitp("Could not write output file");
+	fprintf(stderr, "%llu packets written\n", (unsigned long long)packets);
+	return 0;
+}
+
+static void printstatus(struct qtcapturecontrol* c) {
+	printf("Process: %u, %u tunnels\n", c->pid, c->sessions);
+	printf("Capture: %s", c->enabled ? "enabled" : "disabled");
+	if (c->which == QTCAPTURE_INNER) printf(", inner packets");
+	else if (c->which == QTCAPTURE_OUTER) printf(", outer datagrams");
+	else printf(", inner packets and outer datagrams");
+	if (c->snaplen) printf(", %u bytes of every packet", c->snaplen);
+	if (c->sample > 1) printf(", 1 in %u packets", c->sample);
+	printf("\n");
+	if (c->filterlen) printf("Filter: %u instructions\n", c->filterlen);
+	else printf("Filter: none\n");
+	printf("Ring: %u bytes\n", c->dataend - c->datastart);
+	printf("Packets: %llu captured, %llu skipped\n", (unsigned long long)c->packets, (unsigned long long)c->skipped);
+}
+
+int main(int argc, char** argv) {
+	const char* path = NULL;
+	const char* output = NULL;
+	const char* filtertext = NULL;
+	bool enable = false, disable = false;
+	int which = QTCAPTURE_INNER | QTCAPTURE_OUTER;
+	unsigned long snaplen = 0, sample = 1;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+			printf("Usage: %s [-e [-i|-o] [-s <snaplen>] [-n <sample>] [-f <filter>]] [-d] [-w <output file>] <capture file>\n", argv[0]);
+			printf("Please read the documentation at http://wiki.ucis.nl/QuickTun\n");
+			return 0;
+		} else if (!strcmp(a, "-v") || !strcmp(a, "--version")) {
+			printf("UCIS QuickTun "QT_VERSION"\n");
+			return 0;
+		} else if (!strcmp(a, "-e")) {
+			enable = true;
+		} else if (!strcmp(a, "-d")) {
+			disable = true;
+		} else if (!strcmp(a, "-i")) {
+			which = QTCAPTURE_INNER;
+		} else if (!strcmp(a, "-o")) {
+			which = QTCAPTURE_OUTER;
+		} else if (!strcmp(a, "-s") || !strcmp(a, "-n") || !strcmp(a, "-f") || !strcmp(a, "-w")) {
+			i++;
+			if (i >= argc) return errorexit2("Missing argument for", a);
+			if (a[1] == 's') snaplen = strtoul(argv[i], NULL, 10);
+			else if (a[1] == 'n') sample = strtoul(argv[i], NULL, 10);
+			else if (a[1] == 'f') filtertext = argv[i];
+			else output = argv[i];
+			if (a[1] == 'n' && (sample < 1 || sample > 0xffffffff)) return errorexit("Invalid argument specified for -n");
+			if (a[1] == 's' && snaplen > 0xffff) return errorexit("Invalid argument specified for -s");
+		} else if (!path) {
+			path = a;
+		} else {
+			return errorexit("Unexpected command line argument");
+		}
+	}
+	if (!path) return errorexit("Missing capture file argument");
+	if (enable && disable) return errorexit("Specify either -e or -d");
+
+	struct qtbpfinsn filter[QTCAPTURE_MAXFILTER];
+	int filterlen = 0;
+	if (filtertext && *filtertext && (filterlen = parsefilter(filtertext, filter)) < 0) return 1;
+
+	char* file;
+	size_t size;
+	struct qtcapturecontrol* c = opencapture(path, enable || disable || output, &file, &size);
+	if (!c) return 1;
+	if (disable) c->enabled = 0;
+	if (enable) {
+		c->enabled = 0;
+		__sync_synchronize();
+		c->which = which;
+		c->snaplen = snaplen;
+		c->sample = sample;
+		memcpy(c->filter, filter, filterlen * sizeof(struct qtbpfinsn));
+		c->filterlen = filterlen;
+		__sync_synchronize();
+		c->generation++;
+		__sync_synchronize();
+		c->enabled = 1;
+	}
+	if (output) return writecapture(c, file, size, output) < 0 ? 1 : 0;
+	if (!enable && !disable) printstatus(c);
+	return 0;
+}
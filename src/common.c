@@ -41,9 +41,17 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/resource.h>
 #ifdef linux
 	#include <linux/if_tun.h>
 	#include <linux/if_ether.h>
+	#include <linux/filter.h>
+	#include <linux/sock_diag.h>
+	#include <linux/net_tstamp.h>
+	#include <linux/errqueue.h>
+	#include <sys/epoll.h>
 #else
 	#define ETH_FRAME_LEN 1514
 	#include <net/if_tun.h>
@@ -55,13 +63,55 @@
 
 #define MAX_PACKET_LEN (ETH_FRAME_LEN+4) //Some space for optional packet information
 
+/*
+Static tracepoints (USDT) in provider quicktun, compiled in when sys/sdt.h is available. An unattached probe is a single nop.
+Every probe has the session id, a packet length and an outcome as arguments:
+	tun_read, tun_write (outcome: result of the write)
+	encode_start, encode_end (outcome: encoded length, 0 if the protocol is not ready, negative on error)
+	socket_send (outcome: result of the send), socket_receive
+	decode_start, decode_end (outcome: decoded length, 0 for control packets, negative if dropped), decode_fail (outcome: QTSTAT_ reason)
+	rekey_start, rekey_end (length: 0, outcome: key id)
+	endpoint_change (outcome: 1 if a connected socket is used)
+	rtt (length: 0, outcome: round trip time of a probe in microseconds)
+For example: bpftrace -e 'usdt:/usr/sbin/quicktun:quicktun:decode_fail { @[arg2] = count(); }'
+*/
+#ifdef HAVE_SYS_SDT_H
+	#include <sys/sdt.h>
+	#define QTPROBE(name, id, len, outcome) STAP_PROBE3(quicktun, name, id, len, outcome)
+#else
+	#define QTPROBE(name, id, len, outcome) do { } while (0)
+#endif
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	#define QT_CLOCK_MONOTONIC CLOCK_MONOTONIC_COARSE
+#else
+	#define QT_CLOCK_MONOTONIC CLOCK_MONOTONIC
+#endif
+
 typedef union {
 	struct sockaddr any;
 	struct sockaddr_in ip4;
 	struct sockaddr_in6 ip6;
 } sockaddr_any;
 
+//A datagram is accepted if its length is between minlen and maxlen and (first byte & mask) == value
+struct qtpacketrule {
+	int minlen, maxlen;
+	unsigned char mask, value;
+};
+
+//Read once per wakeup of the event loop
+struct qtclock {
+	struct timespec monotonic; //use for intervals
+	struct timespec realtime; //use for timestamps
+};
+
+#include "timer.c"
+#include "latency.c"
+#include "stats.c"
+
 struct qtsession;
+struct qttxstamp;
 struct qtproto {
 	int encrypted;
 	int buffersize_raw;
@@ -73,32 +123,67 @@ struct qtproto {
 	int (*init)(struct qtsession* sess);
 	int protocol_data_size;
 	void (*idle)(struct qtsession* sess);
+	const struct qtpacketrule* packetrules; //optional, datagrams matching none of the rules are dropped by the kernel, terminated by a rule with maxlen 0
 };
 struct qtsession {
 	struct qtproto protocol;
 	void* protocol_data;
 	int fd_socket;
 	int fd_dev;
+	int (*device_read)(struct qtsession* sess, char* buffer, int len); //a packet from the device, called when fd_dev is readable
+	int (*device_write)(struct qtsession* sess, char* buffer, int len);
+	void* device_data;
 	int remote_float;
 	sockaddr_any remote_addr;
+	int fd_peer; //socket connected to remote_addr when REMOTE_CONNECT is set, or -1
+	bool connect_peer;
+	bool socket_filter; //SOCKET_FILTER, read once because connected sockets are also created after the configuration section is gone
 	int use_pi;
+	bool tun_mode;
+	sockaddr_any local_addr; //as bound, for captures
 	int poll_timeout;
 	void (*sendnetworkpacket)(struct qtsession* sess, char* msg, int len);
+	int fd_protocol; //optional file descriptor to watch for the protocol, or -1
+	void (*protocol_event)(struct qtsession* sess); //called when fd_protocol is readable
+	int (*protocol_background)(struct qtsession* sess); //optional work for when there are no packets waiting, returns nonzero if there is more to do
+	struct qtclock* clock; //shared by all sessions in the process
+	sockaddr_any* recv_addr; //source of the packet being decoded, or NULL if the socket is connected
+	long long socket_drops; //last reported number of datagrams dropped by the kernel
+	struct qttimer drop_timer;
+	struct qtstats* stats;
+	int id; //index of the tunnel in the process
+	bool (*sendprobe)(struct qtsession* sess, u_int64_t* id); //optional, sends a round trip time probe whose reply will carry id, returns false if it could not be sent
+	struct qttimer probe_timer;
+	u_int64_t probe_id;
+	struct timespec probe_sent;
+	bool probe_pending; //sent and not answered yet
+	bool probe_answered; //the peer has answered a probe, so it supports them
+	u_int64_t probe_lastrtt; //microseconds
+	bool timestamps; //SOCKET_TIMESTAMPS
+	struct qttxstamp* txstamps; //QTTXSTAMPS datagrams waiting for their transmit timestamp
+	u_int32_t txcount_socket, txcount_peer; //datagrams sent on fd_socket and fd_peer, to match transmit timestamps
 };
 
+#include "random.c"
+#include "log.c"
+
 #ifdef COMBINED_BINARY
 	extern char* (*getconf)(const char*);
 	extern int errorexit(const char*);
 	extern int errorexitp(const char*);
 	extern void print_header();
-	extern void hex2bin(unsigned char*, const char*, const int);
+	extern bool hex2bin(unsigned char*, const char*, const int);
 	extern int debug;
 	extern int qtrun(struct qtproto* p);
+	extern void qtprobereply(struct qtsession* session, u_int64_t id);
+	extern int qtrunmulti(struct qtproto* (*selectprotocol)());
 	extern int qtprocessargs(int argc, char** argv);
+	extern char* qtmulticonfig;
 #else
 
 char* (*getconf)(const char*) = getenv;
 int debug = 0;
+char* qtmulticonfig = NULL;
 static int gargc = 0;
 static char** gargv = NULL;
 
@@ -161,6 +246,125 @@ static void sockaddr_to_string(sockaddr_any* sa, char* str, int strbuflen) {
 	str[strbuflen - 1] = 0;
 }
 
+#include "pcapng.c"
+#include "pcapreplay.c"
+
+#ifdef linux
+//Build a classic BPF program from the packet rules of the protocol, so invalid datagrams are dropped before they wake us up
+static int init_filter(struct qtsession* session, int sfd) {
+	const struct qtpacketrule* r = session->protocol.packetrules;
+	int n = 0, i;
+	if (!r || !session->socket_filter) return 0;
+	for (i = 0; r[i].maxlen; i++) ;
+	struct sock_filter code[i * 7 + 1];
+	for (; r->maxlen; r++) {
+		//The filter sees the 8 byte UDP header before the payload
+		int size = r->mask ? 7 : 4;
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + r->minlen, 0, size - 2);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 8 + r->maxlen, size - 3, 0);
+		if (r->mask) {
+			code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8);
+			code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, r->mask);
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, r->value, 0, 1);
+		}
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog prog;
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) return errorexitp("Could not attach socket filter");
+	return 0;
+}
+
+/*
+Kernel timestamps (SOCKET_TIMESTAMPS) to measure the time packets spend in QuickTun.
+Received datagrams carry the time the kernel received them, or the network card if it has been set up for hardware timestamps (hwstamp_ctl) and its clock is synchronized to the system clock (phc2sys).
+The kernel reports the time it handed a sent datagram to the driver on the error queue of the socket, numbered per socket (SOF_TIMESTAMPING_OPT_ID).
+stats->rxdelay counts the time from receiving a datagram to writing its packet to the device, stats->txdelay the time from reading a packet from the device to sending its datagram.
+*/
+#define QTTXSTAMPS 64
+
+struct qttxstamp {
+	int fd; //-1 if unused
+	u_int32_t id; //number of the datagram on the socket
+	struct timespec read; //of the packet from the device
+};
+
+static int init_timestamps(struct qtsession* session, int sfd) {
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if (!session->timestamps) return 0;
+	if (setsockopt(sfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) return errorexitp("Could not enable SO_TIMESTAMPING");
+	return 0;
+}
+#endif
+
+//Count the nanoseconds from one timestamp to the next, if they are in order
+static void qtstats_delay(struct qtstatshist* h, const struct timespec* from, const struct timespec* to) {
+	long long ns = (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+	if (ns >= 0) qtstats_hist_add(h, ns);
+}
+
+//Datagrams dropped by the kernel for this socket, by the socket filter or because the receive buffer was full
+static long long qtsocketdrops(struct qtsession* session) {
+#if defined linux && defined SO_MEMINFO
+	unsigned int meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+	if (getsockopt(session->fd_socket, SOL_SOCKET, SO_MEMINFO, meminfo, &len) || len <= SK_MEMINFO_DROPS * sizeof(unsigned int)) return -1;
+	return meminfo[SK_MEMINFO_DROPS];
+#else
+	return -1;
+#endif
+}
+
+static void qtreportdrops(struct qttimer* t) {
+	struct qtsession* session = (struct qtsession*)t->data;
+	long long drops = qtsocketdrops(session);
+	if (drops < 0 || drops == session->socket_drops) return;
+	session->stats->kerneldrops = drops;
+	if (qtdebug) qtlog(QTLOG_INFO, "Datagrams dropped by the kernel: %lld\n", drops);
+	session->socket_drops = drops;
+}
+
+static int sockaddr_size(sockaddr_any* sa) {
+	if (sa->any.sa_family == AF_INET) return sizeof(struct sockaddr_in);
+	if (sa->any.sa_family == AF_INET6) return sizeof(struct sockaddr_in6);
+	return sizeof(sockaddr_any);
+}
+
+#ifdef linux
+/*
+Create a socket connected to the current remote endpoint, sharing the local port with the main socket through SO_REUSEPORT.
+The kernel delivers datagrams from the endpoint to this socket and everything else to the main socket, and keeps the route cached for sending.
+Only the user that created the main socket can add to its port, so this stops working after SETUID; we fall back to sendto() then.
+*/
+static void qtconnectpeer(struct qtsession* session) {
+	sockaddr_any local;
+	socklen_t local_len = sizeof(local);
+	int one = 1;
+	int fd = -1;
+	if (getsockname(session->fd_socket, &local.any, &local_len)) goto fail;
+	if ((fd = socket(local.any.sa_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) goto fail;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) goto fail;
+	if (bind(fd, &local.any, local_len)) goto fail;
+	if (connect(fd, &session->remote_addr.any, sockaddr_size(&session->remote_addr))) goto fail;
+	if (init_filter(session, fd) < 0) goto fail;
+	if (init_timestamps(session, fd) < 0) goto fail;
+	//Close the old socket only now, so the event loop sees a different descriptor
+	if (session->fd_peer != -1) close(session->fd_peer);
+	session->fd_peer = fd;
+	session->txcount_peer = 0;
+	return;
+fail:
+	perror("Could not create connected socket, using sendto() from now on");
+	if (fd != -1) close(fd);
+	if (session->fd_peer != -1) close(session->fd_peer);
+	session->fd_peer = -1;
+	session->connect_peer = false;
+}
+#endif
+
 static int init_udp(struct qtsession* session) {
 	char* envval;
 	fprintf(stderr, "Initializing UDP socket...\n");
@@ -193,7 +397,28 @@ static int init_udp(struct qtsession* session) {
 	int port = 2998;
 	if ((envval = getconf("LOCAL_PORT"))) port = atoi(envval);
 	if (sockaddr_set_port(&udpaddr, port)) return -1;
+#ifdef linux
+	session->connect_peer = getconf("REMOTE_CONNECT") ? true : false;
+	if (session->connect_peer) {
+		int one = 1;
+		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) return errorexitp("Could not set SO_REUSEPORT");
+	}
+#endif
 	if (bind(sfd, &udpaddr.any, sa_size)) return errorexitp("Could not bind socket");
+	socklen_t local_len = sizeof(session->local_addr);
+	if (getsockname(sfd, &session->local_addr.any, &local_len)) return errorexitp("Could not get local address");
+#ifdef linux
+	if (init_filter(session, sfd) < 0) return -1;
+	session->timestamps = (envval = getconf("SOCKET_TIMESTAMPS")) && atoi(envval);
+	if (session->timestamps) {
+		int i;
+		session->txstamps = malloc(QTTXSTAMPS * sizeof(struct qttxstamp));
+		if (!session->txstamps) return errorexit("Out of memory");
+		for (i = 0; i < QTTXSTAMPS; i++) session->txstamps[i].fd = -1;
+		session->txcount_socket = session->txcount_peer = 0;
+		if (init_timestamps(session, sfd) < 0) return -1;
+	}
+#endif
 	memset(&udpaddr, 0, sizeof(udpaddr));
 	udpaddr.any.sa_family = af;
 	if (ai_remote) memcpy(&udpaddr, ai_remote->ai_addr, ai_remote->ai_addrlen);
@@ -214,6 +439,10 @@ static int init_udp(struct qtsession* session) {
 	if (ai_local) freeaddrinfo(ai_local);
 	if (ai_remote) freeaddrinfo(ai_remote);
 	session->fd_socket = sfd;
+	if (session->remote_float == 0) session->connect_peer = false; //already connected
+#ifdef linux
+	if (session->connect_peer && session->remote_float == 2) qtconnectpeer(session);
+#endif
 	return sfd;
 }
 
@@ -224,6 +453,7 @@ static int init_tuntap(struct qtsession* session) {
 	int tunmode = 0;
 	if ((envval = getconf("TUN_MODE"))) tunmode = atoi(envval);
 	session->use_pi = 0;
+	session->tun_mode = tunmode;
 	if (tunmode && (envval = getconf("USE_PI"))) session->use_pi = atoi(envval);
 #if defined(__linux__)
 	struct ifreq ifr; //required for tun/tap setup
@@ -265,6 +495,54 @@ static int init_tuntap(struct qtsession* session) {
 	return ttfd;
 }
 
+/*
+The device and transport of a tunnel can be replaced, to run the datapath without root or /dev/net/tun (quicktun.bench -l).
+DEVICE=fd uses the datagram socket DEVICE_FD, inherited from the parent process, as the tun/tap device: every datagram is a packet.
+DEVICE=pcap replays a packet capture (see pcapreplay.c).
+TRANSPORT=fd uses the connected datagram socket TRANSPORT_FD instead of a UDP socket.
+Both are made non-blocking, so a full queue drops packets like a real device or UDP socket does instead of stalling the event loop.
+*/
+static int qtdevice_read(struct qtsession* session, char* buffer, int len) {
+	return read(session->fd_dev, buffer, len);
+}
+
+static int qtdevice_write(struct qtsession* session, char* buffer, int len) {
+	return write(session->fd_dev, buffer, len);
+}
+
+static int init_fd(const char* name) {
+	char* envval = getconf(name);
+	int fd = envval ? atoi(envval) : -1;
+	if (fd < 0 || fcntl(fd, F_GETFD) == -1) {
+		fprintf(stderr, "Missing or invalid %s\n", name);
+		return -1;
+	}
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) return errorexitp("Could not make descriptor non-blocking");
+	return fd;
+}
+
+static int init_device(struct qtsession* session) {
+	char* envval = getconf("DEVICE");
+	session->device_read = qtdevice_read;
+	session->device_write = qtdevice_write;
+	if (!envval || !strcmp(envval, "tun")) return init_tuntap(session);
+	session->use_pi = 0;
+	session->tun_mode = getconf("TUN_MODE") && atoi(getconf("TUN_MODE"));
+	if (!strcmp(envval, "fd")) return session->fd_dev = init_fd("DEVICE_FD");
+	if (!strcmp(envval, "pcap")) return init_pcapreplay(session);
+	return errorexit("Unknown DEVICE specified");
+}
+
+static int init_transport(struct qtsession* session) {
+	char* envval = getconf("TRANSPORT");
+	if (!envval || !strcmp(envval, "udp")) return init_udp(session);
+	if (strcmp(envval, "fd")) return errorexit("Unknown TRANSPORT specified");
+	session->remote_float = 0;
+	memset(&session->remote_addr, 0, sizeof(session->remote_addr));
+	memset(&session->local_addr, 0, sizeof(session->local_addr));
+	return session->fd_socket = init_fd("TRANSPORT_FD");
+}
+
 bool hex2bin(unsigned char* dest, const char* src, const int count) {
 	int i;
 	for (i = 0; i < count; i++) {
@@ -301,116 +579,651 @@ static int drop_privileges() {
 	return 0;
 }
 
-static void qtsendnetworkpacket(struct qtsession* session, char* msg, int len) {
+static struct qtclock qtloopclock;
+static struct qtstatsheader* qtstatsheader = NULL;
+
+static void qtupdateclock() {
+	clock_gettime(QT_CLOCK_MONOTONIC, &qtloopclock.monotonic);
+	clock_gettime(CLOCK_REALTIME, &qtloopclock.realtime);
+}
+
+#ifdef linux
+//Remember a sent datagram until its transmit timestamp arrives, read is NULL if the datagram does not carry a packet from the device
+static void qttxstamp_sent(struct qtsession* session, int fd, struct timespec* read) {
+	u_int32_t id = (fd == session->fd_peer) ? session->txcount_peer++ : session->txcount_socket++;
+	struct qttxstamp* t = &session->txstamps[id % QTTXSTAMPS];
+	t->fd = read ? fd : -1;
+	t->id = id;
+	if (read) t->read = *read;
+}
+
+//Read the transmit timestamps from the error queue of a socket, returns the number of messages read
+static int qttxstamp_read(struct qtsession* session, int fd) {
+	char control[256];
+	struct msghdr msg;
+	struct cmsghdr* c;
+	int n = 0;
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return n;
+		n++;
+		struct scm_timestamping* ts = NULL;
+		struct sock_extended_err* err = NULL;
+		for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) ts = (struct scm_timestamping*)CMSG_DATA(c);
+			else if ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) || (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)) err = (struct sock_extended_err*)CMSG_DATA(c);
+		}
+		if (!ts || !err || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+		struct qttxstamp* t = &session->txstamps[err->ee_data % QTTXSTAMPS];
+		if (t->fd != fd || t->id != err->ee_data) continue;
+		t->fd = -1;
+		qtstats_delay(&session->stats->txdelay, &t->read, &ts->ts[0]);
+	}
+}
+#endif
+
+//Send a datagram, read is the time its packet was read from the device if the transmit timestamp should be counted
+static void qtsendpacket(struct qtsession* session, char* msg, int len, struct timespec* read) {
+	int ret;
+	int fd = session->fd_socket;
+	QTLATENCY_START(sendstart);
 	if (session->remote_float == 0) {
-		len = write(session->fd_socket, msg, len);
+		ret = write(fd, msg, len);
+	} else if (session->remote_float == 2 && session->fd_peer != -1) {
+		fd = session->fd_peer;
+		ret = write(fd, msg, len);
 	} else if (session->remote_float == 2) {
-		int sa_size = sizeof(sockaddr_any);
-		if (session->remote_addr.any.sa_family == AF_INET) sa_size = sizeof(struct sockaddr_in);
-		else if (session->remote_addr.any.sa_family == AF_INET6) sa_size = sizeof(struct sockaddr_in6);
-		len = sendto(session->fd_socket, msg, len, 0, (struct sockaddr*)&session->remote_addr, sa_size);
+		ret = sendto(fd, msg, len, 0, (struct sockaddr*)&session->remote_addr, sockaddr_size(&session->remote_addr));
+	} else {
+		return;
+	}
+	QTLATENCY_LAP(QTLAT_SEND, sendstart);
+	QTPROBE(socket_send, session->id, len, ret);
+	if (ret < 0) {
+		session->stats->txerrors++;
+	} else {
+		session->stats->txpackets++;
+		session->stats->txbytes += ret;
+#ifdef linux
+		if (session->timestamps) qttxstamp_sent(session, fd, read);
+#endif
 	}
 }
 
-int qtrun(struct qtproto* p) {
-	if (getconf("DEBUG")) debug = 1;
-	struct qtsession session;
-	session.poll_timeout = -1;
-	session.protocol = *p;
+static void qtsendnetworkpacket(struct qtsession* session, char* msg, int len) {
+	u_int64_t captureid;
+	if (qtcapture_active() && (captureid = qtcapture_select(session, NULL, 0))) qtcapture_outer(session, captureid, QTCAPTURE_OUT, &session->remote_addr, msg, len, len);
+	qtsendpacket(session, msg, len, NULL);
+}
+
+static void qtprobetimer(struct qttimer* t) {
+	struct qtsession* session = (struct qtsession*)t->data;
+	if (session->probe_pending && session->probe_answered) session->stats->probeslost++;
+	session->probe_pending = false;
+	if (session->remote_float == 1) return; //the remote endpoint is not known yet
+	clock_gettime(CLOCK_MONOTONIC, &session->probe_sent);
+	if (!session->sendprobe(session, &session->probe_id)) return;
+	session->probe_pending = true;
+	session->stats->probes++;
+}
+
+//Called by the protocol for an authenticated reply to a round trip time probe
+void qtprobereply(struct qtsession* session, u_int64_t id) {
+	struct qtstats* st = session->stats;
+	struct timespec now;
+	if (!session->probe_pending || id != session->probe_id) return; //late reply to a probe that has been counted as lost
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	u_int64_t rtt = (now.tv_sec - session->probe_sent.tv_sec) * 1000000LL + (now.tv_nsec - session->probe_sent.tv_nsec) / 1000;
+	session->probe_pending = false;
+	st->probereplies++;
+	if (!session->probe_answered) {
+		st->rttsmoothed = rtt;
+		st->rttvariation = rtt / 2;
+		session->probe_answered = true;
+	} else {
+		u_int64_t delta = rtt > st->rttsmoothed ? rtt - st->rttsmoothed : st->rttsmoothed - rtt;
+		st->rttvariation = (3 * st->rttvariation + delta) / 4;
+		st->rttsmoothed = (7 * st->rttsmoothed + rtt) / 8;
+		qtstats_hist_add(&st->jitter, rtt > session->probe_lastrtt ? rtt - session->probe_lastrtt : session->probe_lastrtt - rtt);
+	}
+	session->probe_lastrtt = rtt;
+	qtstats_hist_add(&st->rtt, rtt);
+	QTPROBE(rtt, session->id, 0, rtt);
+}
+
+//Set up the socket, device and protocol of a tunnel from the current configuration
+static int qtinitsession(struct qtsession* session, struct qtproto* p, int id, const char* name) {
+	char* envval;
+	session->id = id;
+	session->stats = QTSTATS_SESSION(qtstatsheader, id);
+	strncpy(session->stats->name, name, sizeof(session->stats->name) - 1);
+	session->poll_timeout = -1;
+	session->protocol = *p;
+	session->clock = &qtloopclock;
+	session->fd_peer = -1;
+	session->connect_peer = false;
+	session->socket_filter = !(envval = getconf("SOCKET_FILTER")) || atoi(envval);
+	session->fd_protocol = -1;
+	session->protocol_event = NULL;
+	session->protocol_background = NULL;
+	session->recv_addr = NULL;
+	session->socket_drops = 0;
+	session->timestamps = false;
+	session->txstamps = NULL;
+	session->sendprobe = NULL;
+	session->probe_pending = false;
+	session->probe_answered = false;
 
-	if (init_udp(&session) < 0) return -1;
-	int sfd = session.fd_socket;
+	if (init_transport(session) < 0) return -1;
+	session->sendnetworkpacket = qtsendnetworkpacket;
+	if (init_device(session) < 0) return -1;
 
-	session.sendnetworkpacket = qtsendnetworkpacket;
+	session->protocol_data = calloc(1, p->protocol_data_size ? p->protocol_data_size : 1);
+	if (!session->protocol_data) return errorexit("Could not allocate protocol data");
+	if (p->init && p->init(session) < 0) return -1;
 
-	if (init_tuntap(&session) < 0) return -1;
-	int ttfd = session.fd_dev;
+	qttimer_init(&session->drop_timer, qtreportdrops, session);
+	qttimer_start(&session->drop_timer, 10000, 10000);
 
-	char protocol_data[p->protocol_data_size];
-	memset(protocol_data, 0, p->protocol_data_size);
-	session.protocol_data = protocol_data;
-	if (p->init && p->init(&session) < 0) return -1;
+	qttimer_init(&session->probe_timer, qtprobetimer, session);
+	if ((envval = getconf("PROBE_INTERVAL"))) {
+		int interval = atoi(envval);
+		if (interval < 100) return errorexit("PROBE_INTERVAL must be at least 100 milliseconds");
+		if (!session->sendprobe) fprintf(stderr, "Warning: the protocol does not support round trip time probes, ignoring PROBE_INTERVAL\n");
+		else qttimer_start(&session->probe_timer, interval, interval);
+	}
+	return 0;
+}
 
+//Encode a packet from the tun/tap device and send it, buffer_raw must have room for the packet information header
+static int qtdevicereadable(struct qtsession* session, char* buffer_raw, char* buffer_enc) {
+	struct qtproto* p = &session->protocol;
+	int pi_length = (session->use_pi == 2) ? 4 : 0;
+	struct timespec readtime;
+	QTLATENCY_START(start);
+	int len = session->device_read(session, buffer_raw + p->offset_raw, p->buffersize_raw + pi_length);
+	if (len < 0 && errno == EAGAIN) return 0;
+	if (len < pi_length) return errorexit("read packet smaller than header from tun device");
+	QTLATENCY_LAP(QTLAT_TUNREAD, start);
+	if (session->timestamps) clock_gettime(CLOCK_REALTIME, &readtime);
+	len -= pi_length;
+	QTPROBE(tun_read, session->id, len, 0);
+	if (session->remote_float == 0 || session->remote_float == 2) {
+		int rawlen = len;
+		char* packet = buffer_raw + p->offset_raw + pi_length;
+		u_int64_t captureid = 0;
+		if (qtcapture_active() && (captureid = qtcapture_select(session, packet, len))) qtcapture_inner(session, captureid, QTCAPTURE_OUT, packet, len);
+		QTPROBE(encode_start, session->id, rawlen, 0);
+		len = p->encode(session, buffer_raw + pi_length, buffer_enc, rawlen);
+		QTLATENCY_LAP(QTLAT_ENCODE, start);
+		QTPROBE(encode_end, session->id, rawlen, len);
+		if (len < 0) return len;
+		if (len == 0) { //encoding is not yet possible
+			session->stats->txnotready++;
+			return 0;
+		}
+		if (captureid) qtcapture_outer(session, captureid, QTCAPTURE_OUT, &session->remote_addr, buffer_enc + p->offset_enc, len, len);
+		qtsendpacket(session, buffer_enc + p->offset_enc, len, session->timestamps ? &readtime : NULL);
+	}
+	return 0;
+}
+
+//Receive a datagram with recvmsg, setting stamp to its receive timestamp if the kernel provides one
+static int qtrecvstamped(struct qtsession* session, int fd, char* buffer, int size, sockaddr_any* from, struct timespec* stamp) {
+	char control[256];
+	struct iovec iov;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buffer;
+	iov.iov_len = size;
+	msg.msg_name = from;
+	msg.msg_namelen = from ? sizeof(*from) : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int len = recvmsg(fd, &msg, MSG_DONTWAIT);
+#ifdef linux
+	struct cmsghdr* c;
+	if (len >= 0) for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING) continue;
+		struct scm_timestamping* ts = (struct scm_timestamping*)CMSG_DATA(c);
+		if (ts->ts[2].tv_sec) { //hardware
+			*stamp = ts->ts[2];
+			session->stats->hwtimestamps++;
+		} else {
+			*stamp = ts->ts[0];
+		}
+	}
+#endif
+	return len;
+}
+
+static void qtsocketerror(struct qtsession* session, int fd) {
+#ifdef linux
+	if (session->timestamps && qttxstamp_read(session, fd)) return; //the error queue also holds the transmit timestamps
+#endif
+	int out;
+	socklen_t slen = sizeof(out);
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &out, &slen);
+	qtlog(QTLOG_WARNING, "Received error %d on udp socket\n", out);
+}
+
+//Decode a packet from the main or the connected socket and write it to the tun/tap device
+static void qtsocketreadable(struct qtsession* session, int fd, char* buffer_raw, char* buffer_enc) {
+	struct qtproto* p = &session->protocol;
+	int pi_length = (session->use_pi == 2) ? 4 : 0;
+	sockaddr_any recvaddr;
+	socklen_t recvaddr_len = sizeof(recvaddr);
+	struct timespec rxstamp = { 0, 0 };
+	int len;
+	//The connected socket may have been replaced after the event loop polled it, so never block here
+	QTLATENCY_START(start);
+	if (session->timestamps) {
+		len = qtrecvstamped(session, fd, buffer_enc + p->offset_enc, p->buffersize_enc, (session->remote_float == 0) ? NULL : &recvaddr, &rxstamp);
+		session->recv_addr = (session->remote_float == 0) ? NULL : &recvaddr;
+	} else if (session->remote_float == 0) {
+	 	len = recv(fd, buffer_enc + p->offset_enc, p->buffersize_enc, MSG_DONTWAIT);
+		session->recv_addr = NULL;
+	} else {
+		len = recvfrom(fd, buffer_enc + p->offset_enc, p->buffersize_enc, MSG_DONTWAIT, (struct sockaddr*)&recvaddr, &recvaddr_len);
+		session->recv_addr = &recvaddr;
+	}
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	QTLATENCY_LAP(QTLAT_RECEIVE, start);
+	if (len >= 0) {
+		QTPROBE(socket_receive, session->id, len, 0);
+		session->stats->rxpackets++;
+		session->stats->rxbytes += len;
+	}
+	if (len < 0) {
+		int out;
+		socklen_t slen = sizeof(out);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &out, &slen);
+		qtlog(QTLOG_WARNING, "Received end of file on udp socket (error %d)\n", out);
+		return;
+	}
+	bool capturing = qtcapture_active();
+	int capturelen = capturing ? qtcapture_keep(buffer_enc + p->offset_enc, len) : -1;
+	QTPROBE(decode_start, session->id, len, 0);
+	int enclen = len;
+	len = p->decode(session, buffer_enc, buffer_raw + pi_length, len);
+	QTLATENCY_LAP(QTLAT_DECODE, start);
+	QTPROBE(decode_end, session->id, enclen, len);
+	session->recv_addr = NULL;
+	if (capturing && (capturelen >= 0 || len > 0)) {
+		char* packet = buffer_raw + p->offset_raw + pi_length;
+		u_int64_t captureid = qtcapture_select(session, len > 0 ? packet : NULL, len);
+		if (captureid && capturelen >= 0) qtcapture_outer(session, captureid, QTCAPTURE_IN, session->remote_float == 0 ? &session->remote_addr : &recvaddr, qtcapturecopy, capturelen, enclen);
+		if (captureid && len > 0) qtcapture_inner(session, captureid, QTCAPTURE_IN, packet, len);
+	}
+	if (len < 0) {
+		session->stats->rxdropped++;
+		return;
+	}
+	if (len == 0) session->stats->rxcontrol++;
+	if (session->remote_float != 0 && !sockaddr_equal(&session->remote_addr, &recvaddr)) {
+		static struct qtlogsite endpointlog;
+		if (qtlog_check(&endpointlog, QTLOG_INFO, "Remote endpoint has changed")) {
+			char epname[INET6_ADDRSTRLEN + 1 + 2 + 1 + 5]; //addr%scope:port
+			sockaddr_to_string(&recvaddr, epname, sizeof(epname));
+			qtlog_write(QTLOG_INFO, "Remote endpoint has changed to %s\n", epname);
+		}
+		session->remote_addr = recvaddr;
+		session->remote_float = 2;
+		session->stats->endpointchanges++;
+#ifdef linux
+		if (session->connect_peer) qtconnectpeer(session);
+#endif
+		QTPROBE(endpoint_change, session->id, enclen, session->fd_peer != -1);
+	}
+	if (len > 0 && session->use_pi == 2) {
+		int ipver = (buffer_raw[p->offset_raw + pi_length] >> 4) & 0xf;
+		int pihdr = 0;
+#if defined linux
+		if (ipver == 4) pihdr = 0x0000 | (0x0008 << 16); //little endian: flags and protocol are swapped
+		else if (ipver == 6) pihdr = 0x0000 | (0xdd86 << 16);
+#else
+		if (ipver == 4) pihdr = htonl(AF_INET);
+		else if (ipver == 6) pihdr = htonl(AF_INET6);
+#endif
+		*(int*)(buffer_raw + p->offset_raw) = pihdr;
+	}
+	if (len > 0) {
+		QTLATENCY_START(writestart);
+		int ret = session->device_write(session, buffer_raw + p->offset_raw, len + pi_length);
+		QTLATENCY_LAP(QTLAT_TUNWRITE, writestart);
+		QTPROBE(tun_write, session->id, len, ret);
+		if (ret < 0) {
+			session->stats->rxerrors++;
+		} else if (rxstamp.tv_sec) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			qtstats_delay(&session->stats->rxdelay, &rxstamp, &now);
+		}
+	}
+}
+
+static int qtloginit() {
+	char* envval;
+	int level = QTLOG_INFO, rate = 5;
+	if (getconf("DEBUG")) debug = 1;
+	if ((envval = getconf("LOG_LEVEL"))) {
+		if (!strcmp(envval, "error")) level = QTLOG_ERROR;
+		else if (!strcmp(envval, "warning")) level = QTLOG_WARNING;
+		else if (!strcmp(envval, "info")) level = QTLOG_INFO;
+		else if (!strcmp(envval, "debug")) debug = 1;
+		else return errorexit("Invalid LOG_LEVEL specified");
+	}
+	if (debug) level = QTLOG_DEBUG;
+	if ((envval = getconf("LOG_RATE"))) rate = atoi(envval);
+	if (rate < 0) return errorexit("Invalid LOG_RATE specified");
+	if (qtlog_init(level, rate, &qtloopclock) < 0) return errorexitp("Could not start logging thread");
+	return 0;
+}
+
+int qtrun(struct qtproto* p) {
+	if (qtmulticonfig) return errorexit("Multiple tunnels are only supported by the combined binary");
+	if (qtloginit() < 0) return -1;
+	struct qtsession session;
+	qtupdateclock();
+	if (qttimer_setup(&qtloopclock) < 0) return errorexitp("Could not create timerfd");
+	if (!(qtstatsheader = qtstats_open(getconf("STATS_FILE"), 1))) return -1;
+	if (qtinitsession(&session, p, 0, getconf("INTERFACE") ? getconf("INTERFACE") : "") < 0) return -1;
+	if (getconf("CAPTURE_FILE") && qtcapture_open(getconf("CAPTURE_FILE"), &session, 1) < 0) return -1;
+
+	if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
 	if (drop_privileges() < 0) return -1;
 
 	fprintf(stderr, "The tunnel is now operational!\n");
 
-	struct pollfd fds[2];
-	fds[0].fd = ttfd;
+	struct pollfd fds[5];
+	int nfds = 5;
+	fds[0].fd = session.fd_dev;
 	fds[0].events = POLLIN;
-	fds[1].fd = sfd;
+	fds[1].fd = session.fd_socket;
 	fds[1].events = POLLIN;
+	fds[2].fd = session.fd_protocol; //ignored by poll if -1
+	fds[2].events = POLLIN;
+	fds[2].revents = 0;
+	fds[3].fd = qttimers.fd;
+	fds[3].events = POLLIN;
+	fds[3].revents = 0;
+	fds[4].events = POLLIN;
 
-	int pi_length = 0;
-	if (session.use_pi == 2) pi_length = 4;
-
-	char buffer_raw_a[p->buffersize_raw + pi_length];
-	char buffer_enc_a[p->buffersize_enc];
-	char* buffer_raw = buffer_raw_a;
-	char* buffer_enc = buffer_enc_a;
+	char buffer_raw[p->buffersize_raw + 4];
+	char buffer_enc[p->buffersize_enc];
 
 	while (1) {
-		int len = poll(fds, 2, session.poll_timeout);
+		int len = 0;
+		int timeout = qttimer_run(&qtloopclock, fds[3].revents & POLLIN);
+		if (session.poll_timeout >= 0 && (timeout < 0 || session.poll_timeout < timeout)) timeout = session.poll_timeout;
+		fds[4].fd = session.fd_peer; //may be replaced when the remote endpoint changes
+		if (session.protocol_background) while ((len = poll(fds, nfds, 0)) == 0 && session.protocol_background(&session)) ;
+		if (len == 0) {
+			QTLATENCY_START(pollstart);
+			len = poll(fds, nfds, timeout);
+			QTLATENCY_LAP(QTLAT_POLL, pollstart);
+		}
 		if (len < 0) return errorexitp("poll error");
-		else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) return errorexit("poll error on tap device");
+		if (len > 0) qtstats_batch(qtstatsheader, len);
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) return errorexit("poll error on tap device");
 		else if (fds[1].revents & (POLLHUP | POLLNVAL)) return errorexit("poll error on udp socket");
+		qtupdateclock();
 		if (len == 0 && p->idle) p->idle(&session);
-		if (fds[0].revents & POLLIN) {
-			len = read(ttfd, buffer_raw + p->offset_raw, p->buffersize_raw + pi_length);
-			if (len < pi_length) return errorexit("read packet smaller than header from tun device");
-			if (session.remote_float == 0 || session.remote_float == 2) {
-				len = p->encode(&session, buffer_raw + pi_length, buffer_enc, len - pi_length);
-				if (len < 0) return len;
-				if (len == 0) continue; //encoding is not yet possible
-				qtsendnetworkpacket(&session, buffer_enc + p->offset_enc, len);
+		if (fds[2].revents & POLLIN) session.protocol_event(&session);
+		if ((fds[0].revents & POLLIN) && qtdevicereadable(&session, buffer_raw, buffer_enc) < 0) return -1;
+		if (fds[1].revents & POLLERR) qtsocketerror(&session, session.fd_socket);
+		if (fds[1].revents & POLLIN) qtsocketreadable(&session, session.fd_socket, buffer_raw, buffer_enc);
+		if (fds[4].fd != -1 && fds[4].fd == session.fd_peer) {
+			if (fds[4].revents & POLLERR) qtsocketerror(&session, session.fd_peer);
+			if (fds[4].revents & POLLIN) qtsocketreadable(&session, session.fd_peer, buffer_raw, buffer_enc);
+		}
+	}
+	return 0;
+}
+
+#include "database.c"
+
+/*
+Multiple tunnels in one process (-f <file>).
+The file holds NAME=value lines. Lines before the first [tunnel name] header apply to all tunnels and to the process (DEBUG, SETUID, CHROOT), the lines after a header configure that tunnel.
+All tunnels are driven by a single epoll loop with shared packet buffers. Each tunnel has its own device, socket and protocol state.
+The file can also be a tunnel database built by quicktun.peerdb, which is faster to start from with many tunnels.
+*/
+struct qtconfline {
+	int section;
+	char* name;
+	char* value;
+};
+static struct qtconfline* qtconflines = NULL;
+static int qtconfcount = 0;
+static char** qtconfsections = NULL; //names of the tunnels, qtconfsections[0] is unused
+static int qtconfsectioncount = 0;
+static int qtconfsection = 0; //the tunnel being configured, 0 for the process
+static struct qtdb qtconfdb;
+static bool qtconfisdb = false;
+
+static char* getconfmulti(const char* name) {
+	char* global = NULL;
+	int i;
+	if (qtconfisdb) {
+		const char* value = qtdb_get(&qtconfdb, qtconfsection, name);
+		if (!value && qtconfsection) value = qtdb_get(&qtconfdb, 0, name);
+		return (char*)value;
+	}
+	for (i = 0; i < qtconfcount; i++) {
+		if (strcmp(qtconflines[i].name, name)) continue;
+		if (qtconflines[i].section == qtconfsection) return qtconflines[i].value;
+		if (qtconflines[i].section == 0 && !global) global = qtconflines[i].value;
+	}
+	return global;
+}
+
+static char* qttrim(char* s) {
+	char* e;
+	while (*s == ' ' || *s == '\t') s++;
+	for (e = s + strlen(s); e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '\n'); e--) ;
+	*e = 0;
+	return s;
+}
+
+static const char* qtconfsectionname(int section) {
+	return qtconfisdb ? qtdb_sectionname(&qtconfdb, section) : qtconfsections[section];
+}
+
+static int qtloadmulticonfig(const char* path) {
+	char buffer[1024];
+	int lineno = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return errorexitp("Could not open tunnel configuration file");
+	if (read(fd, buffer, 4) == 4 && !memcmp(buffer, QTDB_MAGIC, 4)) {
+		int ret = qtdb_open(&qtconfdb, fd);
+		close(fd);
+		if (ret < 0) return -1;
+		qtconfisdb = true;
+		qtconfsectioncount = qtconfdb.header->sections - 1;
+		return 0;
+	}
+	lseek(fd, 0, SEEK_SET);
+	FILE* f = fdopen(fd, "r");
+	if (!f) return errorexitp("Could not open tunnel configuration file");
+	while (fgets(buffer, sizeof(buffer), f)) {
+		char* line = qttrim(buffer);
+		lineno++;
+		if (!*line || *line == '#') continue;
+		if (*line == '[') {
+			char* end = strchr(line, ']');
+			if (end) *end = 0;
+			qtconfsections = realloc(qtconfsections, (qtconfsectioncount + 2) * sizeof(char*));
+			if (!qtconfsections) return errorexit("Out of memory");
+			qtconfsections[++qtconfsectioncount] = strdup(qttrim(line + 1));
+			continue;
+		}
+		char* value = strchr(line, '=');
+		if (!value) {
+			fprintf(stderr, "Invalid line %d in tunnel configuration file\n", lineno);
+			fclose(f);
+			return -1;
+		}
+		*value++ = 0;
+		qtconflines = realloc(qtconflines, (qtconfcount + 1) * sizeof(struct qtconfline));
+		if (!qtconflines) return errorexit("Out of memory");
+		qtconflines[qtconfcount].section = qtconfsectioncount;
+		qtconflines[qtconfcount].name = strdup(qttrim(line));
+		qtconflines[qtconfcount].value = strdup(qttrim(value));
+		qtconfcount++;
+	}
+	fclose(f);
+	if (!qtconfsectioncount) return errorexit("No tunnels defined in the tunnel configuration file");
+	return 0;
+}
+
+#ifdef linux
+#define QTEPOLL_DEVICE 0
+#define QTEPOLL_SOCKET 1
+#define QTEPOLL_PROTOCOL 2
+#define QTEPOLL_PEER 3
+#define QTEPOLL_TIMER ((u_int64_t)-1)
+
+static int qtepolladd(int epfd, int fd, u_int64_t data) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = data;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+int qtrunmulti(struct qtproto* (*selectprotocol)()) {
+#ifdef linux
+	int i, count;
+	if (qtloadmulticonfig(qtmulticonfig) < 0) return -1;
+	getconf = getconfmulti;
+	qtconfsection = 0;
+	if (qtloginit() < 0) return -1;
+	count = qtconfsectioncount;
+
+	//Every tunnel needs a few descriptors
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	qtupdateclock();
+	if (qttimer_setup(&qtloopclock) < 0) return errorexitp("Could not create timerfd");
+	struct qtsession* sessions = calloc(count, sizeof(struct qtsession));
+	if (!sessions) return errorexit("Out of memory");
+	if (!(qtstatsheader = qtstats_open(getconf("STATS_FILE"), count))) return -1;
+	int buffersize_raw = 0, buffersize_enc = 0, poll_timeout = -1;
+	bool background = false, idle = false;
+	for (i = 0; i < count; i++) {
+		qtconfsection = i + 1;
+		fprintf(stderr, "Initializing tunnel %s...\n", qtconfsectionname(qtconfsection));
+		struct qtproto* p = selectprotocol();
+		if (!p) return -1;
+		if (qtinitsession(&sessions[i], p, i, qtconfsectionname(qtconfsection)) < 0) return -1;
+		if (p->buffersize_raw > buffersize_raw) buffersize_raw = p->buffersize_raw;
+		if (p->buffersize_enc > buffersize_enc) buffersize_enc = p->buffersize_enc;
+		if (sessions[i].poll_timeout >= 0 && (poll_timeout < 0 || sessions[i].poll_timeout < poll_timeout)) poll_timeout = sessions[i].poll_timeout;
+		if (sessions[i].protocol_background) background = true;
+		if (p->idle) idle = true;
+	}
+	qtconfsection = 0;
+	if (getconf("CAPTURE_FILE") && qtcapture_open(getconf("CAPTURE_FILE"), sessions, count) < 0) return -1;
+
+	if (qtrandom_init() < 0) return errorexit("Could not seed the random number generator");
+	if (drop_privileges() < 0) return -1;
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) return errorexitp("Could not create epoll instance");
+	int* peerfds = malloc(count * sizeof(int)); //connected sockets as registered with epoll
+	if (!peerfds) return errorexit("Out of memory");
+	for (i = 0; i < count; i++) {
+		u_int64_t id = (u_int64_t)i << 2;
+		if (qtepolladd(epfd, sessions[i].fd_dev, id | QTEPOLL_DEVICE)) return errorexitp("epoll_ctl");
+		if (qtepolladd(epfd, sessions[i].fd_socket, id | QTEPOLL_SOCKET)) return errorexitp("epoll_ctl");
+		if (sessions[i].fd_protocol != -1 && qtepolladd(epfd, sessions[i].fd_protocol, id | QTEPOLL_PROTOCOL)) return errorexitp("epoll_ctl");
+		if (sessions[i].fd_peer != -1 && qtepolladd(epfd, sessions[i].fd_peer, id | QTEPOLL_PEER)) return errorexitp("epoll_ctl");
+		peerfds[i] = sessions[i].fd_peer;
+	}
+	if (qttimers.fd != -1 && qtepolladd(epfd, qttimers.fd, QTEPOLL_TIMER)) return errorexitp("epoll_ctl");
+
+	fprintf(stderr, "%d tunnels are now operational!\n", count);
+
+	char* buffer_raw = malloc(buffersize_raw + 4);
+	char* buffer_enc = malloc(buffersize_enc);
+	if (!buffer_raw || !buffer_enc) return errorexit("Out of memory");
+	struct epoll_event events[64];
+	bool timerreadable = false;
+	int nextbackground = 0;
+
+	while (1) {
+		int n = 0;
+		int timeout = qttimer_run(&qtloopclock, timerreadable);
+		if (poll_timeout >= 0 && (timeout < 0 || poll_timeout < timeout)) timeout = poll_timeout;
+		timerreadable = false;
+		if (background) {
+			//Give each tunnel with background work a turn until a packet arrives or all work is done
+			int idlecount = 0;
+			while ((n = epoll_wait(epfd, events, 64, 0)) == 0 && idlecount < count) {
+				struct qtsession* s = &sessions[nextbackground];
+				nextbackground = (nextbackground + 1) % count;
+				if (s->protocol_background && s->protocol_background(s)) idlecount = 0;
+				else idlecount++;
 			}
 		}
-		if (fds[1].revents & POLLERR) {
-			int out;
-			socklen_t slen = sizeof(out);
-			getsockopt(sfd, SOL_SOCKET, SO_ERROR, &out, &slen);
-			fprintf(stderr, "Received error %d on udp socket\n", out);
+		if (n == 0) {
+			QTLATENCY_START(pollstart);
+			n = epoll_wait(epfd, events, 64, timeout);
+			QTLATENCY_LAP(QTLAT_POLL, pollstart);
 		}
-		if (fds[1].revents & POLLIN) {
-			sockaddr_any recvaddr;
-			socklen_t recvaddr_len = sizeof(recvaddr);
-			if (session.remote_float == 0) {
-			 	len = read(sfd, buffer_enc + p->offset_enc, p->buffersize_enc);
-			} else {
-				len = recvfrom(sfd, buffer_enc + p->offset_enc, p->buffersize_enc, 0, (struct sockaddr*)&recvaddr, &recvaddr_len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return errorexitp("epoll error");
+		if (n > 0) qtstats_batch(qtstatsheader, n);
+		qtupdateclock();
+		if (n == 0 && idle) for (i = 0; i < count; i++) if (sessions[i].protocol.idle) sessions[i].protocol.idle(&sessions[i]);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u64 == QTEPOLL_TIMER) {
+				timerreadable = true;
+				continue;
 			}
-			if (len < 0) {
-				int out;
-				socklen_t slen = sizeof(out);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, &out, &slen);
-				fprintf(stderr, "Received end of file on udp socket (error %d)\n", out);
-			} else {
-				len = p->decode(&session, buffer_enc, buffer_raw + pi_length, len);
-				if (len < 0) continue;
-				if (session.remote_float != 0 && !sockaddr_equal(&session.remote_addr, &recvaddr)) {
-					char epname[INET6_ADDRSTRLEN + 1 + 2 + 1 + 5]; //addr%scope:port
-					sockaddr_to_string(&recvaddr, epname, sizeof(epname));
-					fprintf(stderr, "Remote endpoint has changed to %s\n", epname);
-					session.remote_addr = recvaddr;
-					session.remote_float = 2;
-				}
-				if (len > 0 && session.use_pi == 2) {
-					int ipver = (buffer_raw[p->offset_raw + pi_length] >> 4) & 0xf;
-					int pihdr = 0;
-#if defined linux
-					if (ipver == 4) pihdr = 0x0000 | (0x0008 << 16); //little endian: flags and protocol are swapped
-					else if (ipver == 6) pihdr = 0x0000 | (0xdd86 << 16);
-#else
-					if (ipver == 4) pihdr = htonl(AF_INET);
-					else if (ipver == 6) pihdr = htonl(AF_INET6);
-#endif
-					*(int*)(buffer_raw + p->offset_raw) = pihdr;
-				}
-				if (len > 0) write(ttfd, buffer_raw + p->offset_raw, len + pi_length);
+			int index = events[i].data.u64 >> 2;
+			struct qtsession* s = &sessions[index];
+			int ev = events[i].events;
+			switch (events[i].data.u64 & 3) {
+				case QTEPOLL_DEVICE:
+					if (ev & (EPOLLERR | EPOLLHUP)) return errorexit("poll error on tap device");
+					if (qtdevicereadable(s, buffer_raw, buffer_enc) < 0) return -1;
+					break;
+				case QTEPOLL_SOCKET:
+					if (ev & EPOLLHUP) return errorexit("poll error on udp socket");
+					if (ev & EPOLLERR) qtsocketerror(s, s->fd_socket);
+					if (ev & EPOLLIN) qtsocketreadable(s, s->fd_socket, buffer_raw, buffer_enc);
+					//A closed socket is removed from epoll by the kernel, register its replacement
+					if (s->fd_peer != peerfds[index]) {
+						peerfds[index] = s->fd_peer;
+						if (s->fd_peer != -1 && qtepolladd(epfd, s->fd_peer, ((u_int64_t)index << 2) | QTEPOLL_PEER)) return errorexitp("epoll_ctl");
+					}
+					break;
+				case QTEPOLL_PEER:
+					if (s->fd_peer != peerfds[index]) break; //event for a socket that has been replaced
+					if (ev & EPOLLERR) qtsocketerror(s, s->fd_peer);
+					if (ev & EPOLLIN) qtsocketreadable(s, s->fd_peer, buffer_raw, buffer_enc);
+					break;
+				case QTEPOLL_PROTOCOL:
+					s->protocol_event(s);
+					break;
 			}
 		}
 	}
 	return 0;
+#else
+	return errorexit("Multiple tunnels are only supported on Linux");
+#endif
 }
 
 static char* getconfcmdargs(const char* name) {
@@ -438,6 +1251,10 @@ int qtprocessargs(int argc, char** argv) {
 			gargv = argv;
 			getconf = getconfcmdargs;
 			i += 2;
+		} else if (!strcmp(a, "-f")) {
+			i++;
+			if (i >= argc) return errorexit("Missing argument for -f");
+			qtmulticonfig = argv[i];
 		} else {
 			return errorexit("Unexpected command line argument");
 		}
@@ -0,0 +1,114 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Binary tunnel database, built by quicktun.peerdb from a tunnel configuration file (see qtrunmulti).
+The file is mapped read only and used in place: nothing is parsed at startup, lookups are a binary search in the entries of a tunnel, and pages that are never looked at are never read from disk. Processes that map the same file share its pages.
+Layout, in the byte order of the machine that built the file:
+	header
+	sections[header.sections]: name, first entry, entry count; section 0 holds the settings for all tunnels
+	entries[header.entries]: name, value; sorted by name within each section
+	strings: nul terminated, referenced by their offset from the start of the file
+The file ends with a nul byte, so any string offset within the file ends within the file.
+*/
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define QTDB_MAGIC "QTDB"
+#define QTDB_VERSION 1
+#define QTDB_BYTEORDER 0x01020304
+
+struct qtdbheader {
+	char magic[4];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t sections;
+	uint32_t entries;
+	uint32_t size; //of the whole file
+};
+struct qtdbsection {
+	uint32_t name;
+	uint32_t first;
+	uint32_t count;
+};
+struct qtdbentry {
+	uint32_t name;
+	uint32_t value;
+};
+
+struct qtdb {
+	const char* base;
+	size_t size;
+	const struct qtdbheader* header;
+	const struct qtdbsection* sections;
+	const struct qtdbentry* entries;
+};
+
+static int qtdb_open(struct qtdb* db, int fd) {
+	struct stat st;
+	if (fstat(fd, &st)) return errorexitp("Could not stat tunnel database");
+	if (st.st_size < sizeof(struct qtdbheader) + 1) return errorexit("Tunnel database is truncated");
+	db->size = st.st_size;
+	db->base = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (db->base == MAP_FAILED) return errorexitp("Could not map tunnel database");
+	db->header = (const struct qtdbheader*)db->base;
+	if (memcmp(db->header->magic, QTDB_MAGIC, 4)) return errorexit("Not a tunnel database");
+	if (db->header->byteorder != QTDB_BYTEORDER) return errorexit("Tunnel database was built for a different byte order");
+	if (db->header->version != QTDB_VERSION) return errorexit("Unsupported tunnel database version");
+	if (db->header->size != db->size || db->base[db->size - 1]) return errorexit("Tunnel database is truncated");
+	uint64_t tables = sizeof(struct qtdbheader) + (uint64_t)db->header->sections * sizeof(struct qtdbsection) + (uint64_t)db->header->entries * sizeof(struct qtdbentry);
+	if (tables > db->size || db->header->sections < 2) return errorexit("Tunnel database is corrupt");
+	db->sections = (const struct qtdbsection*)(db->base + sizeof(struct qtdbheader));
+	db->entries = (const struct qtdbentry*)(db->sections + db->header->sections);
+	return 0;
+}
+
+static const char* qtdb_string(const struct qtdb* db, uint32_t offset) {
+	return offset < db->size ? db->base + offset : NULL;
+}
+
+static const char* qtdb_sectionname(const struct qtdb* db, int section) {
+	return qtdb_string(db, db->sections[section].name);
+}
+
+//Find a setting in one section, returns NULL if it is not there
+static const char* qtdb_get(const struct qtdb* db, int section, const char* name) {
+	const struct qtdbsection* s = &db->sections[section];
+	if (s->first > db->header->entries || s->count > db->header->entries - s->first) return NULL;
+	const struct qtdbentry* e = db->entries + s->first;
+	int lo = 0, hi = s->count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		const char* key = qtdb_string(db, e[mid].name);
+		if (!key) return NULL;
+		int c = strcmp(name, key);
+		if (c == 0) return qtdb_string(db, e[mid].value);
+		if (c < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return NULL;
+}
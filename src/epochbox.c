@@ -0,0 +1,74 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Epoch subkey variant of crypto_box_curve25519xsalsa20poly1305_afternm.
+XSalsa20 derives a Salsa20 subkey from the shared key and the first 16 nonce bytes using HSalsa20, and then runs plain Salsa20 with the last 8 nonce bytes as the per-packet counter.
+The first 16 nonce bytes only change once per key epoch (role bit and base nonce in salty, role bit and TAI64 seconds in nacltai), so the subkey is derived once per epoch instead of once per packet, saving one Salsa20 core per packet.
+The output is identical to crypto_box_curve25519xsalsa20poly1305_afternm, so this does not change the wire format.
+*/
+
+#include "crypto_core_hsalsa20.h"
+#include "crypto_stream_salsa20.h"
+#include "crypto_onetimeauth_poly1305.h"
+
+struct qtepochbox {
+	unsigned char key[32];
+	unsigned char prefix[16];
+	unsigned char subkey[32];
+	int valid;
+};
+
+static const unsigned char epochbox_sigma[16] = "expand 32-byte k";
+
+static const unsigned char* epochbox_subkey(struct qtepochbox* e, const unsigned char* n, const unsigned char* k) {
+	if (!e->valid || memcmp(e->prefix, n, 16) || memcmp(e->key, k, 32)) {
+		crypto_core_hsalsa20(e->subkey, n, k, epochbox_sigma);
+		memcpy(e->prefix, n, 16);
+		memcpy(e->key, k, 32);
+		e->valid = 1;
+	}
+	return e->subkey;
+}
+
+//Same calling convention as crypto_box_curve25519xsalsa20poly1305_afternm: m starts with 32 zero bytes, c starts with 16 zero bytes
+static int epochbox_afternm(struct qtepochbox* e, unsigned char* c, const unsigned char* m, unsigned long long mlen, const unsigned char* n, const unsigned char* k) {
+	if (mlen < 32) return -1;
+	crypto_stream_salsa20_xor(c, m, mlen, n + 16, epochbox_subkey(e, n, k));
+	crypto_onetimeauth_poly1305(c + 16, c + 32, mlen - 32, c);
+	memset(c, 0, 16);
+	return 0;
+}
+
+static int epochbox_open_afternm(struct qtepochbox* e, unsigned char* m, const unsigned char* c, unsigned long long clen, const unsigned char* n, const unsigned char* k) {
+	unsigned char otk[32];
+	if (clen < 32) return -1;
+	const unsigned char* subkey = epochbox_subkey(e, n, k);
+	crypto_stream_salsa20(otk, 32, n + 16, subkey);
+	if (crypto_onetimeauth_poly1305_verify(c + 16, c + 32, clen - 32, otk)) return -1;
+	crypto_stream_salsa20_xor(m, c, clen, n + 16, subkey);
+	memset(m, 0, 32);
+	return 0;
+}
@@ -68,11 +68,8 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if (input_mode == 0) {
-		crypto_box_curve25519xsalsa20poly1305_keypair(cpublickey, csecretkey);
-	} else {
-		crypto_scalarmult_curve25519_base(cpublickey, csecretkey);
-	}
+	if (input_mode == 0 && qtrandom(csecretkey, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Could not get random data");
+	crypto_scalarmult_curve25519_base(cpublickey, csecretkey);
 
 	if (output_mode == 2) {
 		fwrite(csecretkey, 1, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES, stdout);
@@ -0,0 +1,112 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Keystream precomputation for protocols with an incrementing nonce (salty, nacltai2), on top of epochbox.c.
+The nonces of the next packets are known in advance, so while the event loop is idle a ring is filled with the first bytes of the Salsa20 keystream for each of them, starting with the Poly1305 one-time key.
+A packet that fits in a precomputed slot is then encrypted with a plain XOR and the MAC. Larger packets and packets for which no slot is ready use epochbox_afternm.
+The ring holds slots * size bytes and is enabled with PRECOMPUTE (number of packets, default 0) and PRECOMPUTE_SIZE (maximum payload bytes, default 256).
+*/
+
+struct qtkeystream {
+	unsigned char* buffer; //slots * size bytes of keystream
+	unsigned char* nonces; //slots * 24 bytes
+	unsigned char key[32];
+	int slots, size;
+	int head, count;
+	unsigned long long hits, misses;
+};
+
+static int keystream_init(struct qtkeystream* r) {
+	char* envval;
+	r->slots = 0;
+	r->head = r->count = 0;
+	if (!(envval = getconf("PRECOMPUTE")) || atoi(envval) <= 0) return 0;
+	r->slots = atoi(envval);
+	if (r->slots > 4096) r->slots = 4096;
+	r->size = 256;
+	if ((envval = getconf("PRECOMPUTE_SIZE"))) r->size = atoi(envval);
+	if (r->size < 0 || r->size > MAX_PACKET_LEN) return errorexit("PRECOMPUTE_SIZE out of range");
+	r->size += 32;
+	r->buffer = malloc((size_t)r->slots * r->size);
+	r->nonces = malloc((size_t)r->slots * 24);
+	if (!r->buffer || !r->nonces) return errorexit("Could not allocate keystream buffer");
+	return 0;
+}
+
+//Increment the last 8 bytes of the nonce, returns 0 when that would change the first 16 bytes
+static int keystream_nextnonce(unsigned char* n) {
+	int i;
+	for (i = 23; i >= 16 && ++n[i] == 0; i--) ;
+	return i >= 16;
+}
+
+//Precompute up to max slots for the nonces following n, the nonce of the last packet sent. Returns nonzero if the ring is not full yet.
+static int keystream_fill(struct qtkeystream* r, struct qtepochbox* e, const unsigned char* n, const unsigned char* k, int max) {
+	unsigned char next[24];
+	if (!r->slots) return 0;
+	memcpy(next, n, 24);
+	if (!keystream_nextnonce(next)) return 0;
+	if (r->count && (memcmp(r->key, k, 32) || memcmp(r->nonces + r->head * 24, next, 24))) r->count = 0;
+	if (!r->count) {
+		r->head = 0;
+		memcpy(r->key, k, 32);
+	} else {
+		memcpy(next, r->nonces + ((r->head + r->count - 1) % r->slots) * 24, 24);
+		if (!keystream_nextnonce(next)) return 0;
+	}
+	const unsigned char* subkey = epochbox_subkey(e, next, k);
+	for (; max > 0 && r->count < r->slots; max--) {
+		int slot = (r->head + r->count) % r->slots;
+		memcpy(r->nonces + slot * 24, next, 24);
+		crypto_stream_salsa20(r->buffer + slot * r->size, r->size, next + 16, subkey);
+		r->count++;
+		if (!keystream_nextnonce(next)) return 0;
+	}
+	return r->count < r->slots;
+}
+
+//Same as epochbox_afternm, using the precomputed keystream for nonce n when available
+static int keystream_afternm(struct qtkeystream* r, struct qtepochbox* e, unsigned char* c, const unsigned char* m, unsigned long long mlen, const unsigned char* n, const unsigned char* k) {
+	unsigned long long i;
+	if (!r->slots) return epochbox_afternm(e, c, m, mlen, n, k);
+	if (!r->count || memcmp(r->nonces + r->head * 24, n, 24) || memcmp(r->key, k, 32)) {
+		r->misses++;
+		return epochbox_afternm(e, c, m, mlen, n, k);
+	}
+	const unsigned char* ks = r->buffer + r->head * r->size;
+	r->head = (r->head + 1) % r->slots;
+	r->count--;
+	if (mlen > r->size) {
+		r->misses++;
+		return epochbox_afternm(e, c, m, mlen, n, k);
+	}
+	if (mlen < 32) return -1;
+	for (i = 0; i < mlen; i++) c[i] = m[i] ^ ks[i];
+	crypto_onetimeauth_poly1305(c + 16, c + 32, mlen - 32, c);
+	memset(c, 0, 16);
+	r->hits++;
+	return 0;
+}
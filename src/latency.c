@@ -0,0 +1,109 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Timing of the stages of the event loop, compiled in with -DQT_LATENCY (LATENCY=1 for build.sh).
+Every stage has a log-linear histogram of its durations with 16 buckets per power of two, so a percentile read from it is within 6.25% of the real value.
+The histograms follow the tunnel statistics in the statistics segment and are shown by quicktun.stat. They are kept for the process, not per tunnel.
+Durations are measured with the time stamp counter on x86 and with CLOCK_MONOTONIC in nanoseconds elsewhere. Without -DQT_LATENCY the QTLATENCY_ macros expand to nothing.
+*/
+
+#include <stdint.h>
+
+enum {
+	QTLAT_POLL, //waiting for the next event
+	QTLAT_TUNREAD,
+	QTLAT_ENCODE,
+	QTLAT_SEND,
+	QTLAT_RECEIVE,
+	QTLAT_DECODE,
+	QTLAT_TUNWRITE,
+	QTLAT_STAGES
+};
+
+#define QTLATENCY_SUBBITS 4
+#define QTLATENCY_BUCKETS ((64 - QTLATENCY_SUBBITS + 1) << QTLATENCY_SUBBITS)
+
+struct qtlatency {
+	uint64_t count, sum, max; //in ticks
+	uint64_t buckets[QTLATENCY_BUCKETS];
+};
+
+//Log-linear histogram bucket of a value: values below 2^subbits have a bucket of their own, above that every power of two is split into 2^subbits buckets
+static inline int qthist_bucket(uint64_t value, int subbits) {
+	if (value < (1 << subbits)) return value;
+	int magnitude = 63 - __builtin_clzll(value);
+	return ((magnitude - subbits + 1) << subbits) + ((value >> (magnitude - subbits)) & ((1 << subbits) - 1));
+}
+
+#ifdef QT_LATENCY
+	#if defined(__x86_64__) || defined(__i386__)
+		#include <x86intrin.h>
+		#define qtlatency_now() __rdtsc()
+	#else
+		static inline uint64_t qtlatency_now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+	#endif
+
+	//Start timing in a new variable, and record the time since var for a stage and restart it
+	#define QTLATENCY_START(var) uint64_t var = qtlatency_now()
+	#define QTLATENCY_LAP(stage, var) (var = qtlatency_record(stage, var))
+#else
+	#define QTLATENCY_START(var) do { } while (0)
+	#define QTLATENCY_LAP(stage, var) do { } while (0)
+#endif
+
+#if defined(QT_LATENCY) && !defined(COMBINED_BINARY)
+static struct qtlatency* qtlatency_stages = NULL;
+
+static inline uint64_t qtlatency_record(int stage, uint64_t start) {
+	uint64_t now = qtlatency_now();
+	uint64_t value = now - start;
+	struct qtlatency* l = &qtlatency_stages[stage];
+	l->count++;
+	l->sum += value;
+	if (value > l->max) l->max = value;
+	l->buckets[qthist_bucket(value, QTLATENCY_SUBBITS)]++;
+	return now;
+}
+
+//Ticks per second of qtlatency_now(), measured against CLOCK_MONOTONIC when it is the time stamp counter
+static uint64_t qtlatency_tickrate() {
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec start, end, delay = { 0, 20000000 };
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t ticks = qtlatency_now();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ticks = qtlatency_now() - ticks;
+	return ticks * 1e9 / ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec));
+#else
+	return 1000000000;
+#endif
+}
+#endif
@@ -0,0 +1,250 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Logging off the packet path.
+Messages are formatted into a fixed ring of lines by the thread that logs them and written to stderr by a background thread, so a slow stderr (a pipe to a busy journald) never blocks the event loop. Producers claim a slot with a compare and swap and never wait: when the ring is full the message is counted as lost.
+qtlog() limits every call site to LOG_RATE messages per second (default 5, 0 for no limit), by the clock of the event loop. The writer reports how many messages of a call site were suppressed at most once per second, and sleeps until there is something to write.
+qtlogdebug() is not rate limited, it is only active with DEBUG set and is compiled out entirely with -DQT_NODEBUG.
+Before qtlog_init() and for fatal errors (errorexit) messages are written directly.
+*/
+
+#include <pthread.h>
+#include <stdarg.h>
+
+enum {
+	QTLOG_ERROR,
+	QTLOG_WARNING,
+	QTLOG_INFO,
+	QTLOG_DEBUG,
+};
+
+//State of one qtlog() call site
+struct qtlogsite {
+	struct qtlogsite* next; //in the list of sites that have suppressed messages
+	bool listed;
+	const char* format; //of the last message
+	time_t window; //second of the current rate limit window
+	unsigned int count; //messages in the current window
+	unsigned long suppressed; //since the last summary, shared with the writer
+};
+
+#ifdef QT_NODEBUG
+	#define qtdebug 0
+#else
+	#define qtdebug debug
+#endif
+
+//The arguments are only evaluated when the message is written
+#define qtlog(level, format, ...) do { \
+	static struct qtlogsite qtlogsite_; \
+	if (qtlog_check(&qtlogsite_, level, format)) qtlog_write(level, format, ##__VA_ARGS__); \
+} while (0)
+#define qtlogdebug(...) do { if (qtdebug) qtlog_write(QTLOG_DEBUG, __VA_ARGS__); } while (0)
+
+#ifdef COMBINED_BINARY
+	extern bool qtlog_check(struct qtlogsite* site, int level, const char* format);
+	extern void qtlog_write(int level, const char* format, ...);
+	extern int qtlog_init(int level, int rate, const struct qtclock* clock);
+#else
+
+#define QTLOG_SLOTS 256
+#define QTLOG_LINE 256
+
+static struct {
+	struct {
+		unsigned long seq; //the slot is free for position seq and holds the line of position seq - 1
+		char line[QTLOG_LINE];
+	} slots[QTLOG_SLOTS];
+	unsigned long head; //next position to claim
+	unsigned long tail; //next position to write out, only used with drain held
+	pthread_mutex_t drain;
+	int wakefds[2];
+	bool sleeping; //the writer waits for wakefds
+	bool started;
+	int level;
+	int rate;
+	const struct qtclock* clock; //of the event loop
+	unsigned long lost;
+	unsigned long suppressed; //since the last summary
+	struct qtlogsite* sites;
+} qtlogstate = { .drain = PTHREAD_MUTEX_INITIALIZER, .wakefds = { -1, -1 }, .level = QTLOG_INFO, .rate = 5 };
+
+static void qtlog_wake() {
+	if (__atomic_exchange_n(&qtlogstate.sleeping, false, __ATOMIC_SEQ_CST)) {
+		char c = 0;
+		if (write(qtlogstate.wakefds[1], &c, 1)) { }
+	}
+}
+
+static bool qtlog_put(const char* format, va_list args) {
+	unsigned long pos = __atomic_load_n(&qtlogstate.head, __ATOMIC_RELAXED);
+	while (1) {
+		unsigned long seq = __atomic_load_n(&qtlogstate.slots[pos % QTLOG_SLOTS].seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&qtlogstate.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&qtlogstate.lost, 1, __ATOMIC_RELAXED);
+			return false;
+		} else {
+			pos = __atomic_load_n(&qtlogstate.head, __ATOMIC_RELAXED);
+		}
+	}
+	char* line = qtlogstate.slots[pos % QTLOG_SLOTS].line;
+	int len = vsnprintf(line, QTLOG_LINE, format, args);
+	if (len >= QTLOG_LINE) line[QTLOG_LINE - 2] = '\n';
+	__atomic_store_n(&qtlogstate.slots[pos % QTLOG_SLOTS].seq, pos + 1, __ATOMIC_SEQ_CST);
+	qtlog_wake();
+	return true;
+}
+
+static void qtlog_vwrite(int level, const char* format, va_list args) {
+	if (level > qtlogstate.level) return;
+	if (!qtlogstate.started) vfprintf(stderr, format, args);
+	else qtlog_put(format, args);
+}
+
+void qtlog_write(int level, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	qtlog_vwrite(level, format, args);
+	va_end(args);
+}
+
+//Returns true if a message of this call site may be written now
+bool qtlog_check(struct qtlogsite* site, int level, const char* format) {
+	if (level > qtlogstate.level) return false;
+	if (qtlogstate.rate) {
+		struct timespec now;
+		if (qtlogstate.clock && qtlogstate.clock->monotonic.tv_sec) now = qtlogstate.clock->monotonic;
+		else clock_gettime(QT_CLOCK_MONOTONIC, &now);
+		if (site->window != now.tv_sec) {
+			site->window = now.tv_sec;
+			site->count = 0;
+		}
+		if (site->count >= qtlogstate.rate) {
+			site->format = format;
+			__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+			if (!__atomic_exchange_n(&site->listed, true, __ATOMIC_ACQ_REL)) {
+				site->next = __atomic_load_n(&qtlogstate.sites, __ATOMIC_RELAXED);
+				while (!__atomic_compare_exchange_n(&qtlogstate.sites, &site->next, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) ;
+			}
+			if (!__atomic_fetch_add(&qtlogstate.suppressed, 1, __ATOMIC_SEQ_CST) && qtlogstate.started) qtlog_wake(); //the writer sets a timer for the summary
+			return false;
+		}
+		site->count++;
+	}
+	return true;
+}
+
+//Write out all complete lines in the ring
+static void qtlog_drain() {
+	pthread_mutex_lock(&qtlogstate.drain);
+	while (1) {
+		unsigned long pos = qtlogstate.tail;
+		if (__atomic_load_n(&qtlogstate.slots[pos % QTLOG_SLOTS].seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+		fputs(qtlogstate.slots[pos % QTLOG_SLOTS].line, stderr);
+		__atomic_store_n(&qtlogstate.slots[pos % QTLOG_SLOTS].seq, pos + QTLOG_SLOTS, __ATOMIC_RELEASE);
+		qtlogstate.tail = pos + 1;
+	}
+	unsigned long lost = __atomic_exchange_n(&qtlogstate.lost, 0, __ATOMIC_RELAXED);
+	if (lost) fprintf(stderr, "%lu log messages lost\n", lost);
+	fflush(stderr);
+	pthread_mutex_unlock(&qtlogstate.drain);
+}
+
+//Report the suppressed messages of every call site, with the constant part of its message
+static void qtlog_summarize() {
+	struct qtlogsite* site;
+	__atomic_store_n(&qtlogstate.suppressed, 0, __ATOMIC_SEQ_CST);
+	for (site = __atomic_load_n(&qtlogstate.sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		unsigned long n = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (!n) continue;
+		const char* format = site->format;
+		int len = strcspn(format, "%\n");
+		if (len > 0 && format[len - 1] == '=') while (len > 0 && format[len - 1] != ' ') len--; //drop the name of the value
+		while (len > 0 && (format[len - 1] == ' ' || format[len - 1] == ':')) len--;
+		fprintf(stderr, "%lu messages suppressed: %.*s\n", n, len, format);
+	}
+}
+
+static u_int64_t qtlog_ms() {
+	struct timespec now;
+	clock_gettime(QT_CLOCK_MONOTONIC, &now);
+	return (u_int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//Waits without a timeout unless suppressed messages are due to be summarized
+static void* qtlog_writer(void* arg) {
+	u_int64_t summarized = 0;
+	while (1) {
+		struct pollfd pfd;
+		char buffer[64];
+		int timeout = -1;
+		__atomic_store_n(&qtlogstate.sleeping, true, __ATOMIC_SEQ_CST);
+		pfd.fd = qtlogstate.wakefds[0];
+		pfd.events = POLLIN;
+		if (__atomic_load_n(&qtlogstate.suppressed, __ATOMIC_SEQ_CST)) {
+			u_int64_t now = qtlog_ms();
+			timeout = (now < summarized + 1000) ? summarized + 1000 - now : 0;
+		}
+		//Check for lines that were added before we set sleeping
+		unsigned long pos = qtlogstate.tail;
+		if (timeout && __atomic_load_n(&qtlogstate.slots[pos % QTLOG_SLOTS].seq, __ATOMIC_SEQ_CST) != pos + 1) poll(&pfd, 1, timeout);
+		while (read(qtlogstate.wakefds[0], buffer, sizeof(buffer)) > 0) ;
+		qtlog_drain();
+		if (__atomic_load_n(&qtlogstate.suppressed, __ATOMIC_SEQ_CST) && qtlog_ms() >= summarized + 1000) {
+			pthread_mutex_lock(&qtlogstate.drain);
+			qtlog_summarize();
+			pthread_mutex_unlock(&qtlogstate.drain);
+			summarized = qtlog_ms();
+		}
+	}
+	return NULL;
+}
+
+static void qtlog_exit() {
+	qtlog_drain();
+}
+
+int qtlog_init(int level, int rate, const struct qtclock* clock) {
+	int i;
+	pthread_t thread;
+	qtlogstate.level = level;
+	qtlogstate.rate = rate;
+	qtlogstate.clock = clock;
+	if (qtlogstate.started) return 0;
+	for (i = 0; i < QTLOG_SLOTS; i++) qtlogstate.slots[i].seq = i;
+	if (pipe(qtlogstate.wakefds)) return -1;
+	fcntl(qtlogstate.wakefds[0], F_SETFL, O_NONBLOCK);
+	fcntl(qtlogstate.wakefds[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&thread, NULL, qtlog_writer, NULL)) return -1;
+	pthread_detach(thread);
+	atexit(qtlog_exit);
+	qtlogstate.started = true;
+	return 0;
+}
+#endif
@@ -0,0 +1,478 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Packet capture into a ring file in pcapng format (CAPTURE_FILE, CAPTURE_SIZE), controlled at run time with quicktun.capture.
+The file is created at startup and holds a section header, a control block, two interfaces per tunnel and the ring. The inner interface of a tunnel has the packets of the tun/tap device (raw IP or Ethernet), the outer one its datagrams with an IP and UDP header put in front (the checksums of which are not filled in).
+Both packets of a pair get the same epb_packetid, so a plaintext packet can be matched with the datagram that carried it. Control datagrams and datagrams that could not be decoded have no inner packet.
+The ring is always a sequence of valid blocks: the oldest packets are overwritten and what is left of them is covered by a filler block. The control and filler blocks have block types for local use, which pcapng readers skip. quicktun.capture -w writes the packets in the ring to an ordinary pcapng file.
+The filter is a classic BPF program (tcpdump -ddd) that runs on the inner packet, without a filter datagrams without an inner packet are also captured. Of the packets that pass the filter one in every sample is kept, truncated to snaplen bytes.
+Until capturing is enabled, the packet path only checks the enabled flag in the control block.
+*/
+
+#include <stdint.h>
+#include <sys/mman.h>
+#ifndef BPF_CLASS
+	#include <net/bpf.h>
+#endif
+
+#define QTCAPTURE_MAGIC "QTCP"
+#define QTCAPTURE_VERSION 2
+#define QTCAPTURE_MAXFILTER 256
+#define QTCAPTURE_INNER 1
+#define QTCAPTURE_OUTER 2
+//Values of epb_flags
+#define QTCAPTURE_IN 1
+#define QTCAPTURE_OUT 2
+
+//pcapng block types and options
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_CONTROL 0x80515443 //local use
+#define PCAPNG_FILLER 0x80515446 //local use
+#define PCAPNG_BYTEORDER 0x1A2B3C4D
+#define PCAPNG_SHB_SIZE 40 //with shb_userappl
+#define PCAPNG_EPB_SIZE(caplen) (28 + (((caplen) + 3) & ~3) + 8 + 12 + 4 + 4) //with epb_flags and epb_packetid
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+
+struct qtbpfinsn {
+	uint16_t code;
+	uint8_t jt, jf;
+	uint32_t k;
+};
+
+//Body of the control block at PCAPNG_SHB_SIZE, the block trailer follows it
+struct qtcapturecontrol {
+	uint32_t blocktype, blocklength;
+	char magic[4];
+	uint32_t version;
+	uint32_t pid;
+	uint32_t sessions;
+	//Settings, changed by quicktun.capture while enabled is 0, which increments generation afterwards
+	uint32_t enabled;
+	uint32_t generation;
+	uint32_t which; //QTCAPTURE_INNER and/or QTCAPTURE_OUTER
+	uint32_t snaplen; //0 for the whole packet
+	uint32_t sample; //keep one of every sample packets, 0 or 1 for all
+	uint32_t filterlen; //instructions, 0 for no filter
+	struct qtbpfinsn filter[QTCAPTURE_MAXFILTER];
+	//The ring, offsets in the file
+	uint32_t datastart, dataend;
+	uint32_t head; //the next block is written here, the oldest block starts here
+	uint32_t sequence; //incremented before and after the process writes to the ring, odd while it is writing
+	uint64_t packets; //captured
+	uint64_t skipped; //rejected by the filter or left out by sampling
+};
+
+//Check that a filter only has known instructions, jumps forward within the program and ends with a return
+static bool qtbpf_validate(const struct qtbpfinsn* f, int len) {
+	int i;
+	if (len < 1 || len > QTCAPTURE_MAXFILTER) return false;
+	for (i = 0; i < len; i++) {
+		uint32_t k = f[i].k;
+		switch (f[i].code) {
+			case BPF_LD | BPF_W | BPF_ABS: case BPF_LD | BPF_H | BPF_ABS: case BPF_LD | BPF_B | BPF_ABS:
+			case BPF_LD | BPF_W | BPF_IND: case BPF_LD | BPF_H | BPF_IND: case BPF_LD | BPF_B | BPF_IND:
+			case BPF_LD | BPF_W | BPF_LEN: case BPF_LDX | BPF_W | BPF_LEN:
+			case BPF_LD | BPF_IMM: case BPF_LDX | BPF_IMM: case BPF_LDX | BPF_B | BPF_MSH:
+			case BPF_ALU | BPF_ADD | BPF_K: case BPF_ALU | BPF_SUB | BPF_K: case BPF_ALU | BPF_MUL | BPF_K:
+			case BPF_ALU | BPF_OR | BPF_K: case BPF_ALU | BPF_AND | BPF_K: case BPF_ALU | BPF_XOR | BPF_K:
+			case BPF_ALU | BPF_ADD | BPF_X: case BPF_ALU | BPF_SUB | BPF_X: case BPF_ALU | BPF_MUL | BPF_X:
+			case BPF_ALU | BPF_DIV | BPF_X: case BPF_ALU | BPF_MOD | BPF_X: case BPF_ALU | BPF_OR | BPF_X:
+			case BPF_ALU | BPF_AND | BPF_X: case BPF_ALU | BPF_XOR | BPF_X:
+			case BPF_ALU | BPF_LSH | BPF_X: case BPF_ALU | BPF_RSH | BPF_X: case BPF_ALU | BPF_NEG:
+			case BPF_RET | BPF_K: case BPF_RET | BPF_A: case BPF_MISC | BPF_TAX: case BPF_MISC | BPF_TXA:
+				break;
+			case BPF_LD | BPF_MEM: case BPF_LDX | BPF_MEM: case BPF_ST: case BPF_STX:
+				if (k >= BPF_MEMWORDS) return false;
+				break;
+			case BPF_ALU | BPF_DIV | BPF_K: case BPF_ALU | BPF_MOD | BPF_K:
+				if (k == 0) return false;
+				break;
+			case BPF_ALU | BPF_LSH | BPF_K: case BPF_ALU | BPF_RSH | BPF_K:
+				if (k >= 32) return false;
+				break;
+			case BPF_JMP | BPF_JA:
+				if (k >= len - i - 1) return false;
+				break;
+			case BPF_JMP | BPF_JEQ | BPF_K: case BPF_JMP | BPF_JGT | BPF_K: case BPF_JMP | BPF_JGE | BPF_K: case BPF_JMP | BPF_JSET | BPF_K:
+			case BPF_JMP | BPF_JEQ | BPF_X: case BPF_JMP | BPF_JGT | BPF_X: case BPF_JMP | BPF_JGE | BPF_X: case BPF_JMP | BPF_JSET | BPF_X:
+				if (f[i].jt >= len - i - 1 || f[i].jf >= len - i - 1) return false;
+				break;
+			default:
+				return false;
+		}
+	}
+	return BPF_CLASS(f[len - 1].code) == BPF_RET;
+}
+
+//Run a validated filter on a packet, returns 0 if the packet does not match. Loads beyond the end of the packet do not match.
+static uint32_t qtbpf_run(const struct qtbpfinsn* pc, const unsigned char* p, uint32_t len) {
+	uint32_t A = 0, X = 0, k;
+	uint32_t M[BPF_MEMWORDS];
+	for (;; pc++) {
+		k = pc->k;
+		switch (pc->code) {
+			case BPF_LD | BPF_W | BPF_IND: k += X; if (k < X) return 0; //fall through
+			case BPF_LD | BPF_W | BPF_ABS: if (k > len || len - k < 4) return 0; A = (uint32_t)p[k] << 24 | p[k + 1] << 16 | p[k + 2] << 8 | p[k + 3]; break;
+			case BPF_LD | BPF_H | BPF_IND: k += X; if (k < X) return 0; //fall through
+			case BPF_LD | BPF_H | BPF_ABS: if (k > len || len - k < 2) return 0; A = p[k] << 8 | p[k + 1]; break;
+			case BPF_LD | BPF_B | BPF_IND: k += X; if (k < X) return 0; //fall through
+			case BPF_LD | BPF_B | BPF_ABS: if (k >= len) return 0; A = p[k]; break;
+			case BPF_LD | BPF_W | BPF_LEN: A = len; break;
+			case BPF_LDX | BPF_W | BPF_LEN: X = len; break;
+			case BPF_LD | BPF_IMM: A = k; break;
+			case BPF_LDX | BPF_IMM: X = k; break;
+			case BPF_LD | BPF_MEM: A = M[k]; break;
+			case BPF_LDX | BPF_MEM: X = M[k]; break;
+			case BPF_LDX | BPF_B | BPF_MSH: if (k >= len) return 0; X = (p[k] & 0xf) << 2; break;
+			case BPF_ST: M[k] = A; break;
+			case BPF_STX: M[k] = X; break;
+			case BPF_ALU | BPF_ADD | BPF_K: A += k; break;
+			case BPF_ALU | BPF_SUB | BPF_K: A -= k; break;
+			case BPF_ALU | BPF_MUL | BPF_K: A *= k; break;
+			case BPF_ALU | BPF_DIV | BPF_K: A /= k; break;
+			case BPF_ALU | BPF_MOD | BPF_K: A %= k; break;
+			case BPF_ALU | BPF_OR | BPF_K: A |= k; break;
+			case BPF_ALU | BPF_AND | BPF_K: A &= k; break;
+			case BPF_ALU | BPF_XOR | BPF_K: A ^= k; break;
+			case BPF_ALU | BPF_LSH | BPF_K: A <<= k; break;
+			case BPF_ALU | BPF_RSH | BPF_K: A >>= k; break;
+			case BPF_ALU | BPF_ADD | BPF_X: A += X; break;
+			case BPF_ALU | BPF_SUB | BPF_X: A -= X; break;
+			case BPF_ALU | BPF_MUL | BPF_X: A *= X; break;
+			case BPF_ALU | BPF_DIV | BPF_X: if (!X) return 0; A /= X; break;
+			case BPF_ALU | BPF_MOD | BPF_X: if (!X) return 0; A %= X; break;
+			case BPF_ALU | BPF_OR | BPF_X: A |= X; break;
+			case BPF_ALU | BPF_AND | BPF_X: A &= X; break;
+			case BPF_ALU | BPF_XOR | BPF_X: A ^= X; break;
+			case BPF_ALU | BPF_LSH | BPF_X: A = X < 32 ? A << X : 0; break;
+			case BPF_ALU | BPF_RSH | BPF_X: A = X < 32 ? A >> X : 0; break;
+			case BPF_ALU | BPF_NEG: A = -A; break;
+			case BPF_JMP | BPF_JA: pc += k; break;
+			case BPF_JMP | BPF_JEQ | BPF_K: pc += (A == k) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JGT | BPF_K: pc += (A > k) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JGE | BPF_K: pc += (A >= k) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JSET | BPF_K: pc += (A & k) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JEQ | BPF_X: pc += (A == X) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JGT | BPF_X: pc += (A > X) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JGE | BPF_X: pc += (A >= X) ? pc->jt : pc->jf; break;
+			case BPF_JMP | BPF_JSET | BPF_X: pc += (A & X) ? pc->jt : pc->jf; break;
+			case BPF_RET | BPF_K: return k;
+			case BPF_RET | BPF_A: return A;
+			case BPF_MISC | BPF_TAX: X = A; break;
+			case BPF_MISC | BPF_TXA: A = X; break;
+			default: return 0;
+		}
+	}
+}
+
+static struct qtcapturecontrol* qtcapture = NULL; //NULL without CAPTURE_FILE
+static char* qtcapturering; //start of the file
+static char* qtcapturecopy; //of a received datagram, which the protocol may change while decoding it
+
+//Private copy of the settings, so a filter that changes under us is never run
+static struct {
+	uint32_t generation;
+	uint32_t which, snaplen, sample, skip;
+	int filterlen;
+	struct qtbpfinsn filter[QTCAPTURE_MAXFILTER];
+	u_int64_t nextid;
+} qtcapturestate;
+
+static void qtcapture_put32(char* p, uint32_t v) {
+	memcpy(p, &v, 4);
+}
+
+static uint32_t qtcapture_get32(const char* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static char* qtcapture_option(char* p, uint16_t code, const void* value, int len) {
+	memcpy(p, &code, 2);
+	*(uint16_t*)(p + 2) = len;
+	memcpy(p + 4, value, len);
+	memset(p + 4 + len, 0, (4 - (len & 3)) & 3);
+	return p + 4 + ((len + 3) & ~3);
+}
+
+static int qtcapture_idbsize(const char* name) {
+	return 16 + 4 + ((strlen(name) + 3) & ~3) + 8 + 4 + 4;
+}
+
+//Interface description block with if_name and nanosecond timestamps
+static char* qtcapture_idb(char* p, uint16_t linktype, const char* name) {
+	int size = qtcapture_idbsize(name);
+	unsigned char tsresol = 9;
+	char* o;
+	qtcapture_put32(p, PCAPNG_IDB);
+	qtcapture_put32(p + 4, size);
+	*(uint16_t*)(p + 8) = linktype;
+	*(uint16_t*)(p + 10) = 0;
+	qtcapture_put32(p + 12, 0);
+	o = qtcapture_option(p + 16, 2, name, strlen(name));
+	o = qtcapture_option(o, 9, &tsresol, 1);
+	qtcapture_put32(o, 0); //opt_endofopt
+	qtcapture_put32(o + 4, size);
+	return p + size;
+}
+
+static void qtcapture_filler(uint32_t offset, uint32_t size) {
+	qtcapture_put32(qtcapturering + offset, PCAPNG_FILLER);
+	qtcapture_put32(qtcapturering + offset + 4, size);
+	qtcapture_put32(qtcapturering + offset + size - 4, size);
+}
+
+//Create the ring file, after the sessions have been set up
+static int qtcapture_open(const char* path, struct qtsession* sessions, int count) {
+	char* envval;
+	char name[64];
+	size_t ringsize = 4 << 20, size;
+	int i;
+	if ((envval = getconf("CAPTURE_SIZE"))) ringsize = strtoul(envval, NULL, 10);
+	if (ringsize < 65536 || ringsize > 1 << 30) return errorexit("CAPTURE_SIZE must be between 65536 and 1073741824 bytes");
+	ringsize &= ~3;
+	size = PCAPNG_SHB_SIZE + sizeof(struct qtcapturecontrol) + 4;
+	for (i = 0; i < count; i++) {
+		size += qtcapture_idbsize(sessions[i].stats->name);
+		snprintf(name, sizeof(name), "%s/udp", sessions[i].stats->name);
+		size += qtcapture_idbsize(name);
+	}
+	size_t datastart = size;
+	size += ringsize;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return errorexitp("Could not create CAPTURE_FILE");
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return errorexitp("Could not resize CAPTURE_FILE");
+	}
+	char* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return errorexitp("Could not map CAPTURE_FILE");
+	int maxenc = 0;
+	for (i = 0; i < count; i++) if (sessions[i].protocol.buffersize_enc > maxenc) maxenc = sessions[i].protocol.buffersize_enc;
+	if (!(qtcapturecopy = malloc(maxenc))) return errorexit("Out of memory");
+	qtcapturering = p;
+
+	//Section header block with shb_userappl
+	qtcapture_put32(p, PCAPNG_SHB);
+	qtcapture_put32(p + 4, PCAPNG_SHB_SIZE);
+	qtcapture_put32(p + 8, PCAPNG_BYTEORDER);
+	*(uint16_t*)(p + 12) = 1;
+	*(uint16_t*)(p + 14) = 0;
+	memset(p + 16, 0xff, 8); //section length not specified
+	qtcapture_option(p + 24, 4, "QuickTun", 8);
+	qtcapture_put32(p + 36, PCAPNG_SHB_SIZE);
+
+	struct qtcapturecontrol* c = (struct qtcapturecontrol*)(p + PCAPNG_SHB_SIZE);
+	c->blocktype = PCAPNG_CONTROL;
+	c->blocklength = sizeof(struct qtcapturecontrol) + 4;
+	qtcapture_put32((char*)(c + 1), c->blocklength);
+	c->version = QTCAPTURE_VERSION;
+	c->pid = getpid();
+	c->sessions = count;
+	c->which = QTCAPTURE_INNER | QTCAPTURE_OUTER;
+	c->datastart = datastart;
+	c->dataend = size;
+	c->head = datastart;
+
+	p = (char*)(c + 1) + 4;
+	for (i = 0; i < count; i++) {
+		p = qtcapture_idb(p, sessions[i].tun_mode ? LINKTYPE_RAW : LINKTYPE_ETHERNET, sessions[i].stats->name);
+		snprintf(name, sizeof(name), "%s/udp", sessions[i].stats->name);
+		p = qtcapture_idb(p, LINKTYPE_RAW, name);
+	}
+	qtcapture_filler(datastart, ringsize);
+	qtcapturestate.nextid = 1;
+	memcpy(c->magic, QTCAPTURE_MAGIC, 4); //last, so quicktun.capture does not see a partial file
+	qtcapture = c;
+	return 0;
+}
+
+//Take over changed settings, returns false if capturing has been stopped because they are invalid
+static bool qtcapture_reload() {
+	struct qtcapturecontrol* c = qtcapture;
+	qtcapturestate.generation = c->generation;
+	qtcapturestate.which = c->which;
+	qtcapturestate.snaplen = c->snaplen;
+	qtcapturestate.sample = c->sample;
+	qtcapturestate.skip = 0;
+	qtcapturestate.filterlen = c->filterlen;
+	if (qtcapturestate.filterlen) {
+		if (qtcapturestate.filterlen <= QTCAPTURE_MAXFILTER) memcpy(qtcapturestate.filter, c->filter, qtcapturestate.filterlen * sizeof(struct qtbpfinsn));
+		if (!qtbpf_validate(qtcapturestate.filter, qtcapturestate.filterlen)) {
+			qtlog(QTLOG_WARNING, "Invalid capture filter, capturing stopped\n");
+			c->enabled = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+//Check before capturing anything, this is all the packet path does when capturing is not enabled
+static inline bool qtcapture_active() {
+	if (!qtcapture || !qtcapture->enabled) return false;
+	if (qtcapture->generation != qtcapturestate.generation) return qtcapture_reload();
+	return true;
+}
+
+//Length of the packet information header that a tun device without IFF_NO_PI or with TUNSIFHEAD puts in front of the packet, which is not captured
+static inline int qtcapture_pi(struct qtsession* session, int len) {
+	return (session->use_pi == 1 && len >= 4) ? 4 : 0;
+}
+
+//Decide whether to capture a packet from or to the device, inner is NULL if there is none, returns the packet id or 0
+static u_int64_t qtcapture_select(struct qtsession* session, const char* inner, int len) {
+	if (qtcapturestate.filterlen) {
+		int pi = inner ? qtcapture_pi(session, len) : 0;
+		if (!inner || !qtbpf_run(qtcapturestate.filter, (const unsigned char*)inner + pi, len - pi)) {
+			qtcapture->skipped++;
+			return 0;
+		}
+	}
+	if (qtcapturestate.sample > 1 && qtcapturestate.skip++ % qtcapturestate.sample) {
+		qtcapture->skipped++;
+		return 0;
+	}
+	qtcapture->packets++;
+	return qtcapturestate.nextid++;
+}
+
+//Claim size bytes at the head of the ring, overwriting the oldest blocks
+static char* qtcapture_reserve(uint32_t size) {
+	struct qtcapturecontrol* c = qtcapture;
+	uint32_t head = c->head, rest = c->dataend - head, end, p, l;
+	//Never leave a space too small for a filler block
+	if (rest < size || (rest > size && rest - size < 12)) {
+		if (rest) qtcapture_filler(head, rest);
+		head = c->datastart;
+	}
+	end = head + size;
+	for (p = head; p < end; p += l) {
+		l = qtcapture_get32(qtcapturering + p + 4);
+		if (l < 12 || (l & 3) || l > c->dataend - p) l = c->dataend - p;
+	}
+	if (p > end && p - end < 12) {
+		l = qtcapture_get32(qtcapturering + p + 4);
+		p += (l < 12 || (l & 3) || l > c->dataend - p) ? c->dataend - p : l;
+	}
+	if (p > end) qtcapture_filler(end, p - end);
+	c->head = end;
+	return qtcapturering + head;
+}
+
+//Write an enhanced packet block, the packet is head followed by data, of which caplen bytes are available
+static void qtcapture_write(int interface, uint32_t flags, u_int64_t id, const char* head, int headlen, const char* data, int caplen, int origlen) {
+	struct timespec now;
+	if (qtcapturestate.snaplen && headlen + caplen > qtcapturestate.snaplen) caplen = qtcapturestate.snaplen > headlen ? qtcapturestate.snaplen - headlen : 0;
+	int total = headlen + caplen;
+	uint32_t size = PCAPNG_EPB_SIZE(total);
+	qtcapture->sequence++;
+	__sync_synchronize();
+	char* p = qtcapture_reserve(size);
+	clock_gettime(CLOCK_REALTIME, &now);
+	u_int64_t ts = (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	qtcapture_put32(p, PCAPNG_EPB);
+	qtcapture_put32(p + 4, size);
+	qtcapture_put32(p + 8, interface);
+	qtcapture_put32(p + 12, ts >> 32);
+	qtcapture_put32(p + 16, ts);
+	qtcapture_put32(p + 20, total);
+	qtcapture_put32(p + 24, headlen + origlen);
+	if (headlen) memcpy(p + 28, head, headlen);
+	memcpy(p + 28 + headlen, data, caplen);
+	char* o = p + 28 + ((total + 3) & ~3);
+	memset(p + 28 + total, 0, o - (p + 28 + total));
+	o = qtcapture_option(o, 2, &flags, 4); //epb_flags
+	o = qtcapture_option(o, 5, &id, 8); //epb_packetid
+	qtcapture_put32(o, 0);
+	qtcapture_put32(o + 4, size);
+	__sync_synchronize();
+	qtcapture->sequence++;
+}
+
+//Capture a packet from or to the device
+static void qtcapture_inner(struct qtsession* session, u_int64_t id, uint32_t flags, const char* packet, int len) {
+	if (!(qtcapturestate.which & QTCAPTURE_INNER)) return;
+	int pi = qtcapture_pi(session, len);
+	qtcapture_write(session->id * 2, flags, id, NULL, 0, packet + pi, len - pi, len - pi);
+}
+
+//Keep what will be captured of a received datagram before the protocol decodes it, returns the number of bytes copied or -1
+static int qtcapture_keep(const char* datagram, int len) {
+	if (!(qtcapturestate.which & QTCAPTURE_OUTER)) return -1;
+	if (qtcapturestate.snaplen && len > qtcapturestate.snaplen) len = qtcapturestate.snaplen;
+	memcpy(qtcapturecopy, datagram, len);
+	return len;
+}
+
+//Capture a datagram to or from remote with caplen of its len bytes available, with an IP and UDP header in front of it
+static void qtcapture_outer(struct qtsession* session, u_int64_t id, uint32_t flags, sockaddr_any* remote, const char* datagram, int caplen, int len) {
+	unsigned char hdr[48];
+	sockaddr_any* src = (flags == QTCAPTURE_OUT) ? &session->local_addr : remote;
+	sockaddr_any* dst = (flags == QTCAPTURE_OUT) ? remote : &session->local_addr;
+	int hdrlen, i;
+	if (!(qtcapturestate.which & QTCAPTURE_OUTER)) return;
+	if (remote->any.sa_family == AF_INET) {
+		uint32_t sum = 0;
+		hdrlen = 28;
+		memset(hdr, 0, hdrlen);
+		hdr[0] = 0x45;
+		hdr[2] = (hdrlen + len) >> 8;
+		hdr[3] = hdrlen + len;
+		hdr[8] = 64;
+		hdr[9] = IPPROTO_UDP;
+		memcpy(hdr + 12, &src->ip4.sin_addr, 4);
+		memcpy(hdr + 16, &dst->ip4.sin_addr, 4);
+		for (i = 0; i < 20; i += 2) sum += hdr[i] << 8 | hdr[i + 1];
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = ~((sum & 0xffff) + (sum >> 16));
+		hdr[10] = sum >> 8;
+		hdr[11] = sum;
+		memcpy(hdr + 20, &src->ip4.sin_port, 2);
+		memcpy(hdr + 22, &dst->ip4.sin_port, 2);
+	} else if (remote->any.sa_family == AF_INET6) {
+		hdrlen = 48;
+		memset(hdr, 0, hdrlen);
+		hdr[0] = 0x60;
+		hdr[4] = (8 + len) >> 8;
+		hdr[5] = 8 + len;
+		hdr[6] = IPPROTO_UDP;
+		hdr[7] = 64;
+		memcpy(hdr + 8, &src->ip6.sin6_addr, 16);
+		memcpy(hdr + 24, &dst->ip6.sin6_addr, 16);
+		memcpy(hdr + 40, &src->ip6.sin6_port, 2);
+		memcpy(hdr + 42, &dst->ip6.sin6_port, 2);
+	} else {
+		return;
+	}
+	hdr[hdrlen - 4] = (8 + len) >> 8;
+	hdr[hdrlen - 3] = 8 + len;
+	qtcapture_write(session->id * 2 + 1, flags, id, (char*)hdr, hdrlen, datagram, caplen, len);
+}
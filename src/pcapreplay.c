@@ -0,0 +1,347 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Replay of a packet capture as the tun/tap device of a tunnel (DEVICE=pcap), to run the datapath with a recorded traffic mix.
+REPLAY_FILE is a pcap or pcapng file, the packets of which are read from the device as if they had been sent to the interface. They are converted to what the device would give (TUN_MODE): Ethernet frames of IPv4 and IPv6 are stripped to IP packets for a tun device, while packets without an Ethernet header are skipped for a tap device. Truncated packets are skipped as well, as are the outer interfaces ("name/udp") of a file written by quicktun.capture.
+REPLAY_SPEED scales the time between packets: 1 (default) replays them as recorded, 2 twice as fast and 0 as fast as possible. REPLAY_LOOP is the number of passes through the file, 0 to repeat until stopped (default 1).
+Decoded packets written to the device go to REPLAY_OUTPUT, a pcap file, or are discarded. A tunnel without a REPLAY_FILE only receives.
+The device descriptor is a timerfd that is due when the next packet is, and stays readable while packets are due.
+*/
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define PCAP_MAGIC 0xA1B2C3D4 //microsecond timestamps
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAPNG_SPB 3
+#define LINKTYPE_NULL 0
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+struct qtpcapreplaypacket {
+	const unsigned char* data;
+	int len;
+	u_int64_t time; //nanoseconds since the first packet
+};
+
+struct qtpcapreplay {
+	const char* path;
+	struct qtpcapreplaypacket* packets;
+	u_int32_t count, allocated, next;
+	u_int32_t skipped;
+	int loops, pass;
+	double speed;
+	u_int64_t start; //monotonic time of the first packet of this pass
+	u_int64_t replayed;
+	bool tun_mode;
+	int output; //REPLAY_OUTPUT, or -1
+};
+
+//Header of a pcap file, in host byte order
+struct qtpcapheader {
+	u_int32_t magic;
+	u_int16_t major, minor;
+	int32_t thiszone;
+	u_int32_t sigfigs, snaplen, linktype;
+};
+
+struct qtpcapreplayinterface {
+	int linktype;
+	unsigned char tsresol;
+	bool skip;
+};
+
+static u_int64_t qtpcapreplay_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u_int32_t qtpcapreplay_32(const unsigned char* p, bool big) {
+	return big ? ((u_int32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] : ((u_int32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static u_int16_t qtpcapreplay_16(const unsigned char* p, bool big) {
+	return big ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+//Convert a timestamp in units of if_tsresol to nanoseconds
+static u_int64_t qtpcapreplay_ns(u_int64_t ts, unsigned char tsresol) {
+	int i, exp = tsresol & 0x7F;
+	if (tsresol & 0x80) {
+		if (exp > 63) return 0;
+		return (ts >> exp) * 1000000000 + (u_int64_t)((double)(ts & ((1ULL << exp) - 1)) * 1e9 / (double)(1ULL << exp));
+	}
+	for (i = exp; i < 9; i++) ts *= 10;
+	for (i = 9; i < exp; i++) ts /= 10;
+	return ts;
+}
+
+//Add a packet as the device would give it, data points into the mapped file
+static int qtpcapreplay_add(struct qtpcapreplay* r, int linktype, const unsigned char* data, u_int32_t caplen, u_int32_t len, u_int64_t time) {
+	int type;
+	if (caplen < len) {
+		r->skipped++;
+		return 0;
+	}
+	switch (linktype) {
+		case LINKTYPE_ETHERNET:
+			if (!r->tun_mode) break;
+			if (len < 18) goto skip;
+			type = qtpcapreplay_16(data + 12, true);
+			if (type == 0x8100) { //VLAN tag
+				type = qtpcapreplay_16(data + 16, true);
+				data += 4;
+				len -= 4;
+			}
+			if (type != 0x0800 && type != 0x86DD) goto skip;
+			data += 14;
+			len -= 14;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			if (!r->tun_mode || len < 16) goto skip;
+			type = qtpcapreplay_16(data + 14, true);
+			if (type != 0x0800 && type != 0x86DD) goto skip;
+			data += 16;
+			len -= 16;
+			break;
+		case LINKTYPE_NULL:
+			if (!r->tun_mode || len < 4) goto skip;
+			data += 4;
+			len -= 4;
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			if (!r->tun_mode) goto skip;
+			break;
+		default:
+			goto skip;
+	}
+	if (len == 0 || len > MAX_PACKET_LEN) goto skip;
+	if (r->count == r->allocated) {
+		r->allocated = r->allocated ? r->allocated * 2 : 1024;
+		struct qtpcapreplaypacket* packets = realloc(r->packets, r->allocated * sizeof(struct qtpcapreplaypacket));
+		if (!packets) return errorexit("Out of memory");
+		r->packets = packets;
+	}
+	r->packets[r->count].data = data;
+	r->packets[r->count].len = len;
+	r->packets[r->count].time = time;
+	r->count++;
+	return 0;
+skip:
+	r->skipped++;
+	return 0;
+}
+
+static int qtpcapreplay_pcap(struct qtpcapreplay* r, const unsigned char* file, size_t size, bool big, bool ns) {
+	size_t off = 24;
+	int linktype = qtpcapreplay_32(file + 20, big) & 0xFFFF;
+	while (off + 16 <= size) {
+		u_int64_t time = (u_int64_t)qtpcapreplay_32(file + off, big) * 1000000000 + (u_int64_t)qtpcapreplay_32(file + off + 4, big) * (ns ? 1 : 1000);
+		u_int32_t caplen = qtpcapreplay_32(file + off + 8, big);
+		u_int32_t len = qtpcapreplay_32(file + off + 12, big);
+		if (caplen > size - off - 16) return errorexit("Truncated pcap file");
+		if (qtpcapreplay_add(r, linktype, file + off + 16, caplen, len, time) < 0) return -1;
+		off += 16 + caplen;
+	}
+	return 0;
+}
+
+static int qtpcapreplay_pcapng(struct qtpcapreplay* r, const unsigned char* file, size_t size) {
+	struct qtpcapreplayinterface* interfaces = NULL;
+	int interfacecount = 0;
+	u_int64_t time = 0;
+	size_t off = 0;
+	bool big = false;
+	while (off + 12 <= size) {
+		const unsigned char* block = file + off;
+		u_int32_t type = qtpcapreplay_32(block, big);
+		if (type == PCAPNG_SHB) {
+			big = qtpcapreplay_32(block + 8, true) == PCAPNG_BYTEORDER;
+			interfacecount = 0; //interface ids are per section
+		}
+		u_int32_t blocklen = qtpcapreplay_32(block + 4, big);
+		if (blocklen < 12 || blocklen % 4 || blocklen > size - off) {
+			free(interfaces);
+			return errorexit("Truncated or invalid pcapng file");
+		}
+		if (type == PCAPNG_IDB && blocklen >= 20) {
+			struct qtpcapreplayinterface* grown = realloc(interfaces, (interfacecount + 1) * sizeof(struct qtpcapreplayinterface));
+			if (!grown) {
+				free(interfaces);
+				return errorexit("Out of memory");
+			}
+			interfaces = grown;
+			struct qtpcapreplayinterface* i = &interfaces[interfacecount++];
+			i->linktype = qtpcapreplay_16(block + 8, big);
+			i->tsresol = 6;
+			i->skip = false;
+			u_int32_t opt = 16;
+			while (opt + 4 <= blocklen - 4) {
+				int code = qtpcapreplay_16(block + opt, big), optlen = qtpcapreplay_16(block + opt + 2, big);
+				if (code == 0 || opt + 4 + optlen > blocklen - 4) break;
+				if (code == 9 && optlen >= 1) i->tsresol = block[opt + 4];
+				if (code == 2) { //if_name, which may have a terminating zero
+					while (optlen && !block[opt + 4 + optlen - 1]) optlen--;
+					if (optlen >= 4 && !memcmp(block + opt + optlen, "/udp", 4)) i->skip = true;
+				}
+				opt += 4 + ((qtpcapreplay_16(block + opt + 2, big) + 3) & ~3);
+			}
+		} else if (type == PCAPNG_EPB && blocklen >= 32) {
+			u_int32_t id = qtpcapreplay_32(block + 8, big);
+			u_int32_t caplen = qtpcapreplay_32(block + 20, big);
+			if (id >= interfacecount || caplen > blocklen - 32) {
+				free(interfaces);
+				return errorexit("Invalid packet block in pcapng file");
+			}
+			time = qtpcapreplay_ns(((u_int64_t)qtpcapreplay_32(block + 12, big) << 32) | qtpcapreplay_32(block + 16, big), interfaces[id].tsresol);
+			if (!interfaces[id].skip && qtpcapreplay_add(r, interfaces[id].linktype, block + 28, caplen, qtpcapreplay_32(block + 24, big), time) < 0) {
+				free(interfaces);
+				return -1;
+			}
+		} else if (type == PCAPNG_SPB && blocklen >= 16 && interfacecount) {
+			//No timestamp, it is sent along with the packet before it
+			u_int32_t len = qtpcapreplay_32(block + 8, big);
+			u_int32_t caplen = len < blocklen - 16 ? len : blocklen - 16;
+			if (!interfaces[0].skip && qtpcapreplay_add(r, interfaces[0].linktype, block + 12, caplen, len, time) < 0) {
+				free(interfaces);
+				return -1;
+			}
+		}
+		off += blocklen;
+	}
+	free(interfaces);
+	return 0;
+}
+
+#ifdef linux
+static int qtpcapreplay_arm(struct qtsession* session, u_int64_t due) {
+	struct itimerspec its;
+	u_int64_t expirations;
+	read(session->fd_dev, &expirations, sizeof(expirations)); //no longer readable until due
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000000;
+	its.it_value.tv_nsec = due % 1000000000;
+	timerfd_settime(session->fd_dev, TFD_TIMER_ABSTIME, &its, NULL);
+	errno = EAGAIN;
+	return -1;
+}
+
+static int qtpcapreplay_read(struct qtsession* session, char* buffer, int len) {
+	struct qtpcapreplay* r = (struct qtpcapreplay*)session->device_data;
+	while (1) {
+		if (r->next == r->count) {
+			if (!r->count || (r->loops && ++r->pass >= r->loops)) {
+				fprintf(stderr, "Replay of %s finished after %llu packets\n", r->path, (unsigned long long)r->replayed);
+				r->count = r->next = 0;
+				return qtpcapreplay_arm(session, 0); //disarmed
+			}
+			if (r->speed > 0) r->start += r->packets[r->count - 1].time / r->speed;
+			r->next = 0;
+		}
+		struct qtpcapreplaypacket* p = &r->packets[r->next];
+		if (r->speed > 0) {
+			u_int64_t due = r->start + (u_int64_t)(p->time / r->speed);
+			if (due > qtpcapreplay_now()) return qtpcapreplay_arm(session, due);
+		}
+		r->next++;
+		if (p->len > len) continue;
+		memcpy(buffer, p->data, p->len);
+		r->replayed++;
+		return p->len;
+	}
+}
+#endif
+
+static int qtpcapreplay_write(struct qtsession* session, char* buffer, int len) {
+	struct qtpcapreplay* r = (struct qtpcapreplay*)session->device_data;
+	struct timespec ts;
+	u_int32_t record[4];
+	struct iovec iov[2];
+	if (r->output == -1) return len;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	record[0] = ts.tv_sec;
+	record[1] = ts.tv_nsec;
+	record[2] = record[3] = len;
+	iov[0].iov_base = record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = len;
+	return writev(r->output, iov, 2) < 0 ? -1 : len;
+}
+
+static int init_pcapreplay(struct qtsession* session) {
+#ifdef linux
+	struct qtpcapreplay* r = calloc(1, sizeof(struct qtpcapreplay));
+	char* envval;
+	if (!r) return errorexit("Could not allocate replay state");
+	r->tun_mode = session->tun_mode;
+	r->output = -1;
+	r->loops = (envval = getconf("REPLAY_LOOP")) ? atoi(envval) : 1;
+	r->speed = (envval = getconf("REPLAY_SPEED")) ? atof(envval) : 1;
+	if (r->loops < 0 || r->speed < 0) return errorexit("Invalid REPLAY_LOOP or REPLAY_SPEED specified");
+	if ((r->path = getconf("REPLAY_FILE"))) {
+		struct stat st;
+		int fd = open(r->path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st)) return errorexitp("Could not open REPLAY_FILE");
+		if (st.st_size < 24) return errorexit("REPLAY_FILE is not a pcap or pcapng file");
+		const unsigned char* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (file == MAP_FAILED) return errorexitp("Could not map REPLAY_FILE");
+		int ret;
+		if (qtpcapreplay_32(file, false) == PCAPNG_SHB) ret = qtpcapreplay_pcapng(r, file, st.st_size);
+		else if (qtpcapreplay_32(file, false) == PCAP_MAGIC || qtpcapreplay_32(file, false) == PCAP_MAGIC_NS) ret = qtpcapreplay_pcap(r, file, st.st_size, false, qtpcapreplay_32(file, false) == PCAP_MAGIC_NS);
+		else if (qtpcapreplay_32(file, true) == PCAP_MAGIC || qtpcapreplay_32(file, true) == PCAP_MAGIC_NS) ret = qtpcapreplay_pcap(r, file, st.st_size, true, qtpcapreplay_32(file, true) == PCAP_MAGIC_NS);
+		else return errorexit("REPLAY_FILE is not a pcap or pcapng file");
+		if (ret < 0) return -1;
+		if (!r->count) return errorexit("REPLAY_FILE has no packets that fit the device");
+		u_int64_t first = r->packets[0].time;
+		u_int32_t i;
+		for (i = 0; i < r->count; i++) r->packets[i].time = r->packets[i].time > first ? r->packets[i].time - first : 0;
+		fprintf(stderr, "Replaying %u packets from %s", r->count, r->path);
+		if (r->skipped) fprintf(stderr, ", skipped %u that do not fit the device", r->skipped);
+		fprintf(stderr, "\n");
+	}
+	if ((envval = getconf("REPLAY_OUTPUT"))) {
+		struct qtpcapheader header = { PCAP_MAGIC_NS, 2, 4, 0, 0, 65535, session->tun_mode ? LINKTYPE_RAW : LINKTYPE_ETHERNET };
+		if ((r->output = open(envval, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return errorexitp("Could not create REPLAY_OUTPUT");
+		if (write(r->output, &header, sizeof(header)) != sizeof(header)) return errorexitp("Could not write REPLAY_OUTPUT");
+	}
+	session->device_data = r;
+	session->device_read = qtpcapreplay_read;
+	session->device_write = qtpcapreplay_write;
+	session->fd_dev = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (session->fd_dev < 0) return errorexitp("Could not create timerfd");
+	r->start = qtpcapreplay_now();
+	if (r->count) qtpcapreplay_arm(session, r->start);
+	return session->fd_dev;
+#else
+	return errorexit("DEVICE=pcap is only supported on Linux");
+#endif
+}
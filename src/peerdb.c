@@ -0,0 +1,191 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Compiles a tunnel configuration file (see qtrunmulti) into a tunnel database that quicktun -f maps into memory.
+For every tunnel with a PUBLIC_KEY and PRIVATE_KEY the shared key is computed here and stored as SHARED_KEY, so the daemon does not have to do the key agreement for every tunnel at startup.
+The database contains the private keys and shared keys, protect it like the configuration file.
+The output is written to a temporary file and renamed, so a running daemon keeps its mapping of the old database intact.
+*/
+
+#include "common.c"
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+
+struct dbentry {
+	uint32_t section;
+	const char* name;
+	const char* value;
+};
+
+static int compareentries(const void* a, const void* b) {
+	const struct dbentry* x = (const struct dbentry*)a;
+	const struct dbentry* y = (const struct dbentry*)b;
+	if (x->section != y->section) return x->section < y->section ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static char* sharedkey(int section) {
+	unsigned char cpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], csecretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	unsigned char cbefore[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+	char* pk;
+	char* sk;
+	int i;
+	qtconfsection = section;
+	pk = getconfmulti("PUBLIC_KEY");
+	sk = getconfmulti("PRIVATE_KEY");
+	if (!pk || !sk || getconfmulti("SHARED_KEY")) return NULL;
+	if (strlen(pk) != 2 * sizeof(cpublickey) || !hex2bin(cpublickey, pk, sizeof(cpublickey))) return NULL;
+	if (strlen(sk) != 2 * sizeof(csecretkey) || !hex2bin(csecretkey, sk, sizeof(csecretkey))) return NULL;
+	if (crypto_box_curve25519xsalsa20poly1305_beforenm(cbefore, cpublickey, csecretkey)) return NULL;
+	char* hex = malloc(2 * sizeof(cbefore) + 1);
+	if (!hex) return NULL;
+	for (i = 0; i < sizeof(cbefore); i++) sprintf(hex + 2 * i, "%02x", cbefore[i]);
+	memset(csecretkey, 0, sizeof(csecretkey));
+	memset(cbefore, 0, sizeof(cbefore));
+	return hex;
+}
+
+static int writeall(FILE* f, const void* data, size_t len) {
+	return fwrite(data, 1, len, f) == len ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+	const char* input = NULL;
+	const char* output = NULL;
+	int i, j;
+
+	for (i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+			printf("Usage: %s <configuration file> <database file>\n", argv[0]);
+			printf("Please read the documentation at http://wiki.ucis.nl/QuickTun\n");
+			return 0;
+		} else if (!strcmp(a, "-v") || !strcmp(a, "--version")) {
+			printf("UCIS QuickTun "QT_VERSION"\n");
+			return 0;
+		} else if (!input) {
+			input = a;
+		} else if (!output) {
+			output = a;
+		} else {
+			return errorexit("Unexpected command line argument");
+		}
+	}
+	if (!output) return errorexit("Missing configuration or database file argument");
+
+	if (qtloadmulticonfig(input) < 0) return 1;
+	if (qtconfisdb) return errorexit("Input is already a tunnel database");
+
+	//Collect the settings of every section, the first occurence of a name in a section is the one that counts
+	int sections = qtconfsectioncount + 1;
+	struct dbentry* entries = malloc((qtconfcount + sections) * sizeof(struct dbentry));
+	if (!entries) return errorexit("Out of memory");
+	int count = 0;
+	for (i = 0; i < qtconfcount; i++) {
+		entries[count].section = qtconflines[i].section;
+		entries[count].name = qtconflines[i].name;
+		entries[count].value = qtconflines[i].value;
+		count++;
+	}
+	int precomputed = 0;
+	for (i = 1; i < sections; i++) {
+		char* key = sharedkey(i);
+		if (!key) continue;
+		entries[count].section = i;
+		entries[count].name = "SHARED_KEY";
+		entries[count].value = key;
+		count++;
+		precomputed++;
+	}
+	//qsort is not stable, so drop the duplicates before sorting
+	int unique = 0;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < unique; j++) if (entries[j].section == entries[i].section && !strcmp(entries[j].name, entries[i].name)) break;
+		if (j == unique) entries[unique++] = entries[i];
+	}
+	count = unique;
+	qsort(entries, count, sizeof(struct dbentry), compareentries);
+
+	struct qtdbheader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QTDB_MAGIC, 4);
+	header.version = QTDB_VERSION;
+	header.byteorder = QTDB_BYTEORDER;
+	header.sections = sections;
+	header.entries = count;
+
+	//Assign string offsets
+	uint64_t offset = sizeof(header) + (uint64_t)sections * sizeof(struct qtdbsection) + (uint64_t)count * sizeof(struct qtdbentry);
+	struct qtdbsection* dbsections = calloc(sections, sizeof(struct qtdbsection));
+	struct qtdbentry* dbentries = calloc(count ? count : 1, sizeof(struct qtdbentry));
+	if (!dbsections || !dbentries) return errorexit("Out of memory");
+	for (i = 0; i < sections; i++) {
+		dbsections[i].name = offset;
+		offset += strlen(i ? qtconfsections[i] : "") + 1;
+	}
+	for (i = 0; i < count; i++) {
+		struct qtdbsection* s = &dbsections[entries[i].section];
+		if (!s->count) s->first = i;
+		s->count++;
+		dbentries[i].name = offset;
+		offset += strlen(entries[i].name) + 1;
+		dbentries[i].value = offset;
+		offset += strlen(entries[i].value) + 1;
+	}
+	offset++; //the final nul byte
+	if (offset > UINT32_MAX) return errorexit("Tunnel database would be too big");
+	header.size = offset;
+
+	char tmpname[strlen(output) + 5];
+	sprintf(tmpname, "%s.tmp", output);
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) return errorexitp("Could not create database file");
+	FILE* f = fdopen(fd, "wb");
+	if (!f) return errorexitp("Could not create database file");
+	int err = writeall(f, &header, sizeof(header));
+	err |= writeall(f, dbsections, sections * sizeof(struct qtdbsection));
+	err |= writeall(f, dbentries, count * sizeof(struct qtdbentry));
+	for (i = 0; i < sections; i++) {
+		const char* name = i ? qtconfsections[i] : "";
+		err |= writeall(f, name, strlen(name) + 1);
+	}
+	for (i = 0; i < count; i++) {
+		err |= writeall(f, entries[i].name, strlen(entries[i].name) + 1);
+		err |= writeall(f, entries[i].value, strlen(entries[i].value) + 1);
+	}
+	err |= writeall(f, "", 1);
+	if (fflush(f) || fsync(fd)) err = -1;
+	if (fclose(f)) err = -1;
+	if (err) {
+		unlink(tmpname);
+		return errorexitp("Could not write database file");
+	}
+	if (rename(tmpname, output)) {
+		unlink(tmpname);
+		return errorexitp("Could not rename database file");
+	}
+	fprintf(stderr, "Wrote %d tunnels with %d settings, precomputed %d shared keys\n", sections - 1, count, precomputed);
+	return 0;
+}
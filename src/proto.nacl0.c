@@ -40,13 +40,15 @@ static int encode(struct qtsession* sess, char* raw, char* enc, int len) {
 static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
 	struct qt_proto_data_nacl0* d = (struct qt_proto_data_nacl0*)sess->protocol_data;
 	if (len < crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES) {
-		fprintf(stderr, "Short packet received: %d\n", len);
+		QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+		qtlog(QTLOG_WARNING, "Short packet received: %d\n", len);
 		return -1;
 	}
 	len -= crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES;
 	memset(enc, 0, crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES);
 	if (crypto_box_curve25519xsalsa20poly1305_open_afternm((unsigned char*)raw, (unsigned char*)enc, len+crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cnonce, d->cbefore)) {
-		fprintf(stderr, "Decryption failed len=%d\n", len);
+		QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+		qtlog(QTLOG_WARNING, "Decryption failed len=%d\n", len);
 		return -1;
 	}
 	return len;
@@ -60,10 +62,10 @@ static int init(struct qtsession* sess) {
 	unsigned char cpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], csecretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
 	if (!(envval = getconf("PUBLIC_KEY"))) return errorexit("Missing PUBLIC_KEY");
 	if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PUBLIC_KEY length");
-	hex2bin(cpublickey, envval, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES);
+	if (!hex2bin(cpublickey, envval, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES)) return errorexit("Invalid PUBLIC_KEY");
 	if ((envval = getconf("PRIVATE_KEY"))) {
 		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PRIVATE_KEY length");
-		hex2bin(csecretkey, envval, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
+		if (!hex2bin(csecretkey, envval, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY");
 	} else if ((envval = getconf("PRIVATE_KEY_FILE"))) {
 		FILE* pkfile = fopen(envval, "rb");
 		if (!pkfile) return errorexitp("Could not open PRIVATE_KEY_FILE");
@@ -72,7 +74,7 @@ static int init(struct qtsession* sess) {
 		if (pktextsize == crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
 			memcpy(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
 		} else if (pktextsize == 2 * crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
-			hex2bin(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
+			if (!hex2bin(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY_FILE");
 		} else {
 			return errorexit("PRIVATE_KEY length");
 		}
@@ -80,11 +82,19 @@ static int init(struct qtsession* sess) {
 	} else {
 		return errorexit("Missing PRIVATE_KEY");
 	}
-	if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->cbefore, cpublickey, csecretkey))
+	if ((envval = getconf("SHARED_KEY"))) { //precomputed by quicktun.peerdb
+		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES) return errorexit("SHARED_KEY length");
+		if (!hex2bin(d->cbefore, envval, crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES)) return errorexit("Invalid SHARED_KEY");
+	} else if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->cbefore, cpublickey, csecretkey))
 		return errorexit("Encryption key calculation failed");
 	return 0;
 }
 
+static const struct qtpacketrule packetrules[] = {
+	{ crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES, 0xffff, 0, 0 },
+	{ 0 },
+};
+
 struct qtproto qtproto_nacl0 = {
 	1,
 	MAX_PACKET_LEN + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES,
@@ -95,6 +105,8 @@ struct qtproto qtproto_nacl0 = {
 	decode,
 	init,
 	sizeof(struct qt_proto_data_nacl0),
+	NULL,
+	packetrules,
 };
 
 #ifndef COMBINED_BINARY
@@ -26,8 +26,9 @@
 #include "common.c"
 #include "crypto_box_curve25519xsalsa20poly1305.h"
 #include "crypto_scalarmult_curve25519.h"
+#include "epochbox.c"
+#include "replay.c"
 #include <sys/types.h>
-#include <sys/time.h>
 
 struct packedtaia {
 	unsigned char buffer[16];
@@ -37,17 +38,19 @@ struct qt_proto_data_nacltai {
 	unsigned char cenonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
 	unsigned char cdnonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
 	unsigned char cbefore[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
-	struct packedtaia cdtailog[5];
+	struct packedtaia cdtaitop; //newest timestamp received
+	struct packedtaia cdtaistart; //first timestamp received from the current run of the sender
+	struct qtreplay cdreplay; //window over the packet counter in the last 4 bytes of the timestamp
+	struct qtepochbox cebox, cdbox;
 };
 
 #define noncelength 16
 #define nonceoffset (crypto_box_curve25519xsalsa20poly1305_NONCEBYTES - noncelength)
 static const int overhead = crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES + noncelength;
 
-static void taia_now_packed(unsigned char* b, int secoffset) {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	u_int64_t sec = 4611686018427387914ULL + (u_int64_t)now.tv_sec + secoffset;
+static void taia_now_packed(struct qtsession* sess, unsigned char* b, int secoffset) {
+	struct timespec* now = &sess->clock->realtime;
+	u_int64_t sec = 4611686018427387914ULL + (u_int64_t)now->tv_sec + secoffset;
 	b[0] = (sec >> 56) & 0xff;
 	b[1] = (sec >> 48) & 0xff;
 	b[2] = (sec >> 40) & 0xff;
@@ -56,7 +59,7 @@ static void taia_now_packed(unsigned char* b, int secoffset) {
 	b[5] = (sec >> 16) & 0xff;
 	b[6] = (sec >> 8) & 0xff;
 	b[7] = (sec >> 0) & 0xff;
-	u_int32_t nano = 1000 * now.tv_usec + 500;
+	u_int32_t nano = now->tv_nsec;
 	b[8] = (nano >> 24) & 0xff;
 	b[9] = (nano >> 16) & 0xff;
 	b[10] = (nano >> 8) & 0xff;
@@ -67,49 +70,60 @@ static void taia_now_packed(unsigned char* b, int secoffset) {
 //Packet format: <16 bytes taia packed timestamp><16 bytes checksum><n bytes encrypted data>
 
 static int encode(struct qtsession* sess, char* raw, char* enc, int len) {
-	if (debug) fprintf(stderr, "Encoding packet of %d bytes from %p to %p\n", len, raw, enc);
+	qtlogdebug("Encoding packet of %d bytes from %p to %p\n", len, raw, enc);
 	struct qt_proto_data_nacltai* d = (struct qt_proto_data_nacltai*)sess->protocol_data;
 	memset(raw, 0, crypto_box_curve25519xsalsa20poly1305_ZEROBYTES);
-	taia_now_packed(d->cenonce + nonceoffset, 0);
-	if (crypto_box_curve25519xsalsa20poly1305_afternm((unsigned char*)enc, (unsigned char*)raw, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cenonce, d->cbefore))
+	taia_now_packed(sess, d->cenonce + nonceoffset, 0);
+	if (epochbox_afternm(&d->cebox, (unsigned char*)enc, (unsigned char*)raw, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cenonce, d->cbefore))
 		return errorexit("Encryption failed");
 	memcpy((void*)(enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength), d->cenonce + nonceoffset, noncelength);
 	len += overhead;
-	if (debug) fprintf(stderr, "Encoded packet of %d bytes from %p to %p\n", len, raw, enc);
+	qtlogdebug("Encoded packet of %d bytes from %p to %p\n", len, raw, enc);
 	return len;
 }
 
 static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
-	if (debug) fprintf(stderr, "Decoding packet of %d bytes from %p to %p\n", len, enc, raw);
+	qtlogdebug("Decoding packet of %d bytes from %p to %p\n", len, enc, raw);
 	struct qt_proto_data_nacltai* d = (struct qt_proto_data_nacltai*)sess->protocol_data;
 	int i;
 	if (len < overhead) {
-		fprintf(stderr, "Short packet received: %d\n", len);
+		QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+		qtlog(QTLOG_WARNING, "Short packet received: %d\n", len);
 		return -1;
 	}
 	len -= overhead;
-	struct packedtaia* tailog = &d->cdtailog[0];
-	struct packedtaia* taiold = tailog;
-	for (i = 0; i < 5; i++) {
-		if (memcmp(enc, tailog, 16) == 0) {
-			fprintf(stderr, "Duplicate timestamp received\n");
-			return -1;
-		}
-		if (memcmp(tailog, taiold, 16) < 0) taiold = tailog;
-		tailog++;
+	unsigned char* tai = (unsigned char*)enc;
+	u_int64_t seq = ((u_int64_t)tai[12] << 24) | (tai[13] << 16) | (tai[14] << 8) | tai[15];
+	int newrun = 0;
+	if (memcmp(tai, &d->cdtaistart, 16) <= 0) {
+		d->cdreplay.tooold++;
+		QTSTATS_DROP(sess, QTSTAT_LATE, len);
+		qtlog(QTLOG_WARNING, "Timestamp going back, ignoring packet\n");
+		return -1;
 	}
-	if (memcmp(enc, taiold, 16) <= 0) {
-		fprintf(stderr, "Timestamp going back, ignoring packet\n");
+	if (memcmp(tai, &d->cdtaitop, 16) > 0) {
+		//A newer timestamp with a lower packet counter means that the sender has restarted
+		newrun = seq <= d->cdreplay.top;
+	} else if ((i = replay_check(&d->cdreplay, seq))) {
+		QTSTATS_DROP(sess, (i == -2) ? QTSTAT_DUPLICATE : QTSTAT_LATE, len);
+		qtlog(QTLOG_WARNING, (i == -2) ? "Duplicate timestamp received\n" : "Timestamp going back, ignoring packet\n");
 		return -1;
 	}
 	memcpy(d->cdnonce + nonceoffset, enc, noncelength);
 	memset(enc, 0, crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES);
-	if (crypto_box_curve25519xsalsa20poly1305_open_afternm((unsigned char*)raw, (unsigned char*)enc, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cdnonce, d->cbefore)) {
-		fprintf(stderr, "Decryption failed len=%d\n", len);
+	if (epochbox_open_afternm(&d->cdbox, (unsigned char*)raw, (unsigned char*)enc, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cdnonce, d->cbefore)) {
+		QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+		qtlog(QTLOG_WARNING, "Decryption failed len=%d\n", len);
 		return -1;
 	}
-	memcpy(taiold, d->cdnonce + nonceoffset, 16);
-	if (debug) fprintf(stderr, "Decoded packet of %d bytes from %p to %p\n", len, enc, raw);
+	if (newrun) {
+		replay_reset(&d->cdreplay, seq);
+		memcpy(&d->cdtaistart, d->cdnonce + nonceoffset, 16);
+	} else {
+		replay_update(&d->cdreplay, seq);
+	}
+	if (memcmp(d->cdnonce + nonceoffset, &d->cdtaitop, 16) > 0) memcpy(&d->cdtaitop, d->cdnonce + nonceoffset, 16);
+	qtlogdebug("Decoded packet of %d bytes from %p to %p\n", len, enc, raw);
 	return len;
 }
 
@@ -120,10 +134,10 @@ static int init(struct qtsession* sess) {
 	unsigned char cownpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], cpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], csecretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
 	if (!(envval = getconf("PUBLIC_KEY"))) return errorexit("Missing PUBLIC_KEY");
 	if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PUBLIC_KEY length");
-	hex2bin(cpublickey, envval, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES);
+	if (!hex2bin(cpublickey, envval, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES)) return errorexit("Invalid PUBLIC_KEY");
 	if ((envval = getconf("PRIVATE_KEY"))) {
 		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PRIVATE_KEY length");
-		hex2bin(csecretkey, envval, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
+		if (!hex2bin(csecretkey, envval, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY");
 	} else if ((envval = getconf("PRIVATE_KEY_FILE"))) {
 		FILE* pkfile = fopen(envval, "rb");
 		if (!pkfile) return errorexitp("Could not open PRIVATE_KEY_FILE");
@@ -132,7 +146,7 @@ static int init(struct qtsession* sess) {
 		if (pktextsize == crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
 			memcpy(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
 		} else if (pktextsize == 2 * crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
-			hex2bin(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
+			if (!hex2bin(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY_FILE");
 		} else {
 			return errorexit("PRIVATE_KEY length");
 		}
@@ -140,19 +154,24 @@ static int init(struct qtsession* sess) {
 	} else {
 		return errorexit("Missing PRIVATE_KEY");
 	}
-	if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->cbefore, cpublickey, csecretkey))
+	if ((envval = getconf("SHARED_KEY"))) { //precomputed by quicktun.peerdb
+		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES) return errorexit("SHARED_KEY length");
+		if (!hex2bin(d->cbefore, envval, crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES)) return errorexit("Invalid SHARED_KEY");
+	} else if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->cbefore, cpublickey, csecretkey))
 		return errorexit("Encryption key calculation failed");
 
 	memset(d->cenonce, 0, crypto_box_curve25519xsalsa20poly1305_NONCEBYTES);
 	memset(d->cdnonce, 0, crypto_box_curve25519xsalsa20poly1305_NONCEBYTES);
-	memset(d->cdtailog, 0, 5 * 16);
+	memset(&d->cdtaitop, 0, 16);
+	memset(&d->cdtaistart, 0, 16);
+	if (replay_init(&d->cdreplay)) return -1;
+	replay_reset(&d->cdreplay, 0xffffffff); //The first packet received starts a new run of the sender
 
 	crypto_scalarmult_curve25519_base(cownpublickey, csecretkey);
 
 	if ((envval = getconf("TIME_WINDOW"))) {
-		struct packedtaia* tailog = d->cdtailog;
-		taia_now_packed((unsigned char*)&tailog[0], -atol(envval));
-		tailog[4] = tailog[3] = tailog[2] = tailog[1] = tailog[0];
+		taia_now_packed(sess, (unsigned char*)&d->cdtaistart, -atol(envval));
+		d->cdtaitop = d->cdtaistart;
 	} else {
 		fprintf(stderr, "Warning: TIME_WINDOW not set, risking an initial replay attack\n");
 	}
@@ -164,6 +183,11 @@ static int init(struct qtsession* sess) {
 	return 0;
 }
 
+static const struct qtpacketrule packetrules[] = {
+	{ overhead, 0xffff, 0, 0 },
+	{ 0 },
+};
+
 struct qtproto qtproto_nacltai = {
 	1,
 	MAX_PACKET_LEN + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES,
@@ -174,6 +198,8 @@ struct qtproto qtproto_nacltai = {
 	decode,
 	init,
 	sizeof(struct qt_proto_data_nacltai),
+	NULL,
+	packetrules,
 };
 
 #ifndef COMBINED_BINARY
@@ -0,0 +1,281 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+QuickTun nacltai2 protocol
+A successor of the nacltai protocol with a compact packet header. It uses the same PUBLIC_KEY, PRIVATE_KEY, ROLE and TIME_WINDOW configuration as nacltai.
+
+Wire format:
+	8 byte counter + 16 byte checksum + encrypted data
+		counter bit 63 = 0 for data packets
+		counter bits 62..0 = sender start time in microseconds since 1970 shifted left by 11 bits, plus the number of packets sent
+	8 byte counter + 16 byte checksum + encrypted probe
+		counter bit 63 = 1
+		counter bits 62..0 = sender start time in microseconds since 1970 shifted left by 11 bits, plus the number of probes sent
+		encrypted probe = 1 byte type (0 = echo request, 1 = echo reply) + 8 byte id (the counter of the request)
+
+Nonce:
+	15 zero bytes + 1 byte sender role + 8 byte counter
+
+The counter is strictly increasing for each sender, also across restarts, as long as the clock of the sender does not go back and it sends less than 2048 packets per microsecond.
+The first 16 nonce bytes are constant, so the Salsa20 subkey is derived only once (see epochbox.c).
+Instead of checking a timestamp on every packet, the receiver rejects all counters from before TIME_WINDOW seconds ago once at startup, and from then on only accepts counters it has not seen before (see replay.c).
+Because the counter increments by one for every packet, the keystream for the next packets can be precomputed while the tunnel is idle (PRECOMPUTE, see keystream.c).
+Round trip time probes (PROBE_INTERVAL) count separately, so they do not disturb the precomputed keystream. A probe is accepted if its counter is higher than that of the last accepted probe. Peers that do not support probes drop them.
+*/
+
+#include "common.c"
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "epochbox.c"
+#include "keystream.c"
+#include "replay.c"
+#include <sys/types.h>
+
+struct qt_proto_data_nacltai2 {
+	unsigned char cenonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+	unsigned char cdnonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+	unsigned char cbefore[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+	u_int64_t cecounter;
+	u_int64_t cpcounter; //of the last probe sent, including bit 63
+	u_int64_t cdprobecounter; //of the last probe accepted
+	struct qtreplay cdreplay;
+	struct qtepochbox cebox, cdbox;
+	struct qtkeystream cekeystream;
+};
+
+#define noncelength 8
+#define nonceoffset (crypto_box_curve25519xsalsa20poly1305_NONCEBYTES - noncelength)
+static const int overhead = crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES + noncelength;
+
+static u_int64_t counter_now(struct qtsession* sess, int secoffset) {
+	struct timespec* now = &sess->clock->realtime;
+	return (((u_int64_t)(now->tv_sec + secoffset) * 1000000) + now->tv_nsec / 1000) << 11;
+}
+
+static void encodecounter(unsigned char* b, u_int64_t v) {
+	int i;
+	for (i = 7; i >= 0; i--, v >>= 8) b[i] = v & 0xff;
+}
+static u_int64_t decodecounter(unsigned char* b) {
+	u_int64_t v = 0;
+	int i;
+	for (i = 0; i < 8; i++) v = (v << 8) | b[i];
+	return v;
+}
+
+//Packet format: <8 bytes counter><16 bytes checksum><n bytes encrypted data>
+
+#define PROBE_REQUEST 0
+#define PROBE_REPLY 1
+#define probelength (1 + 8)
+
+static bool sendprobepacket(struct qtsession* sess, int type, u_int64_t id) {
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	unsigned char raw[crypto_box_curve25519xsalsa20poly1305_ZEROBYTES + probelength];
+	unsigned char enc[crypto_box_curve25519xsalsa20poly1305_ZEROBYTES + probelength];
+	unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+	memset(raw, 0, crypto_box_curve25519xsalsa20poly1305_ZEROBYTES);
+	raw[crypto_box_curve25519xsalsa20poly1305_ZEROBYTES] = type;
+	encodecounter(raw + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES + 1, id);
+	memcpy(nonce, d->cenonce, nonceoffset);
+	encodecounter(nonce + nonceoffset, ++d->cpcounter);
+	if (epochbox_afternm(&d->cebox, enc, raw, sizeof(raw), nonce, d->cbefore)) return false;
+	memcpy(enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength, nonce + nonceoffset, noncelength);
+	sess->sendnetworkpacket(sess, (char*)enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength, overhead + probelength);
+	return true;
+}
+
+static bool sendprobe(struct qtsession* sess, u_int64_t* id) {
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	*id = d->cpcounter + 1;
+	return sendprobepacket(sess, PROBE_REQUEST, *id);
+}
+
+static int decodeprobe(struct qtsession* sess, char* enc, char* raw, int len, u_int64_t counter) {
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+	if (len != probelength) {
+		QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+		qtlogdebug("Invalid probe received: len=%d\n", len);
+		return -1;
+	}
+	if (counter <= d->cdprobecounter) {
+		QTSTATS_DROP(sess, QTSTAT_LATE, len);
+		qtlogdebug("Late probe received\n");
+		return -1;
+	}
+	memcpy(nonce, d->cdnonce, nonceoffset);
+	memcpy(nonce + nonceoffset, enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength, noncelength);
+	memset(enc, 0, crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES);
+	if (epochbox_open_afternm(&d->cdbox, (unsigned char*)raw, (unsigned char*)enc, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, nonce, d->cbefore)) {
+		QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+		qtlog(QTLOG_WARNING, "Decryption of probe failed len=%d\n", len);
+		return -1;
+	}
+	d->cdprobecounter = counter;
+	unsigned char* probe = (unsigned char*)raw + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
+	u_int64_t id = decodecounter(probe + 1);
+	if (probe[0] == PROBE_REQUEST) sendprobepacket(sess, PROBE_REPLY, id);
+	else if (probe[0] == PROBE_REPLY) qtprobereply(sess, id);
+	return 0;
+}
+
+static int encode(struct qtsession* sess, char* raw, char* enc, int len) {
+	qtlogdebug("Encoding packet of %d bytes from %p to %p\n", len, raw, enc);
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	if (++d->cecounter >> 63) return errorexit("Packet counter exhausted");
+	encodecounter(d->cenonce + nonceoffset, d->cecounter);
+	memset(raw, 0, crypto_box_curve25519xsalsa20poly1305_ZEROBYTES);
+	if (keystream_afternm(&d->cekeystream, &d->cebox, (unsigned char*)enc, (unsigned char*)raw, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cenonce, d->cbefore))
+		return errorexit("Encryption failed");
+	memcpy((void*)(enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength), d->cenonce + nonceoffset, noncelength);
+	len += overhead;
+	qtlogdebug("Encoded packet of %d bytes from %p to %p\n", len, raw, enc);
+	return len;
+}
+
+static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
+	qtlogdebug("Decoding packet of %d bytes from %p to %p\n", len, enc, raw);
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	int i;
+	if (len < overhead) {
+		QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+		qtlog(QTLOG_WARNING, "Short packet received: %d\n", len);
+		return -1;
+	}
+	len -= overhead;
+	u_int64_t counter = decodecounter((unsigned char*)enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength);
+	if (counter >> 63) return decodeprobe(sess, enc, raw, len, counter);
+	if ((i = replay_check(&d->cdreplay, counter))) {
+		QTSTATS_DROP(sess, (i == -2) ? QTSTAT_DUPLICATE : QTSTAT_LATE, len);
+		qtlog(QTLOG_WARNING, (i == -2) ? "Duplicate counter received\n" : "Counter going back, ignoring packet\n");
+		return -1;
+	}
+	memcpy(d->cdnonce + nonceoffset, enc + crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength, noncelength);
+	memset(enc, 0, crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES);
+	if (epochbox_open_afternm(&d->cdbox, (unsigned char*)raw, (unsigned char*)enc, len + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES, d->cdnonce, d->cbefore)) {
+		QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+		qtlog(QTLOG_WARNING, "Decryption failed len=%d\n", len);
+		return -1;
+	}
+	replay_update(&d->cdreplay, counter);
+	qtlogdebug("Decoded packet of %d bytes from %p to %p\n", len, enc, raw);
+	return len;
+}
+
+static int background(struct qtsession* sess) {
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	return keystream_fill(&d->cekeystream, &d->cebox, d->cenonce, d->cbefore, 4);
+}
+
+static int init(struct qtsession* sess) {
+	struct qt_proto_data_nacltai2* d = (struct qt_proto_data_nacltai2*)sess->protocol_data;
+	char* envval;
+	printf("Initializing cryptography...\n");
+	unsigned char cownpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], cpublickey[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES], csecretkey[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+	if (!(envval = getconf("PUBLIC_KEY"))) return errorexit("Missing PUBLIC_KEY");
+	if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PUBLIC_KEY length");
+	if (!hex2bin(cpublickey, envval, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES)) return errorexit("Invalid PUBLIC_KEY");
+	if ((envval = getconf("PRIVATE_KEY"))) {
+		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES) return errorexit("PRIVATE_KEY length");
+		if (!hex2bin(csecretkey, envval, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY");
+	} else if ((envval = getconf("PRIVATE_KEY_FILE"))) {
+		FILE* pkfile = fopen(envval, "rb");
+		if (!pkfile) return errorexitp("Could not open PRIVATE_KEY_FILE");
+		char pktextbuf[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES * 2];
+		const size_t pktextsize = fread(pktextbuf, 1, sizeof(pktextbuf), pkfile);
+		if (pktextsize == crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
+			memcpy(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES);
+		} else if (pktextsize == 2 * crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES) {
+			if (!hex2bin(csecretkey, pktextbuf, crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES)) return errorexit("Invalid PRIVATE_KEY_FILE");
+		} else {
+			return errorexit("PRIVATE_KEY length");
+		}
+		fclose(pkfile);
+	} else {
+		return errorexit("Missing PRIVATE_KEY");
+	}
+	if ((envval = getconf("SHARED_KEY"))) { //precomputed by quicktun.peerdb
+		if (strlen(envval) != 2*crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES) return errorexit("SHARED_KEY length");
+		if (!hex2bin(d->cbefore, envval, crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES)) return errorexit("Invalid SHARED_KEY");
+	} else if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->cbefore, cpublickey, csecretkey))
+		return errorexit("Encryption key calculation failed");
+
+	memset(d->cenonce, 0, crypto_box_curve25519xsalsa20poly1305_NONCEBYTES);
+	memset(d->cdnonce, 0, crypto_box_curve25519xsalsa20poly1305_NONCEBYTES);
+	if (replay_init(&d->cdreplay)) return -1;
+	d->cecounter = counter_now(sess, 0);
+	d->cpcounter = d->cecounter | (1ULL << 63);
+	encodecounter(d->cenonce + nonceoffset, d->cecounter);
+	if (keystream_init(&d->cekeystream)) return -1;
+	if (d->cekeystream.slots) sess->protocol_background = background;
+	sess->sendprobe = sendprobe;
+
+	crypto_scalarmult_curve25519_base(cownpublickey, csecretkey);
+
+	if ((envval = getconf("TIME_WINDOW"))) {
+		replay_reset(&d->cdreplay, counter_now(sess, -atol(envval)));
+		d->cdprobecounter = counter_now(sess, -atol(envval)) | (1ULL << 63);
+	} else {
+		fprintf(stderr, "Warning: TIME_WINDOW not set, risking an initial replay attack\n");
+	}
+	int role = memcmp(cownpublickey, cpublickey, crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES);
+	if ((envval = getconf("ROLE"))) role = atoi(envval) ? 1 : -1;
+	role = (role == 0) ? 0 : ((role > 0) ? 1 : 2);
+	d->cenonce[nonceoffset-1] = role & 1;
+	d->cdnonce[nonceoffset-1] = (role >> 1) & 1;
+	return 0;
+}
+
+//The probe bit of the counter is the top bit of the first byte
+static const struct qtpacketrule packetrules[] = {
+	{ overhead, 0xffff, 0x80, 0x00 }, //data
+	{ overhead + probelength, overhead + probelength, 0x80, 0x80 }, //probe
+	{ 0 },
+};
+
+struct qtproto qtproto_nacltai2 = {
+	1,
+	MAX_PACKET_LEN + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES,
+	MAX_PACKET_LEN + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES,
+	crypto_box_curve25519xsalsa20poly1305_ZEROBYTES,
+	crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES - noncelength,
+	encode,
+	decode,
+	init,
+	sizeof(struct qt_proto_data_nacltai2),
+	NULL,
+	packetrules,
+};
+
+#ifndef COMBINED_BINARY
+int main(int argc, char** argv) {
+	print_header();
+	int rc = qtprocessargs(argc, argv);
+	if (rc <= 0) return rc;
+	return qtrun(&qtproto_nacltai2);
+}
+#endif
@@ -34,12 +34,14 @@ Wire format:
 		flag 6 = sender key id
 		flag 5 = recipient key id
 	8 bit flags + 64 bit time + 16 byte checksum + encrypted data
-		flag 7 = 1
+		flags = 0x80
 		encrypted data = 8 bit flags + 32 byte sender key + 24 byte sender nonce + 32 byte recipient key + 24 byte recipient nonce + 64 bit last received and accepted control timestamp
 			flag 7 = 0
 			flag 6 = sender key id
 			flag 5 = recipient key id
 			flag 4 = is acknowledgment
+			flag 3 = is echo request
+			flag 2 = is echo reply, the last received control timestamp is that of the request
 
 Key update (begin):
 	Generate new key pair <newkey> and nonce <newnonce> (last 4 bytes in nonce should be 0)
@@ -79,8 +81,9 @@ Every 1 minute:
 	If <newkey> is set:
 		Send key update: sender key id = <keyid>, sender key = <key>, nonce = <nonces[<keyid>], recipient key id = <remotekeyid>, recipient key = <remotekey>, recipient nonce = <remotenonce>
 
-Every 10 minutes:
-	Begin key update (if any packets have been sent with current key)
+Every REKEY_INTERVAL seconds (default 300), minus a random delay of up to REKEY_JITTER seconds (default 10% of REKEY_INTERVAL):
+	Begin key update
+	If more than REKEY_RATE key updates per second (default unlimited, burst REKEY_BURST) are started by the sessions in the process, the key update is delayed
 
 When sending packet:
 	If <key> and <remotekey> are set:
@@ -97,35 +100,50 @@ When sending packet:
 		Else
 			Begin key update
 
+Every PROBE_INTERVAL milliseconds, if set:
+	Send key update with echo request set, acknowledgment set if <newkey> is not set
+	A key update with echo request set is answered with a key update with echo reply set once it has been processed
+	Peers that do not know the echo flags ignore them
+
 When receiving packet:
 	if flag 0 == 1
-		If time <= <lastcontroltime> then
+		If the packet length or flags are invalid or time <= <lastcontroltime> then
+			Ignore packet
+		If the source address is not the remote endpoint and more than CONTROL_RATE control packets per second (default 10, burst CONTROL_BURST, default 20) are received from the source addresses sharing its bucket then
 			Ignore packet
 		Decrypt packet
 		Set <lastcontroltime> = time
 		Key update received
 	Else
 		Use decoder decstate[recipient key id][sender key id]
-		Find index and value of lowest value in recenttimes as mintime and mintimeidx
-		If time <= mintime then
+		If time is older than the replay window or has been received before then
 			Ignore packet
 		Decode packet
-		Set recenttimes[mintimeidx] = time
+		Mark time as received in the replay window
 		Write packet to tunnel
 */
 
 #include "common.c"
 #include "crypto_box_curve25519xsalsa20poly1305.h"
 #include "crypto_scalarmult_curve25519.h"
+#include "epochbox.c"
+#include "keystream.c"
+#include "replay.c"
 #include <sys/types.h>
 #include <sys/time.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 
 #define NONCEBYTES crypto_box_curve25519xsalsa20poly1305_NONCEBYTES
 #define BEFORENMBYTES crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES
 #define PRIVATEKEYBYTES crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES
 #define PUBLICKEYBYTES crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES
+#define CONTROLBYTES (1 + 32 + 24 + 32 + 24 + 8)
+#define CONTROLSOURCES 64
+#define CONTROL_ACK (1 << 4)
+#define CONTROL_ECHO (1 << 3)
+#define CONTROL_ECHOREPLY (1 << 2)
 
 typedef unsigned int uint32;
 typedef unsigned long long uint64;
@@ -134,16 +152,53 @@ struct qt_proto_data_salty_decstate {
 	unsigned char remotekey[PUBLICKEYBYTES];
 	unsigned char nonce[NONCEBYTES];
 	unsigned char sharedkey[BEFORENMBYTES];
-	uint32 timestamps[5];
+	struct qtepochbox box;
+	struct qtreplay replay;
 };
 struct qt_proto_data_salty_keyset {
 	unsigned char privatekey[PRIVATEKEYBYTES];
 	unsigned char publickey[PUBLICKEYBYTES];
 	unsigned char sharedkey[BEFORENMBYTES];
 	unsigned char nonce[NONCEBYTES];
+	struct qtepochbox box;
+};
+
+/*
+Key generation and shared key derivation (curve25519) run on a background thread, so packets never wait for them.
+A job derives the shared key of each of its local key sets with remotekey, optionally generating a new key pair for the first key set first.
+When the job is done, the worker wakes up the event loop through the notification pipe of the session, and the results are installed between packets.
+The job is owned by the worker while it is queued.
+*/
+#define SALTY_JOB_IDLE 0
+#define SALTY_JOB_QUEUED 1
+#define SALTY_JOB_DONE 2
+struct qt_proto_data_salty_job {
+	struct qt_proto_data_salty_job* next;
+	int state;
+	int notifyfd;
+	bool generate;
+	bool ok;
+	int count;
+	unsigned char remotekey[PUBLICKEYBYTES];
+	struct qt_proto_data_salty_keyset localkeys[2];
+};
+
+/*
+Recently derived shared keys, indexed by local and remote public key.
+Control packets are repeated every second during a key transition and mostly carry keys that have been seen before, so those are installed without deriving the shared keys again.
+*/
+#define SHAREDKEYCACHESIZE 4
+struct qt_proto_data_salty_sharedkey {
+	unsigned char localkey[PUBLICKEYBYTES];
+	unsigned char remotekey[PUBLICKEYBYTES];
+	unsigned char sharedkey[BEFORENMBYTES];
+	uint64 lastused; //0 if the entry is empty
 };
+
 struct qt_proto_data_salty {
-	time_t lastkeyupdate, lastkeyupdatesent;
+	struct qttimer rekeytimer; //begin the next key update
+	struct qttimer resendtimer; //repeat the key update until it has been acknowledged
+	unsigned int rekeyinterval, rekeyjitter; //milliseconds
 	unsigned char controlkey[BEFORENMBYTES];
 	int controlroles;
 	uint64 controldecodetime;
@@ -156,6 +211,17 @@ struct qt_proto_data_salty {
 	unsigned char dataremotekey[PUBLICKEYBYTES];
 	unsigned char dataremotenonce[NONCEBYTES];
 	struct qt_proto_data_salty_decstate datadecoders[4];
+	bool controlpending;
+	int controlreply; //1: the remote wants a reply, 2: the reply must not be an acknowledgment, 4: the remote sent an echo request
+	unsigned char controlbody[CONTROLBYTES];
+	struct qt_proto_data_salty_job derivejob; //shared keys for a received control packet
+	struct qt_proto_data_salty_job sparejob; //pre-generated key set for the next key update
+	struct qt_proto_data_salty_sharedkey sharedkeys[SHAREDKEYCACHESIZE];
+	uint64 sharedkeyclock;
+	struct qtkeystream keystream; //precomputed keystream for the current encoder
+	struct ratelimit* controlsources; //CONTROLSOURCES token buckets for control packets, indexed by a hash of the source address
+	uint32 controlseed;
+	uint64 controlrate, controlburst;
 };
 
 static void encodeuint32(char* b, uint32 v) {
@@ -183,44 +249,172 @@ static uint64 decodeuint64(char* sb) {
 	return ((uint64)b[0] << 56) | ((uint64)b[1] << 48) | ((uint64)b[2] << 40) | ((uint64)b[3] << 32) | ((uint64)b[4] << 24) | ((uint64)b[5] << 16) | ((uint64)b[6] << 8) | (uint64)b[7];
 }
 
-static int devurandomfd = -1;
+//Token bucket, rate and burst in tokens per second and tokens, level in thousandths of a token
+struct ratelimit {
+	uint64 rate;
+	uint64 burst;
+	uint64 level;
+	uint64 last; //milliseconds
+};
 
-static void dumphex(char* lbl, unsigned char* buffer, int len) {
-	fprintf(stderr, "%s: ", lbl);
-	for (; len > 0; len--, buffer++) fprintf(stderr, "%02x", *buffer);
-	fprintf(stderr, "\n");
-}
-
-static bool randombytes(unsigned char* buffer, int len) {
-	if (devurandomfd == -1) devurandomfd = open("/dev/urandom", O_RDONLY);
-	if (devurandomfd == -1) return false;
-	while (len > 0) {
-		int got = read(devurandomfd, buffer, len);
-		if (got < 0) return false;
-		buffer += got;
-		len -= got;
+static void ratelimit_init(struct ratelimit* r, uint64 rate, uint64 burst, uint64 now) {
+	r->rate = rate;
+	r->burst = burst ? burst : 1;
+	r->level = r->burst * 1000;
+	r->last = now;
+}
+
+//Take a token, returns 0 on success or the number of milliseconds until the next token is available
+static uint64 ratelimit_take(struct ratelimit* r, uint64 now) {
+	if (!r->rate) return 0;
+	if (now > r->last) r->level += (now - r->last) * r->rate;
+	r->last = now;
+	if (r->level > r->burst * 1000) r->level = r->burst * 1000;
+	if (r->level >= 1000) {
+		r->level -= 1000;
+		return 0;
 	}
+	return (1000 - r->level + r->rate - 1) / r->rate;
+}
+
+static uint64 monotonicms(struct qtsession* sess) {
+	return (uint64)sess->clock->monotonic.tv_sec * 1000 + sess->clock->monotonic.tv_nsec / 1000000;
+}
+
+//Key updates started by the rekey timers of all sessions in the process
+static struct ratelimit rekeybudget;
+static bool rekeybudgetset = false;
+
+static void dumphex(char* lbl, unsigned char* buffer, int len) {
+	char hex[2 * 32 + 1];
+	int i;
+	if (len > 32) len = 32;
+	for (i = 0; i < len; i++) sprintf(hex + 2 * i, "%02x", buffer[i]);
+	hex[2 * len] = 0;
+	qtlogdebug("%s: %s\n", lbl, hex);
+}
+
+static bool generatekey(struct qt_proto_data_salty_keyset* k) {
+	if (qtrandom(k->nonce, 20)) return false;
+	if (qtrandom(k->privatekey, PRIVATEKEYBYTES)) return false;
+	crypto_scalarmult_curve25519_base(k->publickey, k->privatekey);
+	memset(k->nonce + 20, 0, 4);
 	return true;
 }
 
-static void initdecoder(struct qt_proto_data_salty_decstate* d, unsigned char rkey[], unsigned char lkey[], unsigned char nonce[]) {
-	memcpy(d->remotekey, rkey, PUBLICKEYBYTES);
-	memcpy(d->nonce, nonce, NONCEBYTES);
-	memset(d->timestamps, 0, 5 * sizeof(uint32));
-	if (debug) dumphex("INIT DECODER SK", lkey, 32);
-	if (debug) dumphex("INIT DECODER RK", rkey, 32);
-	if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->sharedkey, rkey, lkey)) {
+static void derivekey(struct qt_proto_data_salty_keyset* k, unsigned char rkey[]) {
+	if (qtdebug) dumphex("INIT DECODER SK", k->privatekey, 32);
+	if (qtdebug) dumphex("INIT DECODER RK", rkey, 32);
+	if (crypto_box_curve25519xsalsa20poly1305_beforenm(k->sharedkey, rkey, k->privatekey)) {
 		errorexit("Encryption key calculation failed");
 		abort();
 	}
 }
 
-static void sendkeyupdate(struct qtsession* sess, bool ack) {
+static void initdecoder(struct qt_proto_data_salty_decstate* d, unsigned char rkey[], unsigned char sharedkey[], unsigned char nonce[]) {
+	//A repeated control packet does not change the decoder, keep its replay window
+	if (!memcmp(d->remotekey, rkey, PUBLICKEYBYTES) && !memcmp(d->nonce, nonce, 20) && !memcmp(d->sharedkey, sharedkey, BEFORENMBYTES)) return;
+	memcpy(d->remotekey, rkey, PUBLICKEYBYTES);
+	memcpy(d->nonce, nonce, NONCEBYTES);
+	memcpy(d->sharedkey, sharedkey, BEFORENMBYTES);
+	replay_reset(&d->replay, 0);
+}
+
+static unsigned char* findsharedkey(struct qt_proto_data_salty* d, unsigned char lkey[], unsigned char rkey[]) {
+	int i;
+	for (i = 0; i < SHAREDKEYCACHESIZE; i++) {
+		struct qt_proto_data_salty_sharedkey* e = &d->sharedkeys[i];
+		if (!e->lastused || memcmp(e->localkey, lkey, PUBLICKEYBYTES) || memcmp(e->remotekey, rkey, PUBLICKEYBYTES)) continue;
+		e->lastused = ++d->sharedkeyclock;
+		return e->sharedkey;
+	}
+	return NULL;
+}
+
+static void storesharedkey(struct qt_proto_data_salty* d, unsigned char lkey[], unsigned char rkey[], unsigned char sharedkey[]) {
+	struct qt_proto_data_salty_sharedkey* e = &d->sharedkeys[0];
+	int i;
+	for (i = 0; i < SHAREDKEYCACHESIZE; i++) {
+		struct qt_proto_data_salty_sharedkey* c = &d->sharedkeys[i];
+		if (c->lastused && !memcmp(c->localkey, lkey, PUBLICKEYBYTES) && !memcmp(c->remotekey, rkey, PUBLICKEYBYTES)) {
+			e = c;
+			break;
+		}
+		if (c->lastused < e->lastused) e = c;
+	}
+	memcpy(e->localkey, lkey, PUBLICKEYBYTES);
+	memcpy(e->remotekey, rkey, PUBLICKEYBYTES);
+	memcpy(e->sharedkey, sharedkey, BEFORENMBYTES);
+	e->lastused = ++d->sharedkeyclock;
+}
+
+static pthread_mutex_t workerlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workercond = PTHREAD_COND_INITIALIZER;
+static struct qt_proto_data_salty_job* workerqueue = NULL;
+static bool workerstarted = false;
+
+static void* worker(void* arg) {
+	pthread_mutex_lock(&workerlock);
+	while (true) {
+		while (!workerqueue) pthread_cond_wait(&workercond, &workerlock);
+		struct qt_proto_data_salty_job* job = workerqueue;
+		workerqueue = job->next;
+		pthread_mutex_unlock(&workerlock);
+		int i;
+		job->ok = !job->generate || generatekey(&job->localkeys[0]);
+		if (job->ok) for (i = 0; i < job->count; i++) derivekey(&job->localkeys[i], job->remotekey);
+		pthread_mutex_lock(&workerlock);
+		job->state = SALTY_JOB_DONE;
+		write(job->notifyfd, "", 1);
+	}
+	return NULL;
+}
+
+static int startworker() {
+	pthread_t thread;
+	if (workerstarted) return 0;
+	if (pthread_create(&thread, NULL, worker, NULL)) return errorexit("Could not start key generation thread");
+	pthread_detach(thread);
+	workerstarted = true;
+	return 0;
+}
+
+static void postjob(struct qt_proto_data_salty_job* job) {
+	struct qt_proto_data_salty_job** tail;
+	pthread_mutex_lock(&workerlock);
+	job->state = SALTY_JOB_QUEUED;
+	job->next = NULL;
+	for (tail = &workerqueue; *tail; tail = &(*tail)->next) ;
+	*tail = job;
+	pthread_cond_signal(&workercond);
+	pthread_mutex_unlock(&workerlock);
+}
+
+static int jobstate(struct qt_proto_data_salty_job* job) {
+	pthread_mutex_lock(&workerlock);
+	int state = job->state;
+	pthread_mutex_unlock(&workerlock);
+	return state;
+}
+
+static void requestsparekey(struct qtsession* sess, bool generate) {
+	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
+	struct qt_proto_data_salty_job* job = &d->sparejob;
+	if (jobstate(job) == SALTY_JOB_QUEUED) return;
+	if (!generate && (!job->ok || !memcmp(job->remotekey, d->dataremotekey, PUBLICKEYBYTES))) return;
+	job->generate = generate;
+	job->count = 1;
+	memcpy(job->remotekey, d->dataremotekey, PUBLICKEYBYTES);
+	postjob(job);
+}
+
+//flags is a combination of CONTROL_ACK, CONTROL_ECHO and CONTROL_ECHOREPLY
+static void sendkeyupdate(struct qtsession* sess, int flags) {
 	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
 	unsigned char buffer[32 + (1 + 32 + 24 + 32 + 24 + 8)];
 	int keyid = (d->datalocalkeynextid == -1) ? d->datalocalkeyid : d->datalocalkeynextid;
-	if (debug) fprintf(stderr, "Sending key update nlkid=%d, rkid=%d, ack=%d\n", keyid, d->dataremotekeyid, ack);
-	buffer[32] = (0 << 7) | (keyid << 6) | (d->dataremotekeyid << 5) | (ack ? (1 << 4) : (0 << 4));
+	qtlogdebug("Sending key update nlkid=%d, rkid=%d, flags=%d\n", keyid, d->dataremotekeyid, flags);
+	buffer[32] = (0 << 7) | (keyid << 6) | (d->dataremotekeyid << 5) | flags;
 	memcpy(buffer + 32 + 1, d->datalocalkeys[keyid].publickey, 32);
 	memcpy(buffer + 32 + 1 + 32, d->datalocalkeys[keyid].nonce, 24);
 	memcpy(buffer + 32 + 1 + 32 + 24, d->dataremotekey, 32);
@@ -237,34 +431,164 @@ static void sendkeyupdate(struct qtsession* sess, bool ack) {
 	memcpy(encbuffer + 16 - 8, nonce + 16, 8);
 	encbuffer[16 - 1 - 8] = 0x80;
 	if (sess->sendnetworkpacket) sess->sendnetworkpacket(sess, (char*)encbuffer + 16 - 1 - 8, 1 + 8 + 16 + (1 + 32 + 24 + 32 + 24 + 8));
-	d->lastkeyupdatesent = time(NULL);
+	if (d->datalocalkeynextid != -1) qttimer_start(&d->resendtimer, 2000, 0);
 }
 
 static bool beginkeyupdate(struct qtsession* sess) {
 	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
 	d->datalocalkeynextid = (d->datalocalkeyid + 1) % 2;
-	if (debug) fprintf(stderr, "Beginning key update nlkid=%d, rkid=%d\n", d->datalocalkeynextid, d->dataremotekeyid);
+	QTPROBE(rekey_start, sess->id, 0, d->datalocalkeynextid);
+	qtlogdebug("Beginning key update nlkid=%d, rkid=%d\n", d->datalocalkeynextid, d->dataremotekeyid);
 	struct qt_proto_data_salty_keyset* enckey = &d->datalocalkeys[d->datalocalkeynextid];
-	if (!randombytes(enckey->nonce, 20)) return false;
-	if (!randombytes(enckey->privatekey, PRIVATEKEYBYTES)) return false;
-	crypto_scalarmult_curve25519_base(enckey->publickey, enckey->privatekey);
-	memset(enckey->nonce + 20, 0, 4);
-	if (debug) dumphex("New public key", enckey->publickey, 32);
-	if (debug) dumphex("New base nonce", enckey->nonce, 24);
-	initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | d->datalocalkeynextid], d->dataremotekey, enckey->privatekey, d->dataremotenonce);
-	sendkeyupdate(sess, false);
-	d->lastkeyupdate = time(NULL);
+	struct qt_proto_data_salty_job* spare = &d->sparejob;
+	if (jobstate(spare) == SALTY_JOB_DONE && spare->ok) {
+		*enckey = spare->localkeys[0];
+		spare->ok = false;
+		if (memcmp(spare->remotekey, d->dataremotekey, PUBLICKEYBYTES)) derivekey(enckey, d->dataremotekey);
+	} else {
+		qtlogdebug("No pre-generated key available\n");
+		if (!generatekey(enckey)) return false;
+		derivekey(enckey, d->dataremotekey);
+	}
+	storesharedkey(d, enckey->publickey, d->dataremotekey, enckey->sharedkey);
+	requestsparekey(sess, true);
+	if (qtdebug) dumphex("New public key", enckey->publickey, 32);
+	if (qtdebug) dumphex("New base nonce", enckey->nonce, 24);
+	initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | d->datalocalkeynextid], d->dataremotekey, enckey->sharedkey, d->dataremotenonce);
+	sendkeyupdate(sess, 0);
+	uint32 jitter = 0;
+	if (d->rekeyjitter && !qtrandom((unsigned char*)&jitter, sizeof(jitter))) jitter %= d->rekeyjitter;
+	qttimer_start(&d->rekeytimer, d->rekeyinterval - jitter, 0);
+	sess->stats->rekeys++;
 	return true;
 }
 
-static void beginkeyupdateifnecessary(struct qtsession* sess) {
+static void rekeytimer(struct qttimer* t) {
+	struct qtsession* sess = (struct qtsession*)t->data;
+	uint64 wait = ratelimit_take(&rekeybudget, monotonicms(sess));
+	if (wait) {
+		qtlogdebug("Rekey budget exhausted, delaying key update by %llu ms\n", wait);
+		qttimer_start(t, wait, 0);
+		return;
+	}
+	beginkeyupdate(sess);
+}
+
+static void resendtimer(struct qttimer* t) {
+	struct qtsession* sess = (struct qtsession*)t->data;
+	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
+	if (d->datalocalkeynextid != -1) sendkeyupdate(sess, 0);
+}
+
+//Apply the most recent control packet once the shared keys for its sender key are available
+static void processcontrol(struct qtsession* sess) {
 	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
-	time_t t = time(NULL);
-	if (t - d->lastkeyupdate > 300) {
-		beginkeyupdate(sess);
-	} else if (d->datalocalkeynextid != -1 && t - d->lastkeyupdatesent > 1) {
-		sendkeyupdate(sess, false);
+	struct qt_proto_data_salty_job* job = &d->derivejob;
+	unsigned char* sharedkeys[2];
+	int i;
+	if (!d->controlpending) return;
+	int state = jobstate(job);
+	if (state == SALTY_JOB_QUEUED) return;
+	if (state == SALTY_JOB_DONE) {
+		if (job->ok) for (i = 0; i < job->count; i++) storesharedkey(d, job->localkeys[i].publickey, job->remotekey, job->localkeys[i].sharedkey);
+		job->state = SALTY_JOB_IDLE;
+	}
+	unsigned char* body = d->controlbody;
+	job->count = 0;
+	for (i = 0; i < 2; i++) {
+		sharedkeys[i] = findsharedkey(d, d->datalocalkeys[i].publickey, body + 1);
+		if (!sharedkeys[i]) job->localkeys[job->count++] = d->datalocalkeys[i];
+	}
+	if (state != SALTY_JOB_DONE) {
+		sess->stats->sharedkeyhits += 2 - job->count;
+		sess->stats->sharedkeymisses += job->count;
+		qtlogdebug("Shared key cache: %llu hits, %llu misses\n", (unsigned long long)sess->stats->sharedkeyhits, (unsigned long long)sess->stats->sharedkeymisses);
+	}
+	if (job->count) {
+		job->generate = false;
+		memcpy(job->remotekey, body + 1, 32);
+		postjob(job);
+		return;
+	}
+	d->controlpending = false;
+	int dosendkeyupdate = d->controlreply;
+	d->controlreply = 0;
+	int cflags = body[0];
+	d->dataremotekeyid = (cflags >> 6) & 0x01;
+	int lkeyid = (cflags >> 5) & 0x01;
+	memcpy(d->dataremotekey, body + 1, 32);
+	memcpy(d->dataremotenonce, body + 1 + 32, 24);
+	struct qt_proto_data_salty_keyset* enckey = &d->datalocalkeys[lkeyid];
+	if (memcmp(enckey->publickey, body + 1 + 32 + 24, 32) || memcmp(enckey->nonce, body + 1 + 32 + 24 + 32, 20)) {
+		dosendkeyupdate |= 2;
+		lkeyid = -1;
 	}
+	initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | 0x00], d->dataremotekey, sharedkeys[0], d->dataremotenonce);
+	initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | 0x01], d->dataremotekey, sharedkeys[1], d->dataremotenonce);
+	if (lkeyid != -1 && lkeyid == d->datalocalkeynextid) {
+		d->datalocalkeyid = lkeyid;
+		d->datalocalkeynextid = -1;
+		QTPROBE(rekey_end, sess->id, 0, lkeyid);
+	}
+	if (lkeyid == d->datalocalkeyid) {
+		memcpy(enckey->sharedkey, sharedkeys[lkeyid], BEFORENMBYTES);
+		d->dataencoder = enckey;
+	}
+	qtlogdebug("Decoded control packet: rkid=%d, lkid=%d, ack=%d, lkvalid=%d, uptodate=%d\n", d->dataremotekeyid, (cflags >> 5) & 0x01, (cflags >> 4) & 0x01, lkeyid != -1, d->datalocalkeynextid == -1);
+	if (d->datalocalkeynextid != -1) dosendkeyupdate |= 2;
+	if (dosendkeyupdate) sendkeyupdate(sess, ((dosendkeyupdate & 2) ? 0 : CONTROL_ACK) | ((dosendkeyupdate & 4) ? CONTROL_ECHOREPLY : 0));
+	requestsparekey(sess, false);
+}
+
+//The address and port of a source as bytes, returns their length
+static int controlsource(sockaddr_any* a, unsigned char* addr) {
+	if (a->any.sa_family == AF_INET) {
+		memcpy(addr, &a->ip4.sin_addr, 4);
+		memcpy(addr + 4, &a->ip4.sin_port, 2);
+		return 4 + 2;
+	} else if (a->any.sa_family == AF_INET6) {
+		memcpy(addr, &a->ip6.sin6_addr, 16);
+		memcpy(addr + 16, &a->ip6.sin6_port, 2);
+		return 16 + 2;
+	}
+	return 0;
+}
+
+/*
+Charge a received control packet to its source address, returns false if the source has exceeded its rate.
+The remote endpoint is never charged: its address is configured or taken from authenticated packets, and forged packets with that address must not be able to drop the key updates of the peer. A connected socket (no source address) only receives from the remote endpoint.
+Other sources share the buckets their addresses hash to, so a flood from changing addresses drains the buckets instead of starting with a fresh burst for every address.
+*/
+static bool controlallowed(struct qtsession* sess) {
+	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
+	unsigned char addr[16 + 2], remote[16 + 2];
+	int addrlen, i;
+	if (!d->controlrate || !sess->recv_addr) return true;
+	addrlen = controlsource(sess->recv_addr, addr);
+	if (sess->remote_float == 2 && controlsource(&sess->remote_addr, remote) == addrlen && !memcmp(addr, remote, addrlen)) return true;
+	uint32 h = 2166136261U ^ d->controlseed;
+	for (i = 0; i < addrlen; i++) h = (h ^ addr[i]) * 16777619U;
+	return ratelimit_take(&d->controlsources[h % CONTROLSOURCES], monotonicms(sess)) == 0;
+}
+
+static void protocolevent(struct qtsession* sess) {
+	char buffer[16];
+	while (read(sess->fd_protocol, buffer, sizeof(buffer)) > 0) ;
+	processcontrol(sess);
+}
+
+static bool sendprobe(struct qtsession* sess, u_int64_t* id) {
+	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
+	sendkeyupdate(sess, ((d->datalocalkeynextid == -1) ? CONTROL_ACK : 0) | CONTROL_ECHO);
+	*id = d->controlencodetime;
+	return true;
+}
+
+static int background(struct qtsession* sess) {
+	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
+	struct qt_proto_data_salty_keyset* e = d->dataencoder;
+	if (!e) return 0;
+	return keystream_fill(&d->keystream, &e->box, e->nonce, e->sharedkey, 4);
 }
 
 static int init(struct qtsession* sess) {
@@ -274,10 +598,10 @@ static int init(struct qtsession* sess) {
 	unsigned char cpublickey[PUBLICKEYBYTES], csecretkey[PRIVATEKEYBYTES];
 	if (!(envval = getconf("PUBLIC_KEY"))) return errorexit("Missing PUBLIC_KEY");
 	if (strlen(envval) != 2*PUBLICKEYBYTES) return errorexit("PUBLIC_KEY length");
-	hex2bin(cpublickey, envval, PUBLICKEYBYTES);
+	if (!hex2bin(cpublickey, envval, PUBLICKEYBYTES)) return errorexit("Invalid PUBLIC_KEY");
 	if ((envval = getconf("PRIVATE_KEY"))) {
 		if (strlen(envval) != 2 * PUBLICKEYBYTES) return errorexit("PRIVATE_KEY length");
-		hex2bin(csecretkey, envval, PRIVATEKEYBYTES);
+		if (!hex2bin(csecretkey, envval, PRIVATEKEYBYTES)) return errorexit("Invalid PRIVATE_KEY");
 	} else if ((envval = getconf("PRIVATE_KEY_FILE"))) {
 		FILE* pkfile = fopen(envval, "rb");
 		if (!pkfile) return errorexitp("Could not open PRIVATE_KEY_FILE");
@@ -286,7 +610,7 @@ static int init(struct qtsession* sess) {
 		if (pktextsize == PRIVATEKEYBYTES) {
 			memcpy(csecretkey, pktextbuf, PRIVATEKEYBYTES);
 		} else if (pktextsize == 2 * PRIVATEKEYBYTES) {
-			hex2bin(csecretkey, pktextbuf, PRIVATEKEYBYTES);
+			if (!hex2bin(csecretkey, pktextbuf, PRIVATEKEYBYTES)) return errorexit("Invalid PRIVATE_KEY_FILE");
 		} else {
 			return errorexit("PRIVATE_KEY length");
 		}
@@ -294,38 +618,81 @@ static int init(struct qtsession* sess) {
 	} else {
 		return errorexit("Missing PRIVATE_KEY");
 	}
-	if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->controlkey, cpublickey, csecretkey))
+	if ((envval = getconf("SHARED_KEY"))) { //precomputed by quicktun.peerdb
+		if (strlen(envval) != 2 * BEFORENMBYTES) return errorexit("SHARED_KEY length");
+		if (!hex2bin(d->controlkey, envval, BEFORENMBYTES)) return errorexit("Invalid SHARED_KEY");
+	} else if (crypto_box_curve25519xsalsa20poly1305_beforenm(d->controlkey, cpublickey, csecretkey))
 		return errorexit("Encryption key calculation failed");
+	int i;
+	for (i = 0; i < 4; i++) if (replay_init(&d->datadecoders[i].replay)) return -1;
+	int notifyfds[2];
+	if (pipe(notifyfds)) return errorexitp("Could not create notification pipe");
+	fcntl(notifyfds[0], F_SETFL, O_NONBLOCK);
+	fcntl(notifyfds[1], F_SETFL, O_NONBLOCK);
+	d->derivejob.notifyfd = d->sparejob.notifyfd = notifyfds[1];
+	sess->fd_protocol = notifyfds[0];
+	sess->protocol_event = protocolevent;
+	sess->sendprobe = sendprobe;
+	if (startworker()) return -1;
+	if (keystream_init(&d->keystream)) return -1;
+	if (d->keystream.slots) sess->protocol_background = background;
+	d->controlrate = 10;
+	if ((envval = getconf("CONTROL_RATE"))) d->controlrate = atoi(envval);
+	d->controlburst = 2 * d->controlrate;
+	if ((envval = getconf("CONTROL_BURST"))) d->controlburst = atoi(envval);
+	if (d->controlrate > 1000000 || d->controlburst > 1000000) return errorexit("CONTROL_RATE or CONTROL_BURST out of range");
+	if (d->controlrate) {
+		d->controlsources = calloc(CONTROLSOURCES, sizeof(struct ratelimit));
+		if (!d->controlsources) return errorexit("Could not allocate control rate limit table");
+		for (i = 0; i < CONTROLSOURCES; i++) ratelimit_init(&d->controlsources[i], d->controlrate, d->controlburst, monotonicms(sess));
+		if (qtrandom((unsigned char*)&d->controlseed, sizeof(d->controlseed))) return errorexit("Could not get random data");
+	}
 	unsigned char cownpublickey[PUBLICKEYBYTES];
 	crypto_scalarmult_curve25519_base(cownpublickey, csecretkey);
 	int role = memcmp(cownpublickey, cpublickey, PUBLICKEYBYTES);
 	d->controlroles = (role == 0) ? 0 : ((role > 0) ? 1 : 2);
 	d->controldecodetime = 0;
-	d->controlencodetime = ((uint64)time(NULL)) << 8;
+	d->controlencodetime = ((uint64)sess->clock->realtime.tv_sec) << 8;
 	d->datalocalkeyid = 0;
 	d->datalocalkeynextid = -1;
 	d->dataremotekeyid = 0;
+	d->rekeyinterval = 300;
+	if ((envval = getconf("REKEY_INTERVAL"))) d->rekeyinterval = atoi(envval);
+	if (d->rekeyinterval < 10 || d->rekeyinterval > 86400) return errorexit("REKEY_INTERVAL out of range");
+	d->rekeyjitter = d->rekeyinterval / 10;
+	if ((envval = getconf("REKEY_JITTER"))) d->rekeyjitter = atoi(envval);
+	if (d->rekeyjitter >= d->rekeyinterval) return errorexit("REKEY_JITTER must be less than REKEY_INTERVAL");
+	d->rekeyinterval *= 1000;
+	d->rekeyjitter *= 1000;
+	if (!rekeybudgetset) {
+		uint64 rate = 0, burst = 0;
+		if ((envval = getconf("REKEY_RATE"))) rate = atoi(envval);
+		if ((envval = getconf("REKEY_BURST"))) burst = atoi(envval);
+		if (rate > 1000000 || burst > 1000000) return errorexit("REKEY_RATE or REKEY_BURST out of range");
+		ratelimit_init(&rekeybudget, rate, burst ? burst : rate, monotonicms(sess));
+		rekeybudgetset = true;
+	}
+	qttimer_init(&d->rekeytimer, rekeytimer, sess);
+	qttimer_init(&d->resendtimer, resendtimer, sess);
 	beginkeyupdate(sess);
 	d->datalocalkeyid = d->datalocalkeynextid;
-	sess->poll_timeout = 5000;
 	return 0;
 }
 
 static int encode(struct qtsession* sess, char* raw, char* enc, int len) {
-	beginkeyupdateifnecessary(sess);
 	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
 	struct qt_proto_data_salty_keyset* e = d->dataencoder;
 	if (!e) {
-		if (debug) fprintf(stderr, "Discarding outgoing packet of %d bytes because encoder is not available\n", len);
+		qtlogdebug("Discarding outgoing packet of %d bytes because encoder is not available\n", len);
 		return 0;
 	}
-	if (debug) fprintf(stderr, "Encoding packet of %d bytes from %p to %p\n", len, raw, enc);
+	qtlogdebug("Encoding packet of %d bytes from %p to %p\n", len, raw, enc);
 	//Check if nonce has exceeded half of maximum value (key update) or has exceeded maximum value (drop packet)
 	if (e->nonce[20] & 0xF0) {
 		if (d->datalocalkeynextid == -1) {
 			beginkeyupdate(sess);
 		} else {
-			sendkeyupdate(sess, false);
+			sendkeyupdate(sess, 0);
 		}
 		if (e->nonce[20] & 0xE0) return 0;
 	}
@@ -333,50 +700,39 @@ static int encode(struct qtsession* sess, char* raw, char* enc, int len) {
 	int i;
 	for (i = NONCEBYTES - 1; i >= 0 && ++e->nonce[i] == 0; i--) ;
 	if (e->nonce[20] & 0xE0) return 0;
-	if (debug) dumphex("ENCODE KEY", e->sharedkey, 32);
+	if (qtdebug) dumphex("ENCODE KEY", e->sharedkey, 32);
 	memset(raw, 0, crypto_box_curve25519xsalsa20poly1305_ZEROBYTES);
-	if (crypto_box_curve25519xsalsa20poly1305_afternm((unsigned char*)enc, (unsigned char*)raw, len + 32, e->nonce, e->sharedkey)) return errorexit("Encryption failed");
+	if (keystream_afternm(&d->keystream, &e->box, (unsigned char*)enc, (unsigned char*)raw, len + 32, e->nonce, e->sharedkey)) return errorexit("Encryption failed");
 	enc[12] = (e->nonce[20] & 0x1F) | (0 << 7) | (d->datalocalkeyid << 6) | (d->dataremotekeyid << 5);
 	enc[13] = e->nonce[21];
 	enc[14] = e->nonce[22];
 	enc[15] = e->nonce[23];
-	if (debug) fprintf(stderr, "Encoded packet of %d bytes to %d bytes\n", len, len + 16 + 4);
+	qtlogdebug("Encoded packet of %d bytes to %d bytes\n", len, len + 16 + 4);
 	return len + 16 + 4;
 }
 
 static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
-	beginkeyupdateifnecessary(sess);
 	int i;
 	struct qt_proto_data_salty* d = (struct qt_proto_data_salty*)sess->protocol_data;
 	if (len < 1) {
-		fprintf(stderr, "Short packet received: %d\n", len);
+		QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+		qtlog(QTLOG_WARNING, "Short packet received: %d\n", len);
 		return -1;
 	}
 	int flags = (unsigned char)enc[12];
 	if (!(flags & 0x80)) {
 		//<12 byte padding>|<4 byte timestamp><n+16 bytes encrypted data>
 		if (len < 4 + 16) {
-			fprintf(stderr, "Short data packet received: %d\n", len);
+			QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+			qtlog(QTLOG_WARNING, "Short data packet received: %d\n", len);
 			return -1;
 		}
 		struct qt_proto_data_salty_decstate* dec = &d->datadecoders[(flags >> 5) & 0x03];
 		uint32 ts = decodeuint32(enc + 12) & 0x1FFFFFFF;
-		if (debug) fprintf(stderr, "Decoding data packet of %d bytes with timestamp %u and flags %d\n", len, ts, flags & 0xE0);
-		int ltsi = 0;
-		uint32 ltsv = 0xFFFFFFFF;
-		for (i = 0; i < 5; i++) {
-			uint32 v = dec->timestamps[i];
-			if (ts == v) {
-				fprintf(stderr, "Duplicate data packet received: %u\n", ts);
-				return -1;
-			}
-			if (v < ltsv) {
-				ltsi = i;
-				ltsv = v;
-			}
-		}
-		if (ts <= ltsv) {
-			fprintf(stderr, "Late data packet received: %u\n", ts);
+		qtlogdebug("Decoding data packet of %d bytes with timestamp %u and flags %d\n", len, ts, flags & 0xE0);
+		if ((i = replay_check(&dec->replay, ts))) {
+			QTSTATS_DROP(sess, (i == -2) ? QTSTAT_DUPLICATE : QTSTAT_LATE, len);
+			qtlog(QTLOG_WARNING, (i == -2) ? "Duplicate data packet received: %u\n" : "Late data packet received: %u\n", ts);
 			return -1;
 		}
 		dec->nonce[20] = enc[12] & 0x1F;
@@ -384,23 +740,32 @@ static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
 		dec->nonce[22] = enc[14];
 		dec->nonce[23] = enc[15];
 		memset(enc, 0, crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES);
-		if (debug) dumphex("DECODE KEY", dec->sharedkey, 32);
-		if (crypto_box_curve25519xsalsa20poly1305_open_afternm((unsigned char*)raw, (unsigned char*)enc, len - 4 + 16, dec->nonce, dec->sharedkey)) {
-			fprintf(stderr, "Decryption of data packet failed len=%d\n", len);
+		if (qtdebug) dumphex("DECODE KEY", dec->sharedkey, 32);
+		if (epochbox_open_afternm(&dec->box, (unsigned char*)raw, (unsigned char*)enc, len - 4 + 16, dec->nonce, dec->sharedkey)) {
+			QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+			qtlog(QTLOG_WARNING, "Decryption of data packet failed len=%d\n", len);
 			return -1;
 		}
-		dec->timestamps[ltsi] = ts;
+		replay_update(&dec->replay, ts);
 		return len - 16 - 4;
 	} else {
 		//<12 byte padding>|<1 byte flags><8 byte timestamp><n+16 bytes encrypted control data>
-		if (len < 9 + 16 + 1 + 32 + 24 + 32 + 24 + 8) {
-			fprintf(stderr, "Short control packet received: %d\n", len);
+		//Reject what can be rejected without cryptography first
+		if (len != 9 + 16 + CONTROLBYTES || flags != 0x80) {
+			QTSTATS_DROP(sess, QTSTAT_MALFORMED, len);
+			qtlogdebug("Invalid control packet received: len=%d, flags=%d\n", len, flags);
 			return -1;
 		}
 		uint64 ts = decodeuint64(enc + 13);
-		if (debug) fprintf(stderr, "Decoding control packet of %d bytes with timestamp %llu and flags %d\n", len, ts, flags);
+		qtlogdebug("Decoding control packet of %d bytes with timestamp %llu and flags %d\n", len, ts, flags);
 		if (ts <= d->controldecodetime) {
-			fprintf(stderr, "Late control packet received: %llu < %llu\n", ts, d->controldecodetime);
+			QTSTATS_DROP(sess, QTSTAT_LATE, len);
+			qtlogdebug("Late control packet received: %llu < %llu\n", ts, d->controldecodetime);
+			return -1;
+		}
+		if (!controlallowed(sess)) {
+			QTSTATS_DROP(sess, QTSTAT_RATELIMIT, len);
+			qtlogdebug("Control packet rate exceeded, %llu packets ignored\n", (unsigned long long)sess->stats->rxdrops[QTSTAT_RATELIMIT]);
 			return -1;
 		}
 		unsigned char cnonce[NONCEBYTES];
@@ -409,51 +774,33 @@ static int decode(struct qtsession* sess, char* enc, char* raw, int len) {
 		memcpy(cnonce + 16, enc + 13, 8);
 		memset(enc + 12 + 1 + 8 - 16, 0, 16);
 		if (crypto_box_curve25519xsalsa20poly1305_open_afternm((unsigned char*)raw, (unsigned char*)enc + 12 + 1 + 8 - 16, len - 1 - 8 + 16, cnonce, d->controlkey)) {
-			fprintf(stderr, "Decryption of control packet failed len=%d\n", len);
+			QTSTATS_DROP(sess, QTSTAT_AUTH, len);
+			qtlog(QTLOG_WARNING, "Decryption of control packet failed len=%d\n", len);
 			return -1;
 		}
 		d->controldecodetime = ts;
-		int dosendkeyupdate = 0;
 		//<32 byte padding><1 byte flags><32 byte sender key><24 byte sender nonce><32 byte recipient key><24 byte recipient nonce><8 byte timestamp>
 		int cflags = (unsigned char)raw[32];
-		d->dataremotekeyid = (cflags >> 6) & 0x01;
-		int lkeyid = (cflags >> 5) & 0x01;
-		if ((cflags & (1 << 4)) == 0) dosendkeyupdate |= 1;
-		memcpy(d->dataremotekey, raw + 32 + 1, 32);
-		memcpy(d->dataremotenonce, raw + 32 + 1 + 32, 24);
+		if ((cflags & CONTROL_ACK) == 0) d->controlreply |= 1;
+		if (cflags & CONTROL_ECHO) d->controlreply |= 4;
 		uint64 lexpectts = decodeuint64(raw + 32 + 1 + 32 + 24 + 32 + 24);
+		if (cflags & CONTROL_ECHOREPLY) qtprobereply(sess, lexpectts);
 		if (lexpectts > d->controlencodetime) {
-			fprintf(stderr, "Remote expects newer control timestamp (%llu > %llu), moving forward.\n", lexpectts, d->controlencodetime);
+			qtlog(QTLOG_INFO, "Remote expects newer control timestamp (%llu > %llu), moving forward.\n", lexpectts, d->controlencodetime);
 			d->controlencodetime = lexpectts;
 		}
-		struct qt_proto_data_salty_keyset* enckey = &d->datalocalkeys[lkeyid];
-		if (memcmp(enckey->publickey, raw + 32 + 1 + 32 + 24, 32) || memcmp(enckey->nonce, raw + 32 + 1 + 32 + 24 + 32, 20)) {
-			dosendkeyupdate |= 2;
-			lkeyid = -1;
-		}
-		initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | 0x00], d->dataremotekey, d->datalocalkeys[0].privatekey, d->dataremotenonce);
-		initdecoder(&d->datadecoders[(d->dataremotekeyid << 1) | 0x01], d->dataremotekey, d->datalocalkeys[1].privatekey, d->dataremotenonce);
-		if (lkeyid != -1 && lkeyid == d->datalocalkeynextid) {
-			d->datalocalkeyid = lkeyid;
-			d->datalocalkeynextid = -1;
-		}
-		if (lkeyid == d->datalocalkeyid) {
-			if (crypto_box_curve25519xsalsa20poly1305_beforenm(enckey->sharedkey, d->dataremotekey, enckey->privatekey)) {
-				errorexit("Encryption key calculation failed");
-				abort();
-			}
-			d->dataencoder = enckey;
-		}
-		if (debug) fprintf(stderr, "Decoded control packet: rkid=%d, lkid=%d, ack=%d, lkvalid=%d, uptodate=%d\n", d->dataremotekeyid, (cflags >> 5) & 0x01, (cflags >> 4) & 0x01, lkeyid != -1, d->datalocalkeynextid == -1);
-		if (d->datalocalkeynextid != -1) dosendkeyupdate |= 2;
-		if (dosendkeyupdate) sendkeyupdate(sess, (dosendkeyupdate & 2) == 0);
+		memcpy(d->controlbody, raw + 32, CONTROLBYTES);
+		d->controlpending = true;
+		processcontrol(sess);
 		return 0;
 	}
 }
 
-static void idle(struct qtsession* sess) {
-	beginkeyupdateifnecessary(sess);
-}
+static const struct qtpacketrule packetrules[] = {
+	{ 4 + 16, 0xffff, 0x80, 0x00 }, //data
+	{ 9 + 16 + CONTROLBYTES, 9 + 16 + CONTROLBYTES, 0xff, 0x80 }, //control
+	{ 0 },
+};
 
 struct qtproto qtproto_salty = {
 	1,
@@ -465,7 +812,8 @@ struct qtproto qtproto_salty = {
 	decode,
 	init,
 	sizeof(struct qt_proto_data_salty),
-	idle,
+	NULL,
+	packetrules,
 };
 
 #ifndef COMBINED_BINARY
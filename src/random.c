@@ -0,0 +1,201 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Random number generator for key generation.
+A ChaCha20 based generator with fast key erasure: every refill of the output buffer replaces the key with the first 32 bytes of the new keystream, so earlier output can not be reconstructed from the state.
+It is seeded from getrandom() where available and from /dev/urandom otherwise. The device is opened before privileges are dropped, so this keeps working in a CHROOT.
+The generator is reseeded after every RANDOM_RESEED_BYTES of output and every RANDOM_RESEED_INTERVAL seconds, and in the child after fork().
+Most requests are served from the buffer without a system call.
+*/
+
+#include <pthread.h>
+#include <errno.h>
+#ifdef linux
+	#include <sys/syscall.h>
+#endif
+
+#ifdef COMBINED_BINARY
+	extern int qtrandom(unsigned char* buffer, unsigned long long len);
+	extern int qtrandom_init();
+#else
+
+#define RANDOM_RESEED_BYTES (1024 * 1024)
+#define RANDOM_RESEED_INTERVAL 300
+
+static struct {
+	pthread_mutex_t lock;
+	bool seeded;
+	bool atfork;
+	int urandomfd;
+	unsigned char key[32];
+	unsigned char buffer[16 * 64];
+	unsigned int available; //unused bytes at the end of the buffer
+	unsigned long long generated; //bytes generated since the last reseed
+	time_t reseedtime;
+} qtrandomstate = { PTHREAD_MUTEX_INITIALIZER, false, false, -1 };
+
+#define QTROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QTCHACHAQR(a, b, c, d) \
+	a += b; d ^= a; d = QTROTL32(d, 16); \
+	c += d; b ^= c; b = QTROTL32(b, 12); \
+	a += b; d ^= a; d = QTROTL32(d, 8); \
+	c += d; b ^= c; b = QTROTL32(b, 7);
+
+//One ChaCha20 block with an all zero nonce
+static void qtrandom_chacha20(unsigned char* out, const unsigned char* key, u_int32_t counter) {
+	u_int32_t in[16], x[16];
+	int i;
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (i = 0; i < 8; i++) in[4 + i] = key[4 * i] | (key[4 * i + 1] << 8) | (key[4 * i + 2] << 16) | ((u_int32_t)key[4 * i + 3] << 24);
+	in[12] = counter;
+	in[13] = in[14] = in[15] = 0;
+	memcpy(x, in, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		QTCHACHAQR(x[0], x[4], x[8], x[12]);
+		QTCHACHAQR(x[1], x[5], x[9], x[13]);
+		QTCHACHAQR(x[2], x[6], x[10], x[14]);
+		QTCHACHAQR(x[3], x[7], x[11], x[15]);
+		QTCHACHAQR(x[0], x[5], x[10], x[15]);
+		QTCHACHAQR(x[1], x[6], x[11], x[12]);
+		QTCHACHAQR(x[2], x[7], x[8], x[13]);
+		QTCHACHAQR(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++) {
+		u_int32_t v = x[i] + in[i];
+		out[4 * i + 0] = v & 0xff;
+		out[4 * i + 1] = (v >> 8) & 0xff;
+		out[4 * i + 2] = (v >> 16) & 0xff;
+		out[4 * i + 3] = (v >> 24) & 0xff;
+	}
+}
+
+static void qtrandom_atfork_prepare() {
+	pthread_mutex_lock(&qtrandomstate.lock);
+}
+static void qtrandom_atfork_parent() {
+	pthread_mutex_unlock(&qtrandomstate.lock);
+}
+static void qtrandom_atfork_child() {
+	qtrandomstate.seeded = false;
+	pthread_mutex_unlock(&qtrandomstate.lock);
+}
+
+static int qtrandom_system(unsigned char* buffer, int len) {
+	while (len > 0) {
+		int got = -1;
+#ifdef SYS_getrandom
+		got = syscall(SYS_getrandom, buffer, len, 0);
+		if (got < 0 && errno == EINTR) continue;
+#endif
+		if (got < 0) {
+			if (qtrandomstate.urandomfd == -1) qtrandomstate.urandomfd = open("/dev/urandom", O_RDONLY);
+			if (qtrandomstate.urandomfd == -1) return -1;
+			got = read(qtrandomstate.urandomfd, buffer, len);
+			if (got < 0 && errno == EINTR) continue;
+			if (got <= 0) return -1;
+		}
+		buffer += got;
+		len -= got;
+	}
+	return 0;
+}
+
+static void qtrandom_refill() {
+	int i;
+	for (i = 0; i < sizeof(qtrandomstate.buffer) / 64; i++) qtrandom_chacha20(qtrandomstate.buffer + 64 * i, qtrandomstate.key, i);
+	memcpy(qtrandomstate.key, qtrandomstate.buffer, 32);
+	memset(qtrandomstate.buffer, 0, 32);
+	qtrandomstate.available = sizeof(qtrandomstate.buffer) - 32;
+}
+
+//Mix fresh system entropy into the key
+static int qtrandom_reseed(time_t now) {
+	unsigned char seed[32];
+	int i;
+	if (qtrandom_system(seed, sizeof(seed))) return -1;
+	if (!qtrandomstate.seeded) memset(qtrandomstate.key, 0, 32);
+	for (i = 0; i < 32; i++) qtrandomstate.key[i] ^= seed[i];
+	memset(seed, 0, sizeof(seed));
+	memset(qtrandomstate.buffer, 0, sizeof(qtrandomstate.buffer));
+	qtrandomstate.available = 0;
+	qtrandomstate.generated = 0;
+	qtrandomstate.reseedtime = now;
+	qtrandomstate.seeded = true;
+	return 0;
+}
+
+static void qtrandom_setup() {
+	if (qtrandomstate.atfork) return;
+	pthread_atfork(qtrandom_atfork_prepare, qtrandom_atfork_parent, qtrandom_atfork_child);
+	qtrandomstate.atfork = true;
+}
+
+//Seed the generator, and open /dev/urandom if it is needed, while it is still reachable
+int qtrandom_init() {
+	struct timespec now;
+	int ret = 0;
+	clock_gettime(QT_CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&qtrandomstate.lock);
+	qtrandom_setup();
+	if (!qtrandomstate.seeded) ret = qtrandom_reseed(now.tv_sec);
+	pthread_mutex_unlock(&qtrandomstate.lock);
+	return ret;
+}
+
+//Fill the buffer with random data, returns 0 on success and -1 if no entropy could be obtained
+int qtrandom(unsigned char* buffer, unsigned long long len) {
+	struct timespec now;
+	int ret = 0;
+	pthread_mutex_lock(&qtrandomstate.lock);
+	qtrandom_setup();
+	while (len > 0) {
+		if (!qtrandomstate.seeded || !qtrandomstate.available) {
+			clock_gettime(QT_CLOCK_MONOTONIC, &now);
+			if (!qtrandomstate.seeded || qtrandomstate.generated >= RANDOM_RESEED_BYTES || now.tv_sec - qtrandomstate.reseedtime >= RANDOM_RESEED_INTERVAL) {
+				if (qtrandom_reseed(now.tv_sec)) {
+					ret = -1;
+					break;
+				}
+			}
+			qtrandom_refill();
+		}
+		unsigned int n = (len < qtrandomstate.available) ? len : qtrandomstate.available;
+		unsigned char* src = qtrandomstate.buffer + sizeof(qtrandomstate.buffer) - qtrandomstate.available;
+		memcpy(buffer, src, n);
+		memset(src, 0, n);
+		qtrandomstate.available -= n;
+		qtrandomstate.generated += n;
+		buffer += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&qtrandomstate.lock);
+	return ret;
+}
+
+#endif
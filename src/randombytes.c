@@ -1,37 +1,11 @@
 /*
-randombytes/devurandom.h version 20080713
-D. J. Bernstein
-Public domain.
+randombytes for TweetNaCl, served by the QuickTun random number generator (see random.c)
 */
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
 
-static int fd = -1;
+extern int qtrandom(unsigned char* buffer, unsigned long long len);
 
 void randombytes(unsigned char *x,unsigned long long xlen) {
-  int i;
-
-  if (fd == -1) {
-    for (;;) {
-      fd = open("/dev/urandom",O_RDONLY);
-      if (fd != -1) break;
-      sleep(1);
-    }
-  }
-
-  while (xlen > 0) {
-    if (xlen < 1048576) i = xlen; else i = 1048576;
-
-    i = read(fd,x,i);
-    if (i < 1) {
-      sleep(1);
-      continue;
-    }
-
-    x += i;
-    xlen -= i;
-  }
+  while (qtrandom(x,xlen)) sleep(1);
 }
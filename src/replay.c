@@ -0,0 +1,88 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Sliding window anti-replay check (RFC 6479).
+The window keeps one bit for each of the most recently received sequence numbers in a ring of 64 bit words, so packets can arrive in any order as long as they are no more than the window size behind the newest packet.
+Checking a packet is O(1); advancing the window clears whole words. The window size is set by REPLAY_WINDOW (in packets, default 2048) and is rounded up to a power of two words plus one spare word.
+Call replay_check before and replay_update after authenticating a packet, so forged packets can not move the window.
+*/
+
+#include <sys/types.h>
+
+#define REPLAY_WINDOW_DEFAULT 2048
+
+struct qtreplay {
+	u_int64_t* bitmap;
+	u_int64_t top;
+	unsigned int mask; //number of words - 1
+	unsigned long long replayed, tooold;
+};
+
+//Consider all sequence numbers up to and including top as received
+static void replay_reset(struct qtreplay* w, u_int64_t top) {
+	memset(w->bitmap, 0xff, (w->mask + 1) * sizeof(u_int64_t));
+	w->bitmap[(top >> 6) & w->mask] = ~(u_int64_t)0 >> (63 - (top & 63));
+	w->top = top;
+}
+
+static int replay_init(struct qtreplay* w) {
+	char* envval;
+	int size = REPLAY_WINDOW_DEFAULT;
+	if ((envval = getconf("REPLAY_WINDOW"))) size = atoi(envval);
+	if (size < 64) size = 64;
+	unsigned int words = 2;
+	while ((words - 1) * 64 < size) words <<= 1;
+	w->bitmap = malloc(words * sizeof(u_int64_t));
+	if (!w->bitmap) return errorexit("Could not allocate replay window");
+	w->mask = words - 1;
+	w->replayed = w->tooold = 0;
+	replay_reset(w, 0);
+	return 0;
+}
+
+static int replay_check(struct qtreplay* w, u_int64_t seq) {
+	if (seq > w->top) return 0;
+	if (w->top - seq >= (u_int64_t)w->mask * 64) {
+		w->tooold++;
+		return -1;
+	}
+	if ((w->bitmap[(seq >> 6) & w->mask] >> (seq & 63)) & 1) {
+		w->replayed++;
+		return -2;
+	}
+	return 0;
+}
+
+static void replay_update(struct qtreplay* w, u_int64_t seq) {
+	if (seq > w->top) {
+		u_int64_t index = seq >> 6, topindex = w->top >> 6;
+		u_int64_t diff = index - topindex;
+		if (diff > w->mask + 1) diff = w->mask + 1;
+		while (diff--) w->bitmap[(++topindex) & w->mask] = 0;
+		w->top = seq;
+	}
+	w->bitmap[(seq >> 6) & w->mask] |= (u_int64_t)1 << (seq & 63);
+}
@@ -28,6 +28,7 @@
 extern struct qtproto qtproto_raw;
 extern struct qtproto qtproto_nacl0;
 extern struct qtproto qtproto_nacltai;
+extern struct qtproto qtproto_nacltai2;
 extern struct qtproto qtproto_salty;
 
 #ifdef DEBIAN_BINARY
@@ -43,34 +44,43 @@ char* getenvdeb(const char* name) {
 }
 #endif
 
-int main(int argc, char** argv) {
-	print_header();
-#ifdef DEBIAN_BINARY
-	getconf = getenvdeb;
-#else
-	getconf = getenv;
-#endif
-	int rc = qtprocessargs(argc, argv);
-	if (rc <= 0) return rc;
+static struct qtproto* selectprotocol() {
 	char* envval;
 	if ((envval = getconf("PROTOCOL"))) {
 		if (strcmp(envval, "raw") == 0) {
-			return qtrun(&qtproto_raw);
+			return &qtproto_raw;
 		} else if (strcmp(envval, "nacl0") == 0) {
-			return qtrun(&qtproto_nacl0);
+			return &qtproto_nacl0;
 		} else if (strcmp(envval, "nacltai") == 0) {
-			return qtrun(&qtproto_nacltai);
+			return &qtproto_nacltai;
+		} else if (strcmp(envval, "nacltai2") == 0) {
+			return &qtproto_nacltai2;
 		} else if (strcmp(envval, "salty") == 0) {
-			return qtrun(&qtproto_salty);
+			return &qtproto_salty;
 		} else {
-			return errorexit("Unknown PROTOCOL specified");
+			errorexit("Unknown PROTOCOL specified");
+			return NULL;
 		}
 	} else if (getconf("PRIVATE_KEY")) {
 		fprintf(stderr, "Warning: PROTOCOL not specified, using insecure nacl0 protocol\n");
-		return qtrun(&qtproto_nacl0);
+		return &qtproto_nacl0;
 	} else {
 		fprintf(stderr, "Warning: PROTOCOL not specified, using insecure raw protocol\n");
-		return qtrun(&qtproto_raw);
+		return &qtproto_raw;
 	}
 }
 
+int main(int argc, char** argv) {
+	print_header();
+#ifdef DEBIAN_BINARY
+	getconf = getenvdeb;
+#else
+	getconf = getenv;
+#endif
+	int rc = qtprocessargs(argc, argv);
+	if (rc <= 0) return rc;
+	if (qtmulticonfig) return qtrunmulti(selectprotocol);
+	struct qtproto* p = selectprotocol();
+	if (!p) return -1;
+	return qtrun(p);
+}
@@ -0,0 +1,318 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Shows the statistics that a running quicktun process publishes in its STATS_FILE.
+By default the counters are shown as rates, refreshed every second like top. With -j all counters are written once as JSON.
+With round trip time probes (PROBE_INTERVAL), the top view also shows the round trip time, jitter and loss of each tunnel since the start.
+With SOCKET_TIMESTAMPS, it shows the time from the kernel receiving a datagram to writing its packet to the device (rx) and from reading a packet from the device to the kernel sending its datagram (tx).
+If the process times its event loop stages, the top view shows their latency percentiles over the last interval and the JSON output those since the start.
+The segment is only read, the tunnel does not notice that it is being watched.
+*/
+
+#include "common.c"
+#include <signal.h>
+
+static const char* dropnames[QTSTAT_DROPREASONS] = { "malformed", "auth", "duplicate", "late", "ratelimit" };
+//In the order of the QTLAT_ stages
+static const char* stagenames[QTLAT_STAGES] = { "poll", "tun_read", "encode", "send", "receive", "decode", "tun_write" };
+
+//The middle of the range of values counted in a bucket of a histogram (see qthist_bucket)
+static double bucketvalue(int bucket, int subbits) {
+	if (bucket < (1 << subbits)) return bucket;
+	int shift = (bucket >> subbits) - 1;
+	uint64_t low = (uint64_t)((1 << subbits) + (bucket & ((1 << subbits) - 1))) << shift;
+	return low + ((uint64_t)1 << shift) / 2.0;
+}
+
+//The value below which a fraction of the count samples in the buckets falls, the buckets of prev (if not NULL) are subtracted first
+static double percentile(const uint64_t* buckets, const uint64_t* prev, int nbuckets, int subbits, uint64_t count, double fraction) {
+	uint64_t seen = 0;
+	int i;
+	if (!count) return 0;
+	for (i = 0; i < nbuckets; i++) {
+		seen += buckets[i] - (prev ? prev[i] : 0);
+		if (seen > fraction * (count - 1)) return bucketvalue(i, subbits);
+	}
+	return bucketvalue(nbuckets - 1, subbits);
+}
+
+static double latencypercentile(const struct qtlatency* l, const struct qtlatency* prev, double fraction) {
+	return percentile(l->buckets, prev ? prev->buckets : NULL, QTLATENCY_BUCKETS, QTLATENCY_SUBBITS, l->count - (prev ? prev->count : 0), fraction);
+}
+
+static double histpercentile(const struct qtstatshist* h, double fraction) {
+	return percentile(h->buckets, NULL, QTSTATS_HISTBUCKETS, QTSTATS_HISTSUBBITS, h->count, fraction);
+}
+
+static bool probing(struct qtstatsheader* h) {
+	int i;
+	for (i = 0; i < h->sessions; i++) if (QTSTATS_SESSION(h, i)->probes) return true;
+	return false;
+}
+
+static bool timestamping(struct qtstatsheader* h) {
+	int i;
+	for (i = 0; i < h->sessions; i++) if (QTSTATS_SESSION(h, i)->rxdelay.count || QTSTATS_SESSION(h, i)->txdelay.count) return true;
+	return false;
+}
+
+static bool cachingkeys(struct qtstatsheader* h) {
+	int i;
+	for (i = 0; i < h->sessions; i++) if (QTSTATS_SESSION(h, i)->sharedkeyhits || QTSTATS_SESSION(h, i)->sharedkeymisses) return true;
+	return false;
+}
+
+static void printhistjson(const char* name, struct qtstatshist* h) {
+	printf(",\"%s\":{\"count\":%llu,\"mean\":%.0f", name, (unsigned long long)h->count, h->count ? (double)h->sum / h->count : 0);
+	printf(",\"p50\":%.0f,\"p99\":%.0f,\"p999\":%.0f,\"max\":%llu}", histpercentile(h, 0.5), histpercentile(h, 0.99), histpercentile(h, 0.999), (unsigned long long)h->max);
+}
+
+//Percentiles of a histogram in nanoseconds as microseconds, or dashes if it is empty
+static void printdelay(struct qtstatshist* h) {
+	if (h->count) printf(" %10.1f %10.1f %10.1f", histpercentile(h, 0.5) / 1000, histpercentile(h, 0.99) / 1000, histpercentile(h, 0.999) / 1000);
+	else printf(" %10s %10s %10s", "-", "-", "-");
+}
+
+static struct qtstatsheader* openstats(const char* path, size_t* size) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Could not open statistics file");
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct qtstatsheader)) {
+		fprintf(stderr, "Statistics file is truncated\n");
+		close(fd);
+		return NULL;
+	}
+	struct qtstatsheader* header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		perror("Could not map statistics file");
+		return NULL;
+	}
+	if (memcmp(header->magic, QTSTATS_MAGIC, 4) || header->version != QTSTATS_VERSION) {
+		fprintf(stderr, "Not a statistics file or unsupported version\n");
+		return NULL;
+	}
+	*size = QTSTATS_SIZE(header);
+	if (*size > st.st_size) {
+		fprintf(stderr, "Statistics file is truncated\n");
+		return NULL;
+	}
+	return header;
+}
+
+static bool running(struct qtstatsheader* header) {
+	return kill(header->pid, 0) == 0 || errno == EPERM;
+}
+
+static void printname(const char* name) {
+	char buffer[sizeof(((struct qtstats*)0)->name) + 1];
+	memcpy(buffer, name, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = 0;
+	printf("%-16s", buffer[0] ? buffer : "-");
+}
+
+//Microseconds from ticks of the latency histograms
+static double ticks2us(struct qtstatsheader* h, double ticks) {
+	return ticks * 1e6 / h->tickrate;
+}
+
+static void printjson(struct qtstatsheader* h) {
+	int i, j;
+	printf("{\"pid\":%u,\"running\":%s,\"started\":%llu,\"wakeups\":%llu,\"batches\":[", h->pid, running(h) ? "true" : "false", (unsigned long long)h->started, (unsigned long long)h->wakeups);
+	for (j = 0; j < QTSTATS_BATCHBUCKETS; j++) printf("%s%llu", j ? "," : "", (unsigned long long)h->batches[j]);
+	printf("],\"tunnels\":[");
+	for (i = 0; i < h->sessions; i++) {
+		struct qtstats* s = QTSTATS_SESSION(h, i);
+		printf("%s\n{\"name\":\"", i ? "," : "");
+		for (j = 0; j < sizeof(s->name) && s->name[j]; j++) {
+			unsigned char c = s->name[j];
+			if (c == '"' || c == '\\') printf("\\%c", c);
+			else if (c < 0x20) printf("\\u%04x", c);
+			else putchar(c);
+		}
+		printf("\",\"txpackets\":%llu,\"txbytes\":%llu,\"txnotready\":%llu,\"txerrors\":%llu", (unsigned long long)s->txpackets, (unsigned long long)s->txbytes, (unsigned long long)s->txnotready, (unsigned long long)s->txerrors);
+		printf(",\"rxpackets\":%llu,\"rxbytes\":%llu,\"rxcontrol\":%llu,\"rxdropped\":%llu,\"rxerrors\":%llu", (unsigned long long)s->rxpackets, (unsigned long long)s->rxbytes, (unsigned long long)s->rxcontrol, (unsigned long long)s->rxdropped, (unsigned long long)s->rxerrors);
+		printf(",\"kerneldrops\":%llu,\"rxdrops\":{", (unsigned long long)s->kerneldrops);
+		for (j = 0; j < QTSTAT_DROPREASONS; j++) printf("%s\"%s\":%llu", j ? "," : "", dropnames[j], (unsigned long long)s->rxdrops[j]);
+		printf("},\"rekeys\":%llu,\"endpointchanges\":%llu", (unsigned long long)s->rekeys, (unsigned long long)s->endpointchanges);
+		printf(",\"probes\":%llu,\"probereplies\":%llu,\"probeslost\":%llu", (unsigned long long)s->probes, (unsigned long long)s->probereplies, (unsigned long long)s->probeslost);
+		if (s->probereplies) {
+			printf(",\"rtt_us\":{\"smoothed\":%llu,\"variation\":%llu,\"mean\":%.0f", (unsigned long long)s->rttsmoothed, (unsigned long long)s->rttvariation, (double)s->rtt.sum / s->rtt.count);
+			printf(",\"p50\":%.0f,\"p99\":%.0f,\"p999\":%.0f,\"max\":%llu}", histpercentile(&s->rtt, 0.5), histpercentile(&s->rtt, 0.99), histpercentile(&s->rtt, 0.999), (unsigned long long)s->rtt.max);
+			printf(",\"jitter_us\":{\"mean\":%.0f,\"p50\":%.0f,\"p99\":%.0f,\"max\":%llu}", s->jitter.count ? (double)s->jitter.sum / s->jitter.count : 0, histpercentile(&s->jitter, 0.5), histpercentile(&s->jitter, 0.99), (unsigned long long)s->jitter.max);
+		}
+		if (s->rxdelay.count || s->txdelay.count) {
+			printhistjson("rxdelay_ns", &s->rxdelay);
+			printhistjson("txdelay_ns", &s->txdelay);
+			printf(",\"hwtimestamps\":%llu", (unsigned long long)s->hwtimestamps);
+		}
+		if (s->sharedkeyhits || s->sharedkeymisses) printf(",\"sharedkeyhits\":%llu,\"sharedkeymisses\":%llu", (unsigned long long)s->sharedkeyhits, (unsigned long long)s->sharedkeymisses);
+		printf("}");
+	}
+	printf("]");
+	if (h->tickrate) {
+		printf(",\n\"latency\":{\"tickrate\":%llu", (unsigned long long)h->tickrate);
+		for (j = 0; j < QTLAT_STAGES; j++) {
+			struct qtlatency* l = &QTSTATS_LATENCY(h)[j];
+			printf(",\n\"%s\":{\"count\":%llu,\"mean_us\":%.3f", stagenames[j], (unsigned long long)l->count, l->count ? ticks2us(h, (double)l->sum / l->count) : 0);
+			printf(",\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}", ticks2us(h, latencypercentile(l, NULL, 0.5)), ticks2us(h, latencypercentile(l, NULL, 0.99)), ticks2us(h, latencypercentile(l, NULL, 0.999)), ticks2us(h, l->max));
+		}
+		printf("}");
+	}
+	printf("}\n");
+}
+
+static void printtop(struct qtstatsheader* h, struct qtstatsheader* prev, double seconds) {
+	int i, j;
+	printf("\033[H\033[2J");
+	printf("QuickTun pid %u, %s, up %llus, %u tunnels\n", h->pid, running(h) ? "running" : "not running", (unsigned long long)(time(NULL) - h->started), h->sessions);
+	printf("Wakeups/s %.0f, ready descriptors per wakeup:", (h->wakeups - prev->wakeups) / seconds);
+	for (j = 0; j < QTSTATS_BATCHBUCKETS; j++) printf(" %d%s:%llu", 1 << j, j == QTSTATS_BATCHBUCKETS - 1 ? "+" : "", (unsigned long long)(h->batches[j] - prev->batches[j]));
+	printf("\n\n%-16s %10s %10s %10s %10s %8s %8s %8s %8s\n", "TUNNEL", "RX pkt/s", "RX kB/s", "TX pkt/s", "TX kB/s", "DROP/s", "ERR/s", "REKEYS", "ROAMS");
+	for (i = 0; i < h->sessions; i++) {
+		struct qtstats* s = QTSTATS_SESSION(h, i);
+		struct qtstats* p = QTSTATS_SESSION(prev, i);
+		printname(s->name);
+		printf(" %10.0f %10.1f %10.0f %10.1f %8.0f %8.0f %8llu %8llu\n",
+			(s->rxpackets - p->rxpackets) / seconds, (s->rxbytes - p->rxbytes) / seconds / 1000,
+			(s->txpackets - p->txpackets) / seconds, (s->txbytes - p->txbytes) / seconds / 1000,
+			(s->rxdropped + s->txnotready - p->rxdropped - p->txnotready) / seconds,
+			(s->rxerrors + s->txerrors - p->rxerrors - p->txerrors) / seconds,
+			(unsigned long long)s->rekeys, (unsigned long long)s->endpointchanges);
+	}
+	printf("\n%-16s", "DROPPED");
+	for (j = 0; j < QTSTAT_DROPREASONS; j++) printf(" %10s", dropnames[j]);
+	printf(" %10s %10s\n", "notready", "kernel");
+	for (i = 0; i < h->sessions; i++) {
+		struct qtstats* s = QTSTATS_SESSION(h, i);
+		printname(s->name);
+		for (j = 0; j < QTSTAT_DROPREASONS; j++) printf(" %10llu", (unsigned long long)s->rxdrops[j]);
+		printf(" %10llu %10llu\n", (unsigned long long)s->txnotready, (unsigned long long)s->kerneldrops);
+	}
+	if (probing(h)) {
+		printf("\n%-16s %10s %10s %10s %10s %10s %10s %8s\n", "RTT ms", "smoothed", "variation", "p50", "p99", "p99.9", "jitter p99", "LOSS %");
+		for (i = 0; i < h->sessions; i++) {
+			struct qtstats* s = QTSTATS_SESSION(h, i);
+			printname(s->name);
+			if (!s->probereplies) {
+				printf(" %10s %10s %10s %10s %10s %10s %8s\n", "-", "-", "-", "-", "-", "-", "-");
+				continue;
+			}
+			printf(" %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %8.2f\n", s->rttsmoothed / 1000.0, s->rttvariation / 1000.0,
+				histpercentile(&s->rtt, 0.5) / 1000, histpercentile(&s->rtt, 0.99) / 1000, histpercentile(&s->rtt, 0.999) / 1000, histpercentile(&s->jitter, 0.99) / 1000,
+				100.0 * s->probeslost / (s->probeslost + s->probereplies));
+		}
+	}
+	if (cachingkeys(h)) {
+		printf("\n%-16s %10s %10s %10s\n", "SHARED KEYS", "hits", "misses", "hit %");
+		for (i = 0; i < h->sessions; i++) {
+			struct qtstats* s = QTSTATS_SESSION(h, i);
+			printname(s->name);
+			if (s->sharedkeyhits || s->sharedkeymisses) printf(" %10llu %10llu %10.1f\n", (unsigned long long)s->sharedkeyhits, (unsigned long long)s->sharedkeymisses, 100.0 * s->sharedkeyhits / (s->sharedkeyhits + s->sharedkeymisses));
+			else printf(" %10s %10s %10s\n", "-", "-", "-");
+		}
+	}
+	if (timestamping(h)) {
+		printf("\n%-16s %10s %10s %10s %10s %10s %10s\n", "KERNEL DELAY us", "rx p50", "rx p99", "rx p99.9", "tx p50", "tx p99", "tx p99.9");
+		for (i = 0; i < h->sessions; i++) {
+			struct qtstats* s = QTSTATS_SESSION(h, i);
+			printname(s->name);
+			printdelay(&s->rxdelay);
+			printdelay(&s->txdelay);
+			printf("\n");
+		}
+	}
+	if (h->tickrate) {
+		printf("\n%-16s %10s %10s %10s %10s %10s\n", "STAGE", "count/s", "mean us", "p50 us", "p99 us", "p99.9 us");
+		for (j = 0; j < QTLAT_STAGES; j++) {
+			struct qtlatency* l = &QTSTATS_LATENCY(h)[j];
+			struct qtlatency* p = &QTSTATS_LATENCY(prev)[j];
+			uint64_t count = l->count - p->count;
+			printf("%-16s %10.0f", stagenames[j], count / seconds);
+			if (count) printf(" %10.2f %10.2f %10.2f %10.2f\n", ticks2us(h, (double)(l->sum - p->sum) / count), ticks2us(h, latencypercentile(l, p, 0.5)), ticks2us(h, latencypercentile(l, p, 0.99)), ticks2us(h, latencypercentile(l, p, 0.999)));
+			else printf(" %10s %10s %10s %10s\n", "-", "-", "-", "-");
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+	const char* path = NULL;
+	bool json = false;
+	int delay = 1000;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+			printf("Usage: %s [-j] [-d <milliseconds>] <statistics file>\n", argv[0]);
+			printf("Please read the documentation at http://wiki.ucis.nl/QuickTun\n");
+			return 0;
+		} else if (!strcmp(a, "-v") || !strcmp(a, "--version")) {
+			printf("UCIS QuickTun "QT_VERSION"\n");
+			return 0;
+		} else if (!strcmp(a, "-j")) {
+			json = true;
+		} else if (!strcmp(a, "-d")) {
+			i++;
+			if (i >= argc) return errorexit("Missing argument for -d");
+			delay = atoi(argv[i]);
+			if (delay < 10) return errorexit("Invalid argument specified for -d");
+		} else if (!path) {
+			path = a;
+		} else {
+			return errorexit("Unexpected command line argument");
+		}
+	}
+	if (!path) return errorexit("Missing statistics file argument");
+
+	size_t size;
+	struct qtstatsheader* header = openstats(path, &size);
+	if (!header) return 1;
+	if (json) {
+		printjson(header);
+		return 0;
+	}
+
+	//Rates are computed from a private copy of the previous sample
+	struct qtstatsheader* prev = malloc(size);
+	if (!prev) return errorexit("Out of memory");
+	memcpy(prev, header, size);
+	struct timespec last, now;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while (1) {
+		poll(NULL, 0, delay);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		printtop(header, prev, seconds);
+		memcpy(prev, header, size);
+		last = now;
+	}
+	return 0;
+}
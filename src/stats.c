@@ -0,0 +1,164 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Statistics for every tunnel of the process, kept in a segment that is shared with quicktun.stat when STATS_FILE is set (for example /dev/shm/quicktun.tun0).
+Only the event loop thread writes to the segment, with plain increments: there are no system calls or atomic operations on the packet path. Readers may see a counter that is a few packets behind the one next to it.
+The segment is a header followed by one struct qtstats for every tunnel, in the byte order of the machine. When the event loop stages are timed (tickrate is set), QTLAT_STAGES latency histograms follow the tunnels.
+*/
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define QTSTATS_MAGIC "QTST"
+#define QTSTATS_VERSION 6
+#define QTSTATS_BATCHBUCKETS 8
+#define QTSTATS_HISTSUBBITS 3
+#define QTSTATS_HISTBUCKETS ((32 - QTSTATS_HISTSUBBITS + 1) << QTSTATS_HISTSUBBITS)
+
+//Reasons for dropping a datagram received from the network
+enum {
+	QTSTAT_MALFORMED, //too short or invalid header
+	QTSTAT_AUTH, //authentication failed
+	QTSTAT_DUPLICATE, //replayed
+	QTSTAT_LATE, //too old for the replay window or timestamp going back
+	QTSTAT_RATELIMIT, //control packet rate exceeded
+	QTSTAT_DROPREASONS
+};
+
+struct qtstatsheader {
+	char magic[4];
+	uint32_t version;
+	uint32_t sessions;
+	uint32_t pid;
+	uint64_t started; //unix time
+	uint64_t wakeups; //of the event loop
+	uint64_t batches[QTSTATS_BATCHBUCKETS]; //wakeups by number of ready descriptors: 1, 2-3, 4-7, ..., 128 and more
+	uint64_t tickrate; //of the latency histograms per second, 0 if there are none
+};
+
+//Log-linear histogram of values up to 2^32 with 8 buckets per power of two (see qthist_bucket), larger values are counted in the last bucket
+struct qtstatshist {
+	uint64_t count, sum, max;
+	uint64_t buckets[QTSTATS_HISTBUCKETS];
+};
+
+struct qtstats {
+	char name[32];
+	uint64_t txpackets, txbytes; //sent to the network, including control packets
+	uint64_t txnotready; //packets from the device dropped because the protocol could not encode them yet
+	uint64_t txerrors; //failed sends
+	uint64_t rxpackets, rxbytes; //received from the network
+	uint64_t rxcontrol; //valid packets with nothing to deliver to the device
+	uint64_t rxdropped; //packets the protocol could not decode
+	uint64_t rxdrops[QTSTAT_DROPREASONS]; //details of rxdropped, as far as the protocol reports them
+	uint64_t rxerrors; //failed writes to the device
+	uint64_t kerneldrops; //datagrams dropped by the kernel for the socket, by the socket filter or because the receive buffer was full, updated every 10 seconds
+	uint64_t rekeys;
+	uint64_t endpointchanges;
+	uint64_t probes; //round trip time probes sent, see PROBE_INTERVAL
+	uint64_t probereplies;
+	uint64_t probeslost; //not answered before the next probe, only counted once the peer has answered a probe
+	uint64_t rttsmoothed, rttvariation; //microseconds, as the smoothed round trip time and its variation in TCP (RFC 6298)
+	struct qtstatshist rtt; //microseconds
+	struct qtstatshist jitter; //microseconds between successive round trip times
+	struct qtstatshist rxdelay; //nanoseconds from the receive timestamp of a datagram to the write of its packet to the device, see SOCKET_TIMESTAMPS
+	struct qtstatshist txdelay; //nanoseconds from the read of a packet from the device to the transmit timestamp of its datagram
+	uint64_t hwtimestamps; //received datagrams with a hardware timestamp
+	uint64_t sharedkeyhits, sharedkeymisses; //lookups in the cache of derived shared keys (salty)
+};
+
+#define QTSTATS_SESSION(header, i) ((struct qtstats*)((header) + 1) + (i))
+#define QTSTATS_LATENCY(header) ((struct qtlatency*)QTSTATS_SESSION(header, (header)->sessions))
+#define QTSTATS_SIZE(header) (sizeof(struct qtstatsheader) + (size_t)(header)->sessions * sizeof(struct qtstats) + ((header)->tickrate ? QTLAT_STAGES * sizeof(struct qtlatency) : 0))
+
+//Count a datagram dropped by the protocol, len is its length
+#define QTSTATS_DROP(sess, reason, len) do { \
+	(sess)->stats->rxdrops[reason]++; \
+	QTPROBE(decode_fail, (sess)->id, len, reason); \
+} while (0)
+
+static inline void qtstats_hist_add(struct qtstatshist* h, uint64_t value) {
+	int bucket = qthist_bucket(value, QTSTATS_HISTSUBBITS);
+	h->count++;
+	h->sum += value;
+	if (value > h->max) h->max = value;
+	h->buckets[bucket < QTSTATS_HISTBUCKETS ? bucket : QTSTATS_HISTBUCKETS - 1]++;
+}
+
+static inline void qtstats_batch(struct qtstatsheader* header, int ready) {
+	int bucket = 0;
+	while (ready > 1 && bucket < QTSTATS_BATCHBUCKETS - 1) {
+		ready >>= 1;
+		bucket++;
+	}
+	header->wakeups++;
+	header->batches[bucket]++;
+}
+
+#ifndef COMBINED_BINARY
+//Create the statistics segment, in the file at path if set and in private memory otherwise
+static struct qtstatsheader* qtstats_open(const char* path, int sessions) {
+	size_t size = sizeof(struct qtstatsheader) + sessions * sizeof(struct qtstats);
+#ifdef QT_LATENCY
+	size += QTLAT_STAGES * sizeof(struct qtlatency);
+#endif
+	struct qtstatsheader* header;
+	if (path) {
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("Could not create STATS_FILE");
+			return NULL;
+		}
+		if (ftruncate(fd, size)) {
+			perror("Could not resize STATS_FILE");
+			close(fd);
+			return NULL;
+		}
+		header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (header == MAP_FAILED) {
+			perror("Could not map STATS_FILE");
+			return NULL;
+		}
+	} else {
+		header = calloc(1, size);
+		if (!header) {
+			perror("Could not allocate statistics");
+			return NULL;
+		}
+	}
+	header->version = QTSTATS_VERSION;
+	header->sessions = sessions;
+	header->pid = getpid();
+	header->started = time(NULL);
+#ifdef QT_LATENCY
+	header->tickrate = qtlatency_tickrate();
+	qtlatency_stages = QTSTATS_LATENCY(header);
+#endif
+	memcpy(header->magic, QTSTATS_MAGIC, 4); //last, so readers do not see a partial header
+	return header;
+}
+#endif
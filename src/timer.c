@@ -0,0 +1,200 @@
+/* Copyright 2026 Ivo Smits <Ivo@UCIS.nl>. All rights reserved.
+   Redistribution and use in source and binary forms, with or without modification, are
+   permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+   WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+   FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The views and conclusions contained in the software and documentation are those of the
+   authors and should not be interpreted as representing official policies, either expressed
+   or implied, of Ivo Smits.*/
+
+/*
+Timers for protocol housekeeping (key updates, retransmissions, keepalives).
+The timers of all sessions in the process live in a single hierarchical timing wheel with a resolution of 1 millisecond: 4 levels of 64 slots, covering about 4.6 hours. Longer timers are parked in the last slot and placed again when it comes around.
+Starting and stopping a timer takes constant time, and the event loop only wakes up when a timer is actually due, through a timerfd on Linux or the poll timeout elsewhere.
+Timer callbacks run from the event loop, between packets.
+*/
+
+#ifdef linux
+	#include <sys/timerfd.h>
+#endif
+
+#define QTTIMER_LEVELS 4
+#define QTTIMER_SLOTBITS 6
+#define QTTIMER_SLOTS (1 << QTTIMER_SLOTBITS)
+
+struct qttimer {
+	struct qttimer* next;
+	struct qttimer** pprev; //NULL if the timer is not running
+	u_int64_t expires; //monotonic time in milliseconds
+	unsigned int interval; //milliseconds between runs of a periodic timer, or 0
+	void (*callback)(struct qttimer* timer);
+	void* data;
+};
+
+static inline void qttimer_init(struct qttimer* t, void (*callback)(struct qttimer* timer), void* data) {
+	t->next = NULL;
+	t->pprev = NULL;
+	t->callback = callback;
+	t->data = data;
+}
+static inline int qttimer_running(struct qttimer* t) {
+	return t->pprev != NULL;
+}
+
+#ifdef COMBINED_BINARY
+	extern void qttimer_start(struct qttimer* t, unsigned int delay, unsigned int interval);
+	extern void qttimer_stop(struct qttimer* t);
+	extern void qttimer_expire(u_int64_t now);
+#else
+
+static struct {
+	struct qttimer* slots[QTTIMER_LEVELS][QTTIMER_SLOTS];
+	u_int64_t now; //all timers due up to and including this time have run
+	int fd; //timerfd, or -1
+	u_int64_t armed; //expiry time the timerfd is set to, or 0
+} qttimers;
+
+static u_int64_t qttimer_ms(const struct timespec* ts) {
+	return (u_int64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+static void qttimer_link(struct qttimer* t) {
+	u_int64_t delta = t->expires - qttimers.now;
+	int level = 0;
+	while (level < QTTIMER_LEVELS - 1 && delta >> (QTTIMER_SLOTBITS * (level + 1))) level++;
+	u_int64_t when = t->expires;
+	if (delta >> (QTTIMER_SLOTBITS * QTTIMER_LEVELS)) when = qttimers.now + ((u_int64_t)1 << (QTTIMER_SLOTBITS * QTTIMER_LEVELS)) - 1;
+	struct qttimer** slot = &qttimers.slots[level][(when >> (QTTIMER_SLOTBITS * level)) & (QTTIMER_SLOTS - 1)];
+	t->next = *slot;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+void qttimer_stop(struct qttimer* t) {
+	if (!t->pprev) return;
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+//Run the callback after delay milliseconds, and then every interval milliseconds if interval is not 0
+void qttimer_start(struct qttimer* t, unsigned int delay, unsigned int interval) {
+	qttimer_stop(t);
+	t->expires = qttimers.now + (delay ? delay : 1);
+	t->interval = interval;
+	qttimer_link(t);
+}
+
+static int qttimer_setup(const struct qtclock* clock) {
+	qttimers.now = qttimer_ms(&clock->monotonic);
+	qttimers.fd = -1;
+	qttimers.armed = 0;
+#ifdef linux
+	qttimers.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (qttimers.fd == -1) return -1;
+#endif
+	return 0;
+}
+
+//The earliest time at which a timer is due or a slot has to be cascaded, or 0 if there are no timers
+static u_int64_t qttimer_next() {
+	u_int64_t next = 0;
+	int level, i;
+	for (level = 0; level < QTTIMER_LEVELS; level++) {
+		int shift = QTTIMER_SLOTBITS * level;
+		u_int64_t base = qttimers.now >> shift;
+		for (i = 1; i <= QTTIMER_SLOTS; i++) {
+			if (!qttimers.slots[level][(base + i) & (QTTIMER_SLOTS - 1)]) continue;
+			u_int64_t when = (base + i) << shift;
+			if (!next || when < next) next = when;
+			break;
+		}
+	}
+	return next;
+}
+
+//Run the timers that are due up to now, also used to run them in simulated time (quicktun.bench -r)
+void qttimer_expire(u_int64_t now) {
+	int level;
+	while (qttimers.now < now) {
+		u_int64_t next = qttimer_next();
+		if (!next || next > now) {
+			qttimers.now = now;
+			break;
+		}
+		qttimers.now = next;
+		for (level = QTTIMER_LEVELS - 1; level > 0; level--) {
+			int shift = QTTIMER_SLOTBITS * level;
+			if (next & (((u_int64_t)1 << shift) - 1)) continue;
+			struct qttimer** slot = &qttimers.slots[level][(next >> shift) & (QTTIMER_SLOTS - 1)];
+			struct qttimer* list = *slot;
+			*slot = NULL;
+			if (list) list->pprev = &list;
+			while (list) {
+				struct qttimer* t = list;
+				qttimer_stop(t);
+				qttimer_link(t);
+			}
+		}
+		struct qttimer** slot = &qttimers.slots[0][next & (QTTIMER_SLOTS - 1)];
+		while (*slot) {
+			struct qttimer* t = *slot;
+			qttimer_stop(t);
+			if (t->interval) {
+				t->expires += t->interval;
+				if (t->expires <= qttimers.now) t->expires = qttimers.now + t->interval;
+				qttimer_link(t);
+			}
+			t->callback(t);
+		}
+	}
+}
+
+//Run the timers that are due and return the poll timeout in milliseconds until the next one, or -1. The timerfd is set up to wake up the loop instead when it is available.
+static int qttimer_run(const struct qtclock* clock, int fdreadable) {
+	u_int64_t now = qttimer_ms(&clock->monotonic);
+	if (fdreadable) {
+		u_int64_t expirations;
+		read(qttimers.fd, &expirations, sizeof(expirations));
+		//The coarse clock may lag behind the timerfd by a few milliseconds
+		if (qttimers.armed && now < qttimers.armed) now = qttimers.armed;
+		qttimers.armed = 0;
+	}
+	qttimer_expire(now);
+	u_int64_t next = qttimer_next();
+	if (qttimers.fd == -1) {
+		if (!next) return -1;
+		return (next - qttimers.now > 0x7fffffff) ? 0x7fffffff : (int)(next - qttimers.now);
+	}
+#ifdef linux
+	if (next != qttimers.armed) {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+		timerfd_settime(qttimers.fd, TFD_TIMER_ABSTIME, &its, NULL);
+		qttimers.armed = next;
+	}
+#endif
+	return -1;
+}
+
+#endif